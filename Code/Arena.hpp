@@ -0,0 +1,120 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Scene-lifetime monotonic allocator. Primitives, materials and BVH nodes are
+// placed one after another in large blocks and are never freed one by one:
+// release() (or the destructor) hands back a few blocks, whatever the scene size.
+
+struct ArenaStats
+{
+    size_t allocations = 0; // objects placed in the arena
+    size_t bytes = 0;       // bytes they use, alignment padding included
+    size_t blocks = 0;
+    size_t block_bytes = 0; // bytes reserved from the heap
+    size_t destructors = 0; // objects that need their destructor run on release
+};
+
+// Objects whose destructor would only drop pointers into the same arena can
+// simply be abandoned on release. Types opt in by specialising this.
+template <typename T>
+struct arena_skips_destructor : std::is_trivially_destructible<T>
+{
+};
+
+class Arena
+{
+public:
+    explicit Arena(size_t first_block_size = 64 << 10, size_t max_block_size = 16 << 20)
+        : next_block_size(first_block_size), first_block_size(first_block_size), max_block_size(max_block_size) {}
+    ~Arena() { release(); }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, size_t alignment)
+    {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~uintptr_t(alignment - 1);
+        if (!cursor || p + size > reinterpret_cast<uintptr_t>(limit))
+        {
+            // Blocks double up to a cap, so small scenes stay small and big
+            // ones need only a few dozen blocks.
+            size_t bytes = std::max(next_block_size, size + alignment);
+            next_block_size = std::min(next_block_size * 2, max_block_size);
+            blocks.emplace_back(new char[bytes]);
+            current_stats.block_bytes += bytes;
+            ++current_stats.blocks;
+            cursor = blocks.back().get();
+            limit = cursor + bytes;
+            p = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~uintptr_t(alignment - 1);
+        }
+        char *object = reinterpret_cast<char *>(p);
+        current_stats.bytes += (object + size) - cursor;
+        ++current_stats.allocations;
+        cursor = object + size;
+        return object;
+    }
+
+    // Objects holding resources outside the arena (a material's texture, say)
+    // get their destructor run by release(); the rest are just dropped.
+    template <typename T, typename... Args>
+    T *create(Args &&...args)
+    {
+        T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!arena_skips_destructor<T>::value)
+        {
+            destructors.push_back(Destructor{[](void *p)
+                                             { static_cast<T *>(p)->~T(); },
+                                             object});
+            ++current_stats.destructors;
+        }
+        return object;
+    }
+
+    // A shared_ptr that does not own (no control block, no reference count),
+    // so scene code written against shared_ptr works unchanged and copying
+    // these pointers per hit costs nothing. They must not outlive the arena.
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make_shared(Args &&...args)
+    {
+        return std::shared_ptr<T>(std::shared_ptr<T>(), create<T>(std::forward<Args>(args)...));
+    }
+
+    void release()
+    {
+        for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+            d->destroy(d->object);
+        destructors.clear();
+        blocks.clear();
+        cursor = limit = nullptr;
+        next_block_size = first_block_size;
+        current_stats = ArenaStats();
+    }
+
+    ArenaStats stats() const { return current_stats; }
+
+private:
+    struct Destructor
+    {
+        void (*destroy)(void *);
+        void *object;
+    };
+
+    size_t next_block_size, first_block_size, max_block_size;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cursor = nullptr, *limit = nullptr;
+    std::vector<Destructor> destructors;
+    ArenaStats current_stats;
+};
+
+// Places a scene object in the arena if there is one, on the heap otherwise.
+template <typename T, typename... Args>
+std::shared_ptr<T> arena_make_shared(Arena *arena, Args &&...args)
+{
+    return arena ? arena->make_shared<T>(std::forward<Args>(args)...) : std::make_shared<T>(std::forward<Args>(args)...);
+}
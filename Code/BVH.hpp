@@ -7,6 +7,7 @@
 #include "classbox_ab.hpp"
 #include "Hittable.hpp"
 #include "utility.hpp"
+#include "Arena.hpp"
 
 using std::make_shared;
 using std::shared_ptr;
@@ -20,10 +21,19 @@ public:
 
     BVHNode() {}
 
-    BVHNode(std::vector<shared_ptr<Hittable>> &objects, size_t start, size_t end, double time0, double time1);
+    // With an arena, the inner nodes are placed in it instead of on the heap.
+    BVHNode(std::vector<shared_ptr<Hittable>> &objects, size_t start, size_t end, double time0, double time1,
+            Arena *arena = nullptr);
 
     bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override;
     bool bounding_box(double t0, double t1, box_ab &output_box) const override;
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override;
+};
+
+// Nodes placed in an arena point only at things in the same arena.
+template <>
+struct arena_skips_destructor<BVHNode> : std::true_type
+{
 };
 
 inline bool box_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int axis)
@@ -41,23 +51,24 @@ inline bool box_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable>
         return box_a.min().z < box_b.min().z;
 }
 
-bool box_x_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
+inline bool box_x_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
 {
     return box_compare(a, b, 0);
 }
 
-bool box_y_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
+inline bool box_y_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b)
 {
     return box_compare(a, b, 1);
 }
 
-bool box_z_compare(const shared_ptr<Hittable> a,
+inline bool box_z_compare(const shared_ptr<Hittable> a,
                    const shared_ptr<Hittable> b)
 {
     return box_compare(a, b, 2);
 }
 
-BVHNode::BVHNode(std::vector<shared_ptr<Hittable>> &objects, size_t start, size_t end, double time0, double time1)
+inline BVHNode::BVHNode(std::vector<shared_ptr<Hittable>> &objects, size_t start, size_t end, double time0, double time1,
+                 Arena *arena)
 {
     int axis = random_int(0, 2);
     auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare
@@ -85,8 +96,8 @@ BVHNode::BVHNode(std::vector<shared_ptr<Hittable>> &objects, size_t start, size_
     {
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
         auto mid = start + object_span / 2;
-        left = make_shared<BVHNode>(objects, start, mid, time0, time1);
-        right = make_shared<BVHNode>(objects, mid, end, time0, time1);
+        left = arena_make_shared<BVHNode>(arena, objects, start, mid, time0, time1, arena);
+        right = arena_make_shared<BVHNode>(arena, objects, mid, end, time0, time1, arena);
     }
 
     box_ab box_left, box_right;
@@ -96,13 +107,13 @@ BVHNode::BVHNode(std::vector<shared_ptr<Hittable>> &objects, size_t start, size_
     box = surrounding_box(box_left, box_right);
 }
 
-bool BVHNode::bounding_box(double t0, double t1, box_ab &output_box) const
+inline bool BVHNode::bounding_box(double t0, double t1, box_ab &output_box) const
 {
     output_box = box;
     return true;
 }
 
-bool BVHNode::hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
+inline bool BVHNode::hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
 {
     if (!box.hit(r, t_min, t_max))
         return false;
@@ -111,4 +122,17 @@ bool BVHNode::hit(const Ray &r, double t_min, double t_max, Hit_record &rec) con
     bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
 
     return hit_left || hit_right;
-}
\ No newline at end of file
+}
+
+inline const Hittable *BVHNode::any_hit(const Ray &r, double t_min, double t_max) const
+{
+    if (!box.hit(r, t_min, t_max))
+        return nullptr;
+
+    // Any occluder will do, so stop at the first leaf that reports a hit.
+    if (const Hittable *occluder = left->any_hit(r, t_min, t_max))
+        return occluder;
+    if (right == left)
+        return nullptr;
+    return right->any_hit(r, t_min, t_max);
+}
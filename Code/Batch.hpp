@@ -0,0 +1,194 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "json/include/nlohmann/json.hpp"
+#include "Parallel.hpp"
+#include "Region.hpp"
+#include "Vector3.hpp"
+#include "utility.hpp"
+
+using json = nlohmann::json;
+using Color = Vector3;
+
+// Multi-view batches: several cameras over one loaded scene. The scene and its
+// acceleration structure are built once, and the tiles of every view go into
+// one queue, so threads move on to the next view instead of waiting at the end
+// of each image.
+
+inline json vector_json(const Vector3 &v) { return json::array({v.x, v.y, v.z}); }
+
+// The camera object of every view. "cameras" is an array of camera objects,
+// each patching the scene's "camera" (or, without one, the first entry).
+// "camera_path" generates views from the camera instead:
+//   {"type": "orbit", "frames": 36, "degrees": 360} turns the position about
+//   the lookAt point, around the up vector (a turntable);
+//   {"type": "linear", "frames": 10, "to": {...}} moves position, lookAt and
+//   fov to the values in "to", reaching them on the last frame.
+// Without either, the one "camera". All views share the image size. Empty,
+// with error set, if the file asks for something else.
+inline std::vector<json> camera_views(const json &j, std::string &error)
+{
+    bool has_list = j.contains("cameras"), has_path = j.contains("camera_path");
+    if (has_list && has_path)
+    {
+        error = "use either \"cameras\" or \"camera_path\", not both";
+        return {};
+    }
+    if (has_list && (!j["cameras"].is_array() || j["cameras"].empty() || !j["cameras"][0].is_object()))
+    {
+        error = "\"cameras\" must be a non-empty array of camera objects";
+        return {};
+    }
+    if (!j.contains("camera") && !has_list)
+    {
+        error = "the scene has no camera";
+        return {};
+    }
+    json base = j.contains("camera") ? j["camera"] : j["cameras"][0];
+
+    std::vector<json> views;
+    if (has_list)
+        for (const json &entry : j["cameras"])
+        {
+            json view = base;
+            view.update(entry);
+            views.push_back(view);
+        }
+    else if (has_path)
+    {
+        const json &path = j["camera_path"];
+        std::string type = path.value("type", "orbit");
+        int frames = path.value("frames", 0);
+        if (frames < 1 || (type != "orbit" && type != "linear"))
+        {
+            error = "\"camera_path\" needs a \"type\" of orbit or linear and at least one frame";
+            return {};
+        }
+        if (type == "linear" && !path.contains("to"))
+        {
+            error = "a linear \"camera_path\" needs a \"to\" camera";
+            return {};
+        }
+        Vector3 from = Vector3(base["position"]), center = Vector3(base["lookAt"]);
+        for (int k = 0; k < frames; ++k)
+        {
+            json view = base;
+            if (type == "orbit")
+            {
+                // Rodrigues' rotation of the offset from the centre about the up axis.
+                float angle = static_cast<float>(degrees_to_radians(path.value("degrees", 360.0) * k / frames));
+                Vector3 axis = Vector3(base["upVector"]).normalized(), offset = from - center;
+                Vector3 turned = offset * std::cos(angle) + axis.cross(offset) * std::sin(angle) +
+                                 axis * axis.dot(offset) * (1 - std::cos(angle));
+                view["position"] = vector_json(center + turned);
+            }
+            else
+            {
+                json to = base;
+                to.update(path["to"]);
+                float t = frames > 1 ? float(k) / (frames - 1) : 1.0f;
+                view["position"] = vector_json(from + (Vector3(to["position"]) - from) * t);
+                view["lookAt"] = vector_json(center + (Vector3(to["lookAt"]) - center) * t);
+                view["fov"] = base["fov"].get<float>() + (to["fov"].get<float>() - base["fov"].get<float>()) * t;
+            }
+            views.push_back(view);
+        }
+    }
+    else
+        views.push_back(base);
+
+    for (const json &view : views)
+        if (view.value("width", 0) != base.value("width", 0) || view.value("height", 0) != base.value("height", 0))
+        {
+            error = "all views must have the same width and height";
+            return {};
+        }
+    return views;
+}
+
+// "out.ppm" -> "out_007.ppm" for view 7 (more digits past 1000 views).
+inline std::string numbered_path(const std::string &path, size_t index, size_t count)
+{
+    std::string number = std::to_string(index);
+    size_t digits = std::max<size_t>(3, std::to_string(count - 1).size());
+    number.insert(0, digits - std::min(digits, number.size()), '0');
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+        return path + "_" + number;
+    return path.substr(0, dot) + "_" + number + path.substr(dot);
+}
+
+struct ViewStats
+{
+    size_t tiles = 0;
+    double started = 0, finished = 0; // seconds from the start of the batch
+    double busy_seconds = 0;          // summed over the threads that rendered its tiles
+};
+
+// Renders views images of width x height from one queue of (view, tile) jobs
+// on every hardware thread (or every thread of executor). render_tile(view, tile, framebuffer) adds the
+// tile's samples to the view's framebuffer (allocated on its first tile);
+// finish_view(view, framebuffer) is called by the thread that completes the
+// view's last tile, after which the buffer is released, so only the views in
+// flight are held in memory.
+template <typename RenderTile, typename FinishView>
+std::vector<ViewStats> render_views(size_t views, int width, int height, int tile_size, RenderTile render_tile,
+                                    FinishView finish_view, ChunkExecutor *executor = nullptr)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<Region> tiles;
+    for (int y = 0; y < height; y += tile_size)
+        for (int x = 0; x < width; x += tile_size)
+            tiles.push_back(Region{x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+
+    struct ViewState
+    {
+        std::once_flag allocated;
+        std::vector<Color> framebuffer;
+        std::atomic<size_t> tiles_left{0};
+    };
+    std::vector<ViewState> state(views);
+    for (ViewState &view : state)
+        view.tiles_left = tiles.size();
+
+    std::vector<ViewStats> stats(views);
+    std::mutex stats_mutex;
+    std::atomic<size_t> next{0};
+    auto batch_start = clock::now();
+    auto seconds = [&](clock::time_point t)
+    { return std::chrono::duration<double>(t - batch_start).count(); };
+
+    size_t threads = executor ? executor->thread_count() : worker_count();
+    parallel_chunks(threads, threads, [&](size_t, size_t, size_t)
+                    {
+        for (size_t job; (job = next.fetch_add(1)) < views * tiles.size();)
+        {
+            size_t v = job / tiles.size();
+            ViewState &view = state[v];
+            std::call_once(view.allocated, [&]
+                           { view.framebuffer.assign(size_t(width) * height, Color(0, 0, 0)); });
+            auto start = clock::now();
+            render_tile(v, tiles[job % tiles.size()], view.framebuffer);
+            auto end = clock::now();
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                ViewStats &s = stats[v];
+                s.started = s.tiles++ == 0 ? seconds(start) : std::min(s.started, seconds(start));
+                s.finished = std::max(s.finished, seconds(end));
+                s.busy_seconds += std::chrono::duration<double>(end - start).count();
+            }
+            if (view.tiles_left.fetch_sub(1) == 1)
+            {
+                finish_view(v, view.framebuffer);
+                std::vector<Color>().swap(view.framebuffer);
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                stats[v].finished = seconds(clock::now());
+            }
+        } }, executor);
+    return stats;
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <cmath> // For tan and other mathematical functions
 #include "utility.hpp"
+#include "Ray.hpp"
+#include "Sampler.hpp"
 
 class Camera
 {
@@ -39,9 +41,14 @@ public:
 
     Ray get_ray(double s, double t) const
     {
-        Vector3 rd = camera_radius * random_in_unit_disk();
+        // Lens position from the current camera sample (dimensions 2-3).
+        Vector2 lens = sample_2d();
+        Vector3 rd = camera_radius * sample_unit_disk(lens.x, lens.y);
         Vector3 offset = u * rd.x + v * rd.y;
-        return Ray(origin + offset, lowerLeftCorner + s * horizontal + t * vertical - origin - offset);
+        Ray ray(origin + offset, lowerLeftCorner + s * horizontal + t * vertical - origin - offset);
+        // One pixel's angular size, for mip selection.
+        ray.cone_spread = vertical.length() / height;
+        return ray;
     }
     float getCameraRadius() const
     {
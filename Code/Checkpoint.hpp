@@ -0,0 +1,241 @@
+#pragma once
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Region.hpp"
+#include "Vector3.hpp"
+
+using Color = Vector3;
+
+// Checkpoints of a long render: the summed framebuffer, how many samples each
+// pixel holds and where the sampler stands, so a render that gets killed can
+// carry on from its last checkpoint. Sample s of pixel (x, y) is seeded by
+// (x, y, s) alone (see seed_sample), and samples are added to a pixel one at a
+// time, so a resumed render ends bit for bit where an uninterrupted one would.
+
+struct RenderCheckpoint
+{
+    int width = 0, height = 0;
+    Region region;                // the pixels rendered; counts are 0 outside it
+    uint64_t fingerprint = 0;     // of the scene and the options that change the image
+    std::string sampler;          // name of the sampler the samples came from
+    std::vector<Color> pixels;    // summed radiance, width x height
+    std::vector<uint32_t> counts; // samples in each pixel, width x height
+
+    // The next sample index of every pixel in region if they all hold the
+    // same number of samples (the renderer works in whole passes), else -1.
+    int next_sample() const
+    {
+        int next = -1;
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                uint32_t count = counts[size_t(y) * width + x];
+                bool inside = x >= region.x0 && x < region.x1 && y >= region.y0 && y < region.y1;
+                if (!inside && count != 0)
+                    return -1;
+                if (inside && next < 0)
+                    next = int(count);
+                else if (inside && uint32_t(next) != count)
+                    return -1;
+            }
+        return next;
+    }
+};
+
+struct CheckpointSettings
+{
+    std::string path;         // where the checkpoints go
+    double seconds = 60;      // between checkpoints
+    uint64_t fingerprint = 0; // of the scene and options, see checkpoint_fingerprint
+};
+
+struct CheckpointedResult
+{
+    int samples = 0;          // per pixel in the framebuffer when the render ended
+    bool stopped = false;     // by a signal, before all samples were in
+    size_t written = 0;       // checkpoints on disk
+    bool write_failed = false; // at least one checkpoint could not be written
+};
+
+const char CHECKPOINT_MAGIC[8] = {'C', 'G', 'R', 'T', 'C', 'K', 'P', '1'};
+const size_t CHECKPOINT_SAMPLER_NAME = 16;
+
+// FNV-1a, for fingerprinting the scene file and options a checkpoint belongs to.
+inline uint64_t checkpoint_fingerprint(const std::string &text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text)
+        hash = (hash ^ c) * 1099511628211ull;
+    return hash;
+}
+
+// Written under path + ".tmp", flushed to disk and renamed, so a crash in the
+// middle leaves the previous checkpoint intact. Color components are floats,
+// stored as they are: reading them back gives exactly the same sums.
+inline bool write_checkpoint(const std::string &path, const RenderCheckpoint &checkpoint)
+{
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    std::FILE *out = fdopen(fd, "wb");
+    if (!out)
+    {
+        close(fd);
+        return false;
+    }
+
+    int32_t header[6] = {checkpoint.width, checkpoint.height, checkpoint.region.x0, checkpoint.region.y0,
+                         checkpoint.region.x1, checkpoint.region.y1};
+    char sampler[CHECKPOINT_SAMPLER_NAME] = {};
+    std::strncpy(sampler, checkpoint.sampler.c_str(), sizeof(sampler) - 1);
+    static_assert(sizeof(Color) == 3 * sizeof(float), "checkpoints store Color as three floats");
+    bool ok = std::fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC), out) == sizeof(CHECKPOINT_MAGIC) &&
+              std::fwrite(header, sizeof(header), 1, out) == 1 &&
+              std::fwrite(&checkpoint.fingerprint, sizeof(checkpoint.fingerprint), 1, out) == 1 &&
+              std::fwrite(sampler, 1, sizeof(sampler), out) == sizeof(sampler) &&
+              std::fwrite(checkpoint.pixels.data(), sizeof(Color), checkpoint.pixels.size(), out) == checkpoint.pixels.size() &&
+              std::fwrite(checkpoint.counts.data(), sizeof(uint32_t), checkpoint.counts.size(), out) == checkpoint.counts.size();
+    ok = std::fflush(out) == 0 && ok;
+    ok = fsync(fd) == 0 && ok;
+    ok = std::fclose(out) == 0 && ok;
+    return ok && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool read_checkpoint(const std::string &path, RenderCheckpoint &checkpoint)
+{
+    std::FILE *in = std::fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    int32_t header[6];
+    char sampler[CHECKPOINT_SAMPLER_NAME];
+    bool ok = std::fread(magic, 1, sizeof(magic), in) == sizeof(magic) && std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0 &&
+              std::fread(header, sizeof(header), 1, in) == 1 &&
+              std::fread(&checkpoint.fingerprint, sizeof(checkpoint.fingerprint), 1, in) == 1 &&
+              std::fread(sampler, 1, sizeof(sampler), in) == sizeof(sampler);
+    if (ok)
+    {
+        checkpoint.width = header[0];
+        checkpoint.height = header[1];
+        checkpoint.region = Region{header[2], header[3], header[4], header[5]};
+        sampler[sizeof(sampler) - 1] = '\0';
+        checkpoint.sampler = sampler;
+        ok = checkpoint.width > 0 && checkpoint.height > 0 && !checkpoint.region.empty() &&
+             checkpoint.region.x1 <= checkpoint.width && checkpoint.region.y1 <= checkpoint.height;
+    }
+    if (ok)
+    {
+        size_t pixels = size_t(checkpoint.width) * checkpoint.height;
+        checkpoint.pixels.resize(pixels);
+        checkpoint.counts.resize(pixels);
+        ok = std::fread(checkpoint.pixels.data(), sizeof(Color), pixels, in) == pixels &&
+             std::fread(checkpoint.counts.data(), sizeof(uint32_t), pixels, in) == pixels;
+    }
+    std::fclose(in);
+    return ok;
+}
+
+// Writes checkpoints on a thread of its own, so the render only pays for the
+// copy handed to save(). If a write is still going when the next checkpoint
+// comes in, the newer one replaces any that is still waiting.
+class CheckpointWriter
+{
+public:
+    explicit CheckpointWriter(std::string checkpoint_path)
+        : path(std::move(checkpoint_path)), thread([this]
+                                                   { run(); })
+    {
+    }
+
+    ~CheckpointWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    void save(RenderCheckpoint checkpoint)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = std::move(checkpoint);
+            has_pending = true;
+        }
+        wake.notify_all();
+    }
+
+    // Waits until everything saved so far is on disk; false if a write failed.
+    bool wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]
+                  { return !has_pending && !writing; });
+        return !failed;
+    }
+
+    size_t written() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return writes;
+    }
+
+private:
+    std::string path;
+    mutable std::mutex mutex;
+    std::condition_variable wake, done;
+    RenderCheckpoint pending;
+    bool has_pending = false, writing = false, stopping = false, failed = false;
+    size_t writes = 0;
+    std::thread thread; // declared last: started once the rest is set up
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this]
+                      { return has_pending || stopping; });
+            if (!has_pending)
+                return;
+            RenderCheckpoint checkpoint = std::move(pending);
+            has_pending = false;
+            writing = true;
+            lock.unlock();
+            bool ok = write_checkpoint(path, checkpoint);
+            lock.lock();
+            writing = false;
+            failed = failed || !ok;
+            writes += ok;
+            done.notify_all();
+        }
+    }
+};
+
+// Set by SIGTERM (what a spot instance gets before it is taken away) and
+// SIGINT while a checkpointed render runs: it stops after the current pass
+// with a final checkpoint.
+inline volatile std::sig_atomic_t &checkpoint_stop_flag()
+{
+    static volatile std::sig_atomic_t flag = 0;
+    return flag;
+}
+
+inline void checkpoint_on_signal(int signal)
+{
+    checkpoint_stop_flag() = 1;
+    // A second signal ends the process as usual.
+    std::signal(signal, SIG_DFL);
+}
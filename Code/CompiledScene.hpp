@@ -0,0 +1,819 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include "BVH.hpp"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+#include "Cylinder.hpp"
+
+// A scene compiled for tracing: every primitive is copied into a pool for its
+// type with whatever its hit test can precompute, and the BVH is flattened into
+// an array whose children name either another node or a primitive by a type
+// tag and pool index. Traversal and leaf tests make no virtual calls; only
+// shapes of a type without a pool (CHILD_OTHER) still go through Hittable::hit.
+
+enum PrimitiveTag : uint32_t
+{
+    CHILD_SPHERE = 0,
+    CHILD_TRIANGLE = 1,
+    CHILD_CYLINDER = 2,
+    CHILD_OTHER = 3,
+};
+
+// Child reference: bit 31 set for a primitive, with the tag in bits 29-30 and
+// the pool index below; otherwise a node index.
+const uint32_t CHILD_PRIMITIVE_BIT = 1u << 31;
+
+inline uint32_t primitive_child(PrimitiveTag tag, uint32_t index)
+{
+    return CHILD_PRIMITIVE_BIT | (uint32_t(tag) << 29) | index;
+}
+
+struct CompiledSphere
+{
+    Vector3 center;
+    float radius_sq, inv_radius;
+    float uv_per_unit;
+    uint32_t material;
+    const Hittable *source;
+};
+
+struct CompiledTriangle
+{
+    Vector3 v0, edge1, edge2; // Moller-Trumbore setup
+    Vector3 normal;           // unit, (v1 - v0) x (v2 - v0)
+    Vector2 t0, t1, t2;
+    float uv_per_unit;
+    uint32_t material;
+    const Hittable *source;
+};
+
+struct CompiledCylinder
+{
+    Vector3 base_center, top_center, axis;
+    float radius_sq, height2; // height2: the full length, 2 * height
+    float base_plane, top_plane; // cap planes as axis . p = d
+    uint32_t material;
+    const Hittable *source;
+};
+
+struct CompiledNode
+{
+    Vector3 box_min, box_max;
+    uint32_t left, right;
+};
+
+// Four-wide node whose children's boxes are stored as 8-bit steps of 2^exponent
+// from origin, per axis. Lower bounds are rounded down and upper bounds up, so
+// a decoded box always contains the real one. 56 bytes against 4 * 32 for the
+// CompiledNodes it replaces.
+struct QuantizedNode
+{
+    Vector3 origin;
+    int8_t exponent[3];
+    uint8_t child_count;
+    uint8_t lo[3][4], hi[3][4]; // [axis][child]
+    uint32_t child[4];          // same encoding as CompiledNode children
+};
+
+// 2^e as a float, straight from the exponent bits (e in [-126, 127]).
+inline float exp2_int(int e)
+{
+    uint32_t bits = uint32_t(e + 127) << 23;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+struct CompiledSceneStats
+{
+    size_t spheres = 0, triangles = 0, cylinders = 0, others = 0, nodes = 0;
+    size_t node_bytes = 0;
+    size_t bytes = 0;
+};
+
+// Ray data the slab test reuses for every node.
+struct RaySlabs
+{
+    Vector3 origin, inv_direction;
+    explicit RaySlabs(const Ray &r)
+        : origin(r.origin), inv_direction(1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z) {}
+
+    bool hit(const CompiledNode &node, double t_min, double t_max) const
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float inv = (&inv_direction.x)[a], o = (&origin.x)[a];
+            float t0 = ((&node.box_min.x)[a] - o) * inv;
+            float t1 = ((&node.box_max.x)[a] - o) * inv;
+            t_min = std::fmax(std::fmin(t0, t1), t_min);
+            t_max = std::fmin(std::fmax(t0, t1), t_max);
+            if (t_max <= t_min)
+                return false;
+        }
+        return true;
+    }
+};
+
+// The flat arrays of a compiled scene, wherever they live: CompiledScene's
+// own vectors, or a chunk mapped from disk (OutOfCore.hpp).
+struct CompiledArrays
+{
+    const CompiledNode *nodes;
+    const CompiledSphere *spheres;
+    const CompiledTriangle *triangles;
+    const CompiledCylinder *cylinders;
+    const Hittable *const *others;
+    const shared_ptr<Material> *materials;
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
+    {
+        RaySlabs slabs(r);
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        bool hit_anything = false;
+
+        // Depth first, left before right, tightening t_max as BVHNode::hit does.
+        while (top > 0)
+        {
+            uint32_t child = stack[--top];
+            if (child & CHILD_PRIMITIVE_BIT)
+            {
+                if (hit_primitive(child, r, t_min, t_max, rec))
+                {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+                continue;
+            }
+            const CompiledNode &node = nodes[child];
+            if (!slabs.hit(node, t_min, t_max))
+                continue;
+            if (node.right != node.left)
+                stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
+        return hit_anything;
+    }
+
+    // The primitive child the ray hits first in the traversal order, or 0 if none.
+    uint32_t any_hit(const Ray &r, double t_min, double t_max) const
+    {
+        RaySlabs slabs(r);
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        Hit_record rec;
+
+        while (top > 0)
+        {
+            uint32_t child = stack[--top];
+            if (child & CHILD_PRIMITIVE_BIT)
+            {
+                if (hit_primitive(child, r, t_min, t_max, rec))
+                    return child;
+                continue;
+            }
+            const CompiledNode &node = nodes[child];
+            if (!slabs.hit(node, t_min, t_max))
+                continue;
+            if (node.right != node.left)
+                stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
+        return 0;
+    }
+
+    bool hit_primitive(uint32_t child, const Ray &r, double t_min, double t_max, Hit_record &rec) const
+    {
+        uint32_t index = child & ((1u << 29) - 1);
+        switch ((child >> 29) & 3)
+        {
+        case CHILD_SPHERE:
+            return hit_sphere(spheres[index], r, t_min, t_max, rec);
+        case CHILD_TRIANGLE:
+            return hit_triangle(triangles[index], r, t_min, t_max, rec);
+        case CHILD_CYLINDER:
+            return hit_cylinder(cylinders[index], r, t_min, t_max, rec);
+        default:
+            return others[index]->hit(r, t_min, t_max, rec);
+        }
+    }
+
+    // The three tests below give the same hits as Sphere/Triangle/Cylinder::hit.
+
+    bool hit_sphere(const CompiledSphere &s, const Ray &r, double t_min, double t_max, Hit_record &rec) const
+    {
+        Vector3 oc = r.origin - s.center;
+        auto a = r.direction.length_squared();
+        auto half_b = oc.dot(r.direction);
+        auto c = oc.length_squared() - s.radius_sq;
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant <= 0)
+            return false;
+
+        auto sqrt_d = sqrt(discriminant);
+        auto root = (-half_b - sqrt_d) / a;
+        if (root < t_min || root > t_max)
+        {
+            root = (-half_b + sqrt_d) / a;
+            if (root < t_min || root > t_max)
+                return false;
+        }
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        Vector3 outward_normal = (rec.p - s.center) * s.inv_radius;
+        rec.set_face_normal(r, outward_normal);
+        rec.material_ptr = materials[s.material];
+
+        float theta = std::acos(clamp(-outward_normal.y, -1.0, 1.0));
+        float phi = std::atan2(-outward_normal.z, outward_normal.x) + pi;
+        rec.uv = Vector2(phi / (2 * pi), theta / pi);
+        rec.uv_per_unit = s.uv_per_unit;
+        return true;
+    }
+
+    bool hit_triangle(const CompiledTriangle &tri, const Ray &r, double t_min, double t_max, Hit_record &rec) const
+    {
+        const double EPSILON = 1e-6;
+        Vector3 h = r.direction.cross(tri.edge2);
+        double a = tri.edge1.dot(h);
+        if (a > -EPSILON && a < EPSILON)
+            return false;
+
+        double f = 1.0 / a;
+        Vector3 s = r.origin - tri.v0;
+        double u = f * s.dot(h);
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        Vector3 q = s.cross(tri.edge1);
+        double v = f * r.direction.dot(q);
+        if (v < 0.0 || u + v > 1.0)
+            return false;
+
+        double t = f * tri.edge2.dot(q);
+        if (t < t_min || t > t_max)
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, tri.normal);
+        rec.material_ptr = materials[tri.material];
+        rec.uv = tri.t0 * (1 - u - v) + tri.t1 * u + tri.t2 * v;
+        rec.uv_per_unit = tri.uv_per_unit;
+        return true;
+    }
+
+    bool hit_cylinder(const CompiledCylinder &cyl, const Ray &r, double t_min, double t_max, Hit_record &rec) const
+    {
+        Vector3 oc = r.origin - cyl.base_center;
+        float axis_dot_dir = cyl.axis.dot(r.direction);
+        Vector3 d = r.direction - cyl.axis * axis_dot_dir;
+        Vector3 v = oc - cyl.axis * cyl.axis.dot(oc);
+
+        double a = d.dot(d);
+        double half_b = v.dot(d);
+        double c = v.dot(v) - cyl.radius_sq;
+        double discriminant = half_b * half_b - a * c;
+
+        if (discriminant > 0)
+        {
+            double sqrt_d = std::sqrt(discriminant);
+            double t = (-half_b - sqrt_d) / a;
+            bool in_range = t >= t_min && t <= t_max;
+            if (!in_range)
+            {
+                t = (-half_b + sqrt_d) / a;
+                in_range = t >= t_min && t <= t_max;
+            }
+            // Like Cylinder::hit, a wall root out of range means no hit at all.
+            if (!in_range)
+                return false;
+
+            Vector3 hit_point = r.at(t);
+            double projection = (hit_point - cyl.base_center).dot(cyl.axis);
+            if (projection >= 0 && projection <= cyl.height2)
+            {
+                rec.t = t;
+                rec.p = hit_point;
+                rec.normal = ((hit_point - cyl.base_center) - cyl.axis * projection).normalized();
+                rec.material_ptr = materials[cyl.material];
+                return true;
+            }
+        }
+
+        // Caps: bottom first, then top, each against the full interval.
+        if (std::fabs(axis_dot_dir) <= 1e-6)
+            return false;
+        double origin_along_axis = r.origin.dot(cyl.axis);
+        for (int cap = 0; cap < 2; ++cap)
+        {
+            double t = ((cap ? cyl.top_plane : cyl.base_plane) - origin_along_axis) / axis_dot_dir;
+            if (t < t_min || t > t_max)
+                continue;
+            Vector3 point = r.at(t);
+            if ((point - (cap ? cyl.top_center : cyl.base_center)).length_squared() <= cyl.radius_sq)
+            {
+                rec.t = t;
+                rec.p = point;
+                rec.normal = cap ? cyl.axis : -cyl.axis;
+                rec.material_ptr = materials[cyl.material];
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+class CompiledScene : public Hittable
+{
+public:
+    // Compiles the tree under root; root must outlive this for CHILD_OTHER leaves.
+    // With quantize, the nodes are stored as QuantizedNodes instead.
+    explicit CompiledScene(const BVHNode &root, bool quantize = false)
+    {
+        compile_node(root);
+        root_box = box_ab(nodes[0].box_min, nodes[0].box_max);
+        built_area = node_area();
+        if (quantize)
+        {
+            quantize_node(0);
+            std::vector<CompiledNode>().swap(nodes);
+        }
+    }
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
+    {
+        if (!quantized_nodes.empty())
+            return traverse_quantized(r, t_min, t_max, rec, nullptr);
+        return arrays().hit(r, t_min, t_max, rec);
+    }
+
+    // Returns the original shape, so ShadowCache can keep it as the occluder.
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override
+    {
+        if (!quantized_nodes.empty())
+        {
+            const Hittable *occluder = nullptr;
+            Hit_record rec;
+            traverse_quantized(r, t_min, t_max, rec, &occluder);
+            return occluder;
+        }
+        uint32_t child = arrays().any_hit(r, t_min, t_max);
+        return child ? source(child) : nullptr;
+    }
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        output_box = root_box;
+        return true;
+    }
+
+    // Valid unless quantized; material indices refer to arrays().materials.
+    CompiledArrays arrays() const
+    {
+        return CompiledArrays{nodes.data(), spheres.data(), triangles.data(), cylinders.data(), others.data(), materials.data()};
+    }
+
+    // Every primitive as a child reference, for other structures over the same pools.
+    std::vector<uint32_t> primitives() const
+    {
+        std::vector<uint32_t> refs;
+        refs.reserve(spheres.size() + triangles.size() + cylinders.size() + others.size());
+        for (size_t i = 0; i < spheres.size(); ++i)
+            refs.push_back(primitive_child(CHILD_SPHERE, static_cast<uint32_t>(i)));
+        for (size_t i = 0; i < triangles.size(); ++i)
+            refs.push_back(primitive_child(CHILD_TRIANGLE, static_cast<uint32_t>(i)));
+        for (size_t i = 0; i < cylinders.size(); ++i)
+            refs.push_back(primitive_child(CHILD_CYLINDER, static_cast<uint32_t>(i)));
+        for (size_t i = 0; i < others.size(); ++i)
+            refs.push_back(primitive_child(CHILD_OTHER, static_cast<uint32_t>(i)));
+        return refs;
+    }
+
+    // The shape a primitive was compiled from.
+    const Hittable *source(uint32_t child) const
+    {
+        uint32_t index = child & ((1u << 29) - 1);
+        switch ((child >> 29) & 3)
+        {
+        case CHILD_SPHERE:
+            return spheres[index].source;
+        case CHILD_TRIANGLE:
+            return triangles[index].source;
+        case CHILD_CYLINDER:
+            return cylinders[index].source;
+        default:
+            return others[index];
+        }
+    }
+
+    // Tight boxes: triangles by their vertices, cylinders by their cap discs.
+    void leaf_bounds(uint32_t reference, Vector3 &box_min, Vector3 &box_max) const
+    {
+        uint32_t index = reference & ((1u << 29) - 1);
+        switch ((reference >> 29) & 3)
+        {
+        case CHILD_SPHERE:
+        {
+            const CompiledSphere &s = spheres[index];
+            float r = 1.0f / s.inv_radius;
+            box_min = s.center - Vector3(r, r, r);
+            box_max = s.center + Vector3(r, r, r);
+            break;
+        }
+        case CHILD_TRIANGLE:
+        {
+            const CompiledTriangle &t = triangles[index];
+            Vector3 p1 = t.v0 + t.edge1, p2 = t.v0 + t.edge2;
+            box_min = Vector3(std::fmin(t.v0.x, std::fmin(p1.x, p2.x)), std::fmin(t.v0.y, std::fmin(p1.y, p2.y)), std::fmin(t.v0.z, std::fmin(p1.z, p2.z)));
+            box_max = Vector3(std::fmax(t.v0.x, std::fmax(p1.x, p2.x)), std::fmax(t.v0.y, std::fmax(p1.y, p2.y)), std::fmax(t.v0.z, std::fmax(p1.z, p2.z)));
+            // An axis-aligned triangle has a flat box, which the slab test
+            // never hits; give it some thickness.
+            const Vector3 pad(1e-4f, 1e-4f, 1e-4f);
+            box_min = box_min - pad;
+            box_max = box_max + pad;
+            break;
+        }
+        case CHILD_CYLINDER:
+        {
+            // A disc of radius r around axis a reaches r * sqrt(1 - a_i^2) along axis i.
+            const CompiledCylinder &c = cylinders[index];
+            float r = std::sqrt(c.radius_sq);
+            Vector3 reach(r * std::sqrt(std::fmax(0.0f, 1 - c.axis.x * c.axis.x)),
+                          r * std::sqrt(std::fmax(0.0f, 1 - c.axis.y * c.axis.y)),
+                          r * std::sqrt(std::fmax(0.0f, 1 - c.axis.z * c.axis.z)));
+            box_min = Vector3(std::fmin(c.base_center.x, c.top_center.x), std::fmin(c.base_center.y, c.top_center.y), std::fmin(c.base_center.z, c.top_center.z)) - reach;
+            box_max = Vector3(std::fmax(c.base_center.x, c.top_center.x), std::fmax(c.base_center.y, c.top_center.y), std::fmax(c.base_center.z, c.top_center.z)) + reach;
+            break;
+        }
+        default:
+        {
+            box_ab box;
+            others[index]->bounding_box(0, 0, box);
+            box_min = box.min();
+            box_max = box.max();
+        }
+        }
+    }
+
+    // Copies a shape's current geometry and material into its compiled
+    // primitive, after the shape was changed in place. Node boxes are left
+    // alone until refit(). False if the shape is not in this scene.
+    bool refresh(const Hittable *shape)
+    {
+        auto found = compiled_leaves.find(shape);
+        if (found == compiled_leaves.end())
+            return false;
+        uint32_t index = found->second & ((1u << 29) - 1);
+        switch ((found->second >> 29) & 3)
+        {
+        case CHILD_SPHERE:
+            spheres[index] = compile(*static_cast<const Sphere *>(shape));
+            break;
+        case CHILD_TRIANGLE:
+            triangles[index] = compile(*static_cast<const Triangle *>(shape));
+            break;
+        case CHILD_CYLINDER:
+            cylinders[index] = compile(*static_cast<const Cylinder *>(shape));
+            break;
+        }
+        return true;
+    }
+
+    // Recomputes every node box from its children, keeping the tree's shape.
+    // Children come after their parent, so one backwards pass does it.
+    // Returns how much the summed node area grew against the original build;
+    // the tree should be rebuilt once that gets large. Not for quantized scenes.
+    double refit()
+    {
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            Vector3 left_min, left_max, right_min, right_max;
+            child_bounds(nodes[i].left, left_min, left_max);
+            child_bounds(nodes[i].right, right_min, right_max);
+            nodes[i].box_min = Vector3(std::fmin(left_min.x, right_min.x), std::fmin(left_min.y, right_min.y), std::fmin(left_min.z, right_min.z));
+            nodes[i].box_max = Vector3(std::fmax(left_max.x, right_max.x), std::fmax(left_max.y, right_max.y), std::fmax(left_max.z, right_max.z));
+        }
+        root_box = box_ab(nodes[0].box_min, nodes[0].box_max);
+        return built_area > 0 ? node_area() / built_area : 1;
+    }
+
+    bool quantized() const { return !quantized_nodes.empty(); }
+
+    CompiledSceneStats stats() const
+    {
+        CompiledSceneStats s;
+        s.spheres = spheres.size();
+        s.triangles = triangles.size();
+        s.cylinders = cylinders.size();
+        s.others = others.size();
+        s.nodes = nodes.size() + quantized_nodes.size();
+        s.node_bytes = nodes.size() * sizeof(CompiledNode) + quantized_nodes.size() * sizeof(QuantizedNode);
+        s.bytes = spheres.size() * sizeof(CompiledSphere) + triangles.size() * sizeof(CompiledTriangle) +
+                  cylinders.size() * sizeof(CompiledCylinder) + s.node_bytes +
+                  others.size() * sizeof(const Hittable *) + materials.size() * sizeof(shared_ptr<Material>);
+        return s;
+    }
+
+private:
+    std::vector<CompiledNode> nodes; // emptied once quantized
+    std::vector<QuantizedNode> quantized_nodes;
+    box_ab root_box;
+    std::vector<CompiledSphere> spheres;
+    std::vector<CompiledTriangle> triangles;
+    std::vector<CompiledCylinder> cylinders;
+    std::vector<const Hittable *> others;
+    std::vector<shared_ptr<Material>> materials;
+    std::unordered_map<const Material *, uint32_t> material_index;
+    std::unordered_map<const Hittable *, uint32_t> compiled_leaves; // a shape can be both children of a node
+    double built_area = 0;
+
+    void child_bounds(uint32_t child, Vector3 &box_min, Vector3 &box_max) const
+    {
+        if (child & CHILD_PRIMITIVE_BIT)
+            leaf_bounds(child, box_min, box_max);
+        else
+        {
+            box_min = nodes[child].box_min;
+            box_max = nodes[child].box_max;
+        }
+    }
+
+    double node_area() const
+    {
+        double area = 0;
+        for (const CompiledNode &node : nodes)
+        {
+            Vector3 d = node.box_max - node.box_min;
+            area += double(d.x) * d.y + double(d.y) * d.z + double(d.z) * d.x;
+        }
+        return area;
+    }
+
+
+    uint32_t add_material(const shared_ptr<Material> &material)
+    {
+        auto found = material_index.find(material.get());
+        if (found != material_index.end())
+            return found->second;
+        materials.push_back(material);
+        return material_index[material.get()] = static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    CompiledSphere compile(const Sphere &s)
+    {
+        return CompiledSphere{s.center, s.radius * s.radius, 1.0f / s.radius,
+                              static_cast<float>(1.0 / (pi * s.radius)), add_material(s.material_ptr), &s};
+    }
+
+    CompiledTriangle compile(const Triangle &t)
+    {
+        Vector3 edge1 = t.v2 - t.v1, edge2 = t.v3 - t.v1;
+        Vector3 cross = edge1.cross(edge2);
+        double world_area = cross.length();
+        double uv_area = std::fabs((t.t2 - t.t1).x * (t.t3 - t.t1).y - (t.t2 - t.t1).y * (t.t3 - t.t1).x);
+        return CompiledTriangle{t.v1, edge1, edge2, cross.normalized(), t.t1, t.t2, t.t3,
+                                static_cast<float>(world_area > 0 ? std::sqrt(uv_area / world_area) : 0),
+                                add_material(t.material_ptr), &t};
+    }
+
+    CompiledCylinder compile(const Cylinder &c)
+    {
+        Vector3 base = c.center - c.height * c.axis, top = c.center + c.height * c.axis;
+        return CompiledCylinder{base, top, c.axis, static_cast<float>(c.radius * c.radius),
+                                static_cast<float>(2 * c.height), base.dot(c.axis), top.dot(c.axis),
+                                add_material(c.material_ptr), &c};
+    }
+
+    // Compiles one child of a BVHNode and returns its reference and tight bounds.
+    uint32_t compile_child(const shared_ptr<Hittable> &child, Vector3 &box_min, Vector3 &box_max)
+    {
+        if (auto node = dynamic_cast<const BVHNode *>(child.get()))
+        {
+            uint32_t index = compile_node(*node);
+            box_min = nodes[index].box_min;
+            box_max = nodes[index].box_max;
+            return index;
+        }
+
+        uint32_t reference;
+        auto found = compiled_leaves.find(child.get());
+        if (found != compiled_leaves.end())
+            reference = found->second;
+        else if (auto s = dynamic_cast<const Sphere *>(child.get()))
+        {
+            spheres.push_back(compile(*s));
+            reference = primitive_child(CHILD_SPHERE, spheres.size() - 1);
+        }
+        else if (auto t = dynamic_cast<const Triangle *>(child.get()))
+        {
+            triangles.push_back(compile(*t));
+            reference = primitive_child(CHILD_TRIANGLE, triangles.size() - 1);
+        }
+        else if (auto c = dynamic_cast<const Cylinder *>(child.get()))
+        {
+            cylinders.push_back(compile(*c));
+            reference = primitive_child(CHILD_CYLINDER, cylinders.size() - 1);
+        }
+        else
+        {
+            others.push_back(child.get());
+            reference = primitive_child(CHILD_OTHER, others.size() - 1);
+        }
+        compiled_leaves[child.get()] = reference;
+        leaf_bounds(reference, box_min, box_max);
+        return reference;
+    }
+
+
+    uint32_t compile_node(const BVHNode &node)
+    {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        Vector3 left_min, left_max, right_min, right_max;
+        uint32_t left = compile_child(node.left, left_min, left_max);
+        uint32_t right = node.right == node.left ? left : compile_child(node.right, right_min, right_max);
+        if (right == left)
+        {
+            right_min = left_min;
+            right_max = left_max;
+        }
+
+        CompiledNode &compiled = nodes[index];
+        compiled.left = left;
+        compiled.right = right;
+        compiled.box_min = Vector3(std::fmin(left_min.x, right_min.x), std::fmin(left_min.y, right_min.y), std::fmin(left_min.z, right_min.z));
+        compiled.box_max = Vector3(std::fmax(left_max.x, right_max.x), std::fmax(left_max.y, right_max.y), std::fmax(left_max.z, right_max.z));
+        return index;
+    }
+
+    // Turns binary node index (and the nodes under it) into QuantizedNodes:
+    // the largest inner child is opened until there are four children or
+    // only primitives are left.
+    uint32_t quantize_node(uint32_t index)
+    {
+        uint32_t children[4];
+        Vector3 mins[4], maxs[4];
+        int count = 0;
+        auto add = [&](uint32_t child)
+        {
+            children[count] = child;
+            if (child & CHILD_PRIMITIVE_BIT)
+                leaf_bounds(child, mins[count], maxs[count]);
+            else
+            {
+                mins[count] = nodes[child].box_min;
+                maxs[count] = nodes[child].box_max;
+            }
+            ++count;
+        };
+        add(nodes[index].left);
+        if (nodes[index].right != nodes[index].left)
+            add(nodes[index].right);
+
+        while (count < 4)
+        {
+            int best = -1;
+            float best_area = -1;
+            for (int i = 0; i < count; ++i)
+            {
+                if (children[i] & CHILD_PRIMITIVE_BIT)
+                    continue;
+                Vector3 d = maxs[i] - mins[i];
+                float area = d.x * d.y + d.y * d.z + d.z * d.x;
+                if (area > best_area)
+                {
+                    best = i;
+                    best_area = area;
+                }
+            }
+            if (best < 0)
+                break;
+            const CompiledNode &open = nodes[children[best]];
+            uint32_t left = open.left, right = open.right;
+            // Replace the opened node by its left child and append the right one.
+            children[best] = children[--count];
+            mins[best] = mins[count];
+            maxs[best] = maxs[count];
+            add(left);
+            if (right != left)
+                add(right);
+        }
+
+        uint32_t quantized = static_cast<uint32_t>(quantized_nodes.size());
+        quantized_nodes.emplace_back();
+        QuantizedNode node{};
+        node.child_count = static_cast<uint8_t>(count);
+        node.origin = mins[0];
+        Vector3 high = maxs[0];
+        for (int i = 1; i < count; ++i)
+        {
+            node.origin = Vector3(std::fmin(node.origin.x, mins[i].x), std::fmin(node.origin.y, mins[i].y), std::fmin(node.origin.z, mins[i].z));
+            high = Vector3(std::fmax(high.x, maxs[i].x), std::fmax(high.y, maxs[i].y), std::fmax(high.z, maxs[i].z));
+        }
+
+        for (int a = 0; a < 3; ++a)
+        {
+            float origin = (&node.origin.x)[a];
+            // The smallest power of two for which 255 steps cover the node.
+            float extent = (&high.x)[a] - origin;
+            int e = extent > 0 ? std::ilogb(extent / 255) : -126;
+            while (e < 127 && 255 * exp2_int(e) < extent)
+                ++e;
+            e = std::max(-126, std::min(127, e));
+            node.exponent[a] = static_cast<int8_t>(e);
+            float scale = exp2_int(e);
+
+            for (int i = 0; i < count; ++i)
+            {
+                // Round outwards, checked with the arithmetic traversal decodes with.
+                float low_bound = (&mins[i].x)[a], high_bound = (&maxs[i].x)[a];
+                int lo = std::max(0, std::min(255, static_cast<int>(std::floor((low_bound - origin) / scale))));
+                while (lo > 0 && origin + lo * scale > low_bound)
+                    --lo;
+                int hi = std::max(0, std::min(255, static_cast<int>(std::ceil((high_bound - origin) / scale))));
+                while (hi < 255 && origin + hi * scale < high_bound)
+                    ++hi;
+                node.lo[a][i] = static_cast<uint8_t>(lo);
+                node.hi[a][i] = static_cast<uint8_t>(hi);
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+            node.child[i] = children[i] & CHILD_PRIMITIVE_BIT ? children[i] : quantize_node(children[i]);
+        quantized_nodes[quantized] = node;
+        return quantized;
+    }
+
+    // Closest hit into rec, or with occluder set, the first hit found into *occluder.
+    // Children's boxes are decoded as they are tested, nearest pushed last.
+    bool traverse_quantized(const Ray &r, double t_min, double t_max, Hit_record &rec, const Hittable **occluder) const
+    {
+        struct Entry
+        {
+            uint32_t child;
+            float t;
+        };
+        Entry stack[128];
+        int top = 0;
+        stack[top++] = Entry{0, static_cast<float>(t_min)};
+        Vector3 inv(1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z);
+        bool hit_anything = false;
+
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            // Entered past the closest hit found since it was pushed.
+            if (entry.t > t_max)
+                continue;
+            if (entry.child & CHILD_PRIMITIVE_BIT)
+            {
+                if (arrays().hit_primitive(entry.child, r, t_min, t_max, rec))
+                {
+                    if (occluder)
+                    {
+                        *occluder = source(entry.child);
+                        return true;
+                    }
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+                continue;
+            }
+
+            const QuantizedNode &node = quantized_nodes[entry.child];
+            float scale[3] = {exp2_int(node.exponent[0]), exp2_int(node.exponent[1]), exp2_int(node.exponent[2])};
+            Entry hits[4];
+            int count = 0;
+            for (int c = 0; c < node.child_count; ++c)
+            {
+                double near = t_min, far = t_max;
+                for (int a = 0; a < 3 && near < far; ++a)
+                {
+                    float origin = (&node.origin.x)[a], o = (&r.origin.x)[a], ia = (&inv.x)[a];
+                    float t0 = (origin + node.lo[a][c] * scale[a] - o) * ia;
+                    float t1 = (origin + node.hi[a][c] * scale[a] - o) * ia;
+                    near = std::fmax(std::fmin(t0, t1), near);
+                    far = std::fmin(std::fmax(t0, t1), far);
+                }
+                if (far <= near)
+                    continue;
+                // Insertion sort, farthest first.
+                int k = count++;
+                for (; k > 0 && hits[k - 1].t < near; --k)
+                    hits[k] = hits[k - 1];
+                hits[k] = Entry{node.child[c], static_cast<float>(near)};
+            }
+            for (int k = 0; k < count; ++k)
+                stack[top++] = hits[k];
+        }
+        return hit_anything;
+    }
+};
@@ -71,6 +71,8 @@ public:
         return false;
     }
 
+    void translate(const Vector3 &offset) override { center += offset; }
+
     virtual bool bounding_box(double t0, double t1, box_ab &output_box) const override
     {
         Vector3 base_center = center - height * axis;
@@ -0,0 +1,263 @@
+#pragma once
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "Parallel.hpp"
+#include "Vector3.hpp"
+
+using Color = Vector3;
+
+// Auxiliary buffers (AOVs) written next to the colour framebuffer, and an
+// edge-avoiding a-trous wavelet denoiser that uses them (Dammertz et al.,
+// with the variance-driven colour weight of SVGF).
+
+inline float luminance(const Color &c)
+{
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// What the camera ray of one sample saw first.
+struct AOVSample
+{
+    Color albedo;
+    Vector3 normal;
+    float depth = 0; // distance to the first hit, 0 when the ray escaped
+};
+
+// Per-pixel sums over samples, like the colour framebuffer.
+struct AOVBuffers
+{
+    std::vector<Color> albedo;
+    std::vector<Vector3> normal;
+    std::vector<float> depth;
+    std::vector<float> luminance_sq; // sum of squared sample luminance, for the variance
+
+    void resize(size_t pixels)
+    {
+        albedo.assign(pixels, Color(0, 0, 0));
+        normal.assign(pixels, Vector3(0, 0, 0));
+        depth.assign(pixels, 0.0f);
+        luminance_sq.assign(pixels, 0.0f);
+    }
+
+    bool empty() const { return albedo.empty(); }
+
+    void add(size_t pixel, const AOVSample &s, const Color &sample_color)
+    {
+        albedo[pixel] += s.albedo;
+        normal[pixel] += s.normal;
+        depth[pixel] += s.depth;
+        float l = luminance(sample_color);
+        luminance_sq[pixel] += l * l;
+    }
+
+    void clear(size_t pixel)
+    {
+        albedo[pixel] = Color(0, 0, 0);
+        normal[pixel] = Vector3(0, 0, 0);
+        depth[pixel] = 0;
+        luminance_sq[pixel] = 0;
+    }
+};
+
+struct DenoiseSettings
+{
+    int iterations = 5;         // filter steps 1, 2, 4, 8, 16 pixels apart
+    float sigma_luminance = 4;  // in standard deviations of the pixel's noise
+    int normal_power = 128;     // exponent on the normal dot product
+    float sigma_depth = 0.02f;  // relative depth difference per pixel of step
+};
+
+// x^n by squaring; much cheaper than std::pow in the filter's inner loop.
+inline float int_power(float x, int n)
+{
+    float result = 1;
+    for (; n > 0; n >>= 1, x *= x)
+        if (n & 1)
+            result *= x;
+    return result;
+}
+
+// Normalised inputs for the filter, one entry per pixel.
+struct DenoiseInput
+{
+    std::vector<Color> irradiance; // colour divided by albedo
+    std::vector<Color> albedo;
+    std::vector<Vector3> normal;
+    std::vector<float> depth;
+    std::vector<float> variance; // of the pixel mean's luminance
+};
+
+inline DenoiseInput prepare_denoise_input(const std::vector<Color> &framebuffer, const AOVBuffers &aovs, int samples)
+{
+    size_t n = framebuffer.size();
+    DenoiseInput in;
+    in.irradiance.resize(n);
+    in.albedo.resize(n);
+    in.normal.resize(n);
+    in.depth.resize(n);
+    in.variance.resize(n);
+    float inv = 1.0f / samples;
+
+    parallel_for(n, [&](size_t i)
+                 {
+        Color color = framebuffer[i] * inv;
+        Color albedo = aovs.albedo[i] * inv;
+        // Filter lighting, not texture: divide the albedo out and put it back later.
+        auto demodulate = [](float c, float a)
+        { return a > 1e-3f ? c / a : c; };
+        in.irradiance[i] = Color(demodulate(color.x, albedo.x), demodulate(color.y, albedo.y), demodulate(color.z, albedo.z));
+        in.albedo[i] = albedo;
+        float len = std::sqrt(aovs.normal[i].length_squared());
+        in.normal[i] = len > 0 ? aovs.normal[i] / len : Vector3(0, 0, 0);
+        in.depth[i] = aovs.depth[i] * inv;
+
+        float mean = luminance(color);
+        float second_moment = aovs.luminance_sq[i] * inv;
+        in.variance[i] = std::max(0.0f, second_moment - mean * mean) / samples; });
+    return in;
+}
+
+// Filters the summed framebuffer in place (it stays a sum over samples).
+inline void denoise_atrous(std::vector<Color> &framebuffer, const AOVBuffers &aovs, int width, int height, int samples,
+                           const DenoiseSettings &settings = DenoiseSettings())
+{
+    DenoiseInput in = prepare_denoise_input(framebuffer, aovs, samples);
+    std::vector<Color> current = in.irradiance, next(current.size());
+    std::vector<float> variance = in.variance, next_variance(variance.size());
+
+    std::vector<float> current_luminance(current.size()), blurred_variance(variance.size());
+    const float kernel[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+    for (int iteration = 0; iteration < settings.iterations; ++iteration)
+    {
+        int step = 1 << iteration;
+        parallel_for(current.size(), [&](size_t i)
+                     { current_luminance[i] = luminance(current[i]); });
+        // A variance from a handful of samples is itself noisy; the luminance
+        // weight uses a 3x3 blur of it, as in SVGF.
+        parallel_for(static_cast<size_t>(height), [&](size_t row)
+                     {
+            int y = static_cast<int>(row);
+            for (int x = 0; x < width; ++x)
+            {
+                float sum = 0, weight = 0;
+                for (int dy = -1; dy <= 1; ++dy)
+                    for (int dx = -1; dx <= 1; ++dx)
+                    {
+                        int qx = x + dx, qy = y + dy;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                            continue;
+                        float w = (dx ? 0.25f : 0.5f) * (dy ? 0.25f : 0.5f);
+                        sum += w * variance[size_t(qy) * width + qx];
+                        weight += w;
+                    }
+                blurred_variance[size_t(y) * width + x] = sum / weight;
+            } });
+        parallel_for(static_cast<size_t>(height), [&](size_t row)
+                     {
+            int y = static_cast<int>(row);
+            for (int x = 0; x < width; ++x)
+            {
+                size_t p = size_t(y) * width + x;
+                const Vector3 &np = in.normal[p];
+                float zp = in.depth[p];
+                float lp = current_luminance[p];
+                float inv_sigma_l = 1.0f / (settings.sigma_luminance * std::sqrt(blurred_variance[p]) + 1e-4f);
+                float inv_sigma_z = 1.0f / (settings.sigma_depth * zp * step + 1e-4f);
+
+                Color sum(0, 0, 0);
+                float weight_sum = 0, variance_sum = 0;
+                for (int dy = -2; dy <= 2; ++dy)
+                {
+                    int qy = y + dy * step;
+                    if (qy < 0 || qy >= height)
+                        continue;
+                    for (int dx = -2; dx <= 2; ++dx)
+                    {
+                        int qx = x + dx * step;
+                        if (qx < 0 || qx >= width)
+                            continue;
+                        size_t q = size_t(qy) * width + qx;
+
+                        float zq = in.depth[q];
+                        // Escaped rays only mix with escaped rays.
+                        if ((zp > 0) != (zq > 0))
+                            continue;
+                        float w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                        float distance = std::fabs(lp - current_luminance[q]) * inv_sigma_l;
+                        if (zp > 0)
+                        {
+                            w *= int_power(std::max(0.0f, np.dot(in.normal[q])), settings.normal_power);
+                            distance += std::fabs(zp - zq) * inv_sigma_z;
+                        }
+                        w *= std::exp(-distance);
+
+                        sum += current[q] * w;
+                        weight_sum += w;
+                        variance_sum += w * w * variance[q];
+                    }
+                }
+                // The centre tap always has weight > 0.
+                next[p] = sum / weight_sum;
+                next_variance[p] = variance_sum / (weight_sum * weight_sum);
+            } });
+        current.swap(next);
+        variance.swap(next_variance);
+    }
+
+    parallel_for(framebuffer.size(), [&](size_t i)
+                 {
+        const Color &a = in.albedo[i];
+        auto remodulate = [](float c, float albedo)
+        { return albedo > 1e-3f ? c * albedo : c; };
+        framebuffer[i] = Color(remodulate(current[i].x, a.x), remodulate(current[i].y, a.y), remodulate(current[i].z, a.z)) * static_cast<float>(samples); });
+}
+
+// Reads a P3 or P6 PPM with 8-bit samples into bytes (RGB).
+inline bool read_ppm(const std::string &path, int &width, int &height, std::vector<unsigned char> &rgb)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int max_val;
+    if (!(in >> magic >> width >> height >> max_val) || (magic != "P3" && magic != "P6") || max_val != 255)
+        return false;
+    rgb.resize(size_t(width) * height * 3);
+    if (magic == "P6")
+    {
+        in.get();
+        in.read(reinterpret_cast<char *>(rgb.data()), rgb.size());
+        return bool(in);
+    }
+    for (auto &v : rgb)
+    {
+        int value;
+        if (!(in >> value))
+            return false;
+        v = static_cast<unsigned char>(value);
+    }
+    return true;
+}
+
+// Root mean square difference between two 8-bit images of equal size.
+inline double rmse(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+        sum += (double(a[i]) - b[i]) * (double(a[i]) - b[i]);
+    return std::sqrt(sum / a.size());
+}
+
+// Peak signal-to-noise ratio in dB between two 8-bit images of equal size.
+inline double psnr(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b)
+{
+    double mse = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        double d = double(a[i]) - double(b[i]);
+        mse += d * d;
+    }
+    mse /= a.size();
+    return mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+}
@@ -0,0 +1,311 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Vector3.hpp"
+#include "Region.hpp"
+#include "ToneMap.hpp"
+
+using Color = Vector3;
+
+// Splitting one frame across processes or machines. Every pixel seeds its own
+// random stream from its image position, so a pixel comes out the same no
+// matter which process renders it or what else that process renders.
+
+// Runs this program again with args (args[0] included, null-terminated).
+// /proc/self/exe finds it however it was started; argv[0] alone names no file
+// when that was through PATH, so it is only searched for as a fallback.
+inline void exec_self(char *const args[])
+{
+    execv("/proc/self/exe", args);
+    execvp(args[0], args);
+}
+
+// "x0,y0,x1,y1"
+inline bool parse_region(const std::string &text, Region &region)
+{
+    return std::sscanf(text.c_str(), "%d,%d,%d,%d", &region.x0, &region.y0, &region.x1, &region.y1) == 4;
+}
+
+// "i/n"
+inline bool parse_shard(const std::string &text, int &index, int &count)
+{
+    return std::sscanf(text.c_str(), "%d/%d", &index, &count) == 2 && count > 0 && index >= 0 && index < count;
+}
+
+// Un-normalised (summed) float radiance for one region of an image. This is
+// what --region/--shard renders write and what merge_tiles reads back, with
+// the tone settings the merged image is to be written with.
+struct PartialFramebuffer
+{
+    int image_width = 0, image_height = 0;
+    int samples_per_pixel = 0;
+    Region region;
+    std::vector<Color> pixels; // region.area() values, row-major
+    ToneSettings tone;
+};
+
+const char PARTIAL_MAGIC[8] = {'C', 'G', 'R', 'T', 'P', 'R', 'T', '2'};
+
+inline bool write_partial(std::FILE *out, const PartialFramebuffer &part)
+{
+    int32_t header[7] = {part.image_width, part.image_height, part.samples_per_pixel,
+                         part.region.x0, part.region.y0, part.region.x1, part.region.y1};
+    int32_t tone[2] = {static_cast<int32_t>(part.tone.op), part.tone.dither};
+    float exposure = part.tone.exposure;
+    std::vector<float> rgb(part.pixels.size() * 3);
+    for (size_t i = 0; i < part.pixels.size(); ++i)
+    {
+        rgb[3 * i] = part.pixels[i].x;
+        rgb[3 * i + 1] = part.pixels[i].y;
+        rgb[3 * i + 2] = part.pixels[i].z;
+    }
+    bool ok = std::fwrite(PARTIAL_MAGIC, 1, sizeof(PARTIAL_MAGIC), out) == sizeof(PARTIAL_MAGIC) &&
+              std::fwrite(header, sizeof(header), 1, out) == 1 &&
+              std::fwrite(tone, sizeof(tone), 1, out) == 1 &&
+              std::fwrite(&exposure, sizeof(exposure), 1, out) == 1 &&
+              std::fwrite(rgb.data(), sizeof(float), rgb.size(), out) == rgb.size();
+    return ok && std::fflush(out) == 0;
+}
+
+inline bool read_partial(std::FILE *in, PartialFramebuffer &part)
+{
+    char magic[sizeof(PARTIAL_MAGIC)];
+    int32_t header[7], tone[2];
+    float exposure;
+    if (std::fread(magic, 1, sizeof(magic), in) != sizeof(magic) || std::memcmp(magic, PARTIAL_MAGIC, sizeof(magic)) != 0)
+        return false;
+    if (std::fread(header, sizeof(header), 1, in) != 1 || std::fread(tone, sizeof(tone), 1, in) != 1 ||
+        std::fread(&exposure, sizeof(exposure), 1, in) != 1)
+        return false;
+    if (tone[0] < static_cast<int32_t>(ToneOperator::Gamma) || tone[0] > static_cast<int32_t>(ToneOperator::Aces))
+        return false;
+    part.tone = ToneSettings{static_cast<ToneOperator>(tone[0]), exposure, tone[1] != 0};
+
+    part.image_width = header[0];
+    part.image_height = header[1];
+    part.samples_per_pixel = header[2];
+    part.region = Region{header[3], header[4], header[5], header[6]};
+    if (part.image_width <= 0 || part.image_height <= 0 || part.region.empty() || part.region.x0 < 0 || part.region.y0 < 0 ||
+        part.region.x1 > part.image_width || part.region.y1 > part.image_height)
+        return false;
+
+    std::vector<float> rgb(part.region.area() * 3);
+    if (std::fread(rgb.data(), sizeof(float), rgb.size(), in) != rgb.size())
+        return false;
+    part.pixels.resize(part.region.area());
+    for (size_t i = 0; i < part.pixels.size(); ++i)
+        part.pixels[i] = Color(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+    return true;
+}
+
+inline PartialFramebuffer extract_region(const std::vector<Color> &framebuffer, int width, int height,
+                                         int samples_per_pixel, const Region &region, const ToneSettings &tone = ToneSettings())
+{
+    PartialFramebuffer part{width, height, samples_per_pixel, region, {}, tone};
+    part.pixels.reserve(region.area());
+    for (int y = region.y0; y < region.y1; ++y)
+        for (int x = region.x0; x < region.x1; ++x)
+            part.pixels.push_back(framebuffer[size_t(y) * width + x]);
+    return part;
+}
+
+inline void insert_region(std::vector<Color> &framebuffer, const PartialFramebuffer &part)
+{
+    const Region &r = part.region;
+    size_t i = 0;
+    for (int y = r.y0; y < r.y1; ++y)
+        for (int x = r.x0; x < r.x1; ++x)
+            framebuffer[size_t(y) * part.image_width + x] = part.pixels[i++];
+}
+
+// Called by a worker before it prints anything: keeps what was stdout for the
+// protocol and sends everything else the renderer prints (scene statistics
+// and so on) to stderr, so it can't corrupt the stream.
+inline int claim_worker_stdout()
+{
+    std::cout.flush();
+    int protocol_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return protocol_fd;
+}
+
+// Worker side of --workers: reads "x0 y0 x1 y1" lines from stdin, renders each
+// region and answers with a partial framebuffer on protocol_fd (see
+// claim_worker_stdout).
+inline int run_worker(const std::function<void(const Region &)> &render_region,
+                      const std::vector<Color> &framebuffer, int width, int height, int samples_per_pixel, int protocol_fd)
+{
+    std::FILE *out = fdopen(protocol_fd, "wb");
+    if (!out)
+        return 1;
+
+    Region region;
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        std::istringstream fields(line);
+        if (!(fields >> region.x0 >> region.y0 >> region.x1 >> region.y1))
+            continue;
+        region = region.clipped(width, height);
+        render_region(region);
+        if (!write_partial(out, extract_region(framebuffer, width, height, samples_per_pixel, region)))
+            return 1;
+    }
+    std::fclose(out);
+    return 0;
+}
+
+struct WorkerProcess
+{
+    pid_t pid = -1;
+    std::FILE *to_worker = nullptr;
+    std::FILE *from_worker = nullptr;
+    int current_tile = -1;
+    int tiles_done = 0;
+};
+
+// Local coordinator: starts `workers` copies of the renderer with worker_args
+// and hands out tiles one at a time, so faster workers simply take more of
+// them. A tile whose worker dies goes back in the queue.
+inline bool run_coordinator(const std::string &executable, const std::vector<std::string> &worker_args, int workers,
+                            int tile_size, std::vector<Color> &framebuffer, int width, int height)
+{
+    std::vector<Region> tiles;
+    for (int y = 0; y < height; y += tile_size)
+        for (int x = 0; x < width; x += tile_size)
+            tiles.push_back(Region{x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+
+    // A worker that dies mid-write must not take the coordinator with it.
+    signal(SIGPIPE, SIG_IGN);
+    std::cout.flush();
+
+    std::vector<WorkerProcess> pool(workers);
+    for (auto &w : pool)
+    {
+        int to_child[2], from_child[2];
+        if (pipe(to_child) != 0 || pipe(from_child) != 0)
+            return false;
+        // Later children must not inherit our ends, or closing them would
+        // never reach this worker as EOF.
+        fcntl(to_child[1], F_SETFD, FD_CLOEXEC);
+        fcntl(from_child[0], F_SETFD, FD_CLOEXEC);
+
+        w.pid = fork();
+        if (w.pid == 0)
+        {
+            dup2(to_child[0], STDIN_FILENO);
+            dup2(from_child[1], STDOUT_FILENO);
+            close(to_child[0]);
+            close(to_child[1]);
+            close(from_child[0]);
+            close(from_child[1]);
+
+            std::vector<char *> args;
+            args.push_back(const_cast<char *>(executable.c_str()));
+            for (const auto &a : worker_args)
+                args.push_back(const_cast<char *>(a.c_str()));
+            args.push_back(nullptr);
+            exec_self(args.data());
+            std::perror("exec");
+            _exit(127);
+        }
+        close(to_child[0]);
+        close(from_child[1]);
+        w.to_worker = fdopen(to_child[1], "w");
+        w.from_worker = fdopen(from_child[0], "rb");
+    }
+
+    std::vector<int> queue;
+    for (int t = static_cast<int>(tiles.size()) - 1; t >= 0; --t)
+        queue.push_back(t);
+
+    auto dispatch = [&](WorkerProcess &w)
+    {
+        if (queue.empty() || !w.to_worker || !w.from_worker)
+            return;
+        w.current_tile = queue.back();
+        queue.pop_back();
+        const Region &r = tiles[w.current_tile];
+        std::fprintf(w.to_worker, "%d %d %d %d\n", r.x0, r.y0, r.x1, r.y1);
+        std::fflush(w.to_worker);
+    };
+
+    size_t done = 0;
+    while (done < tiles.size())
+    {
+        for (auto &w : pool)
+            if (w.current_tile < 0)
+                dispatch(w);
+
+        std::vector<pollfd> fds;
+        std::vector<WorkerProcess *> owners;
+        for (auto &w : pool)
+        {
+            if (w.from_worker && w.current_tile >= 0)
+            {
+                fds.push_back(pollfd{fileno(w.from_worker), POLLIN, 0});
+                owners.push_back(&w);
+            }
+        }
+        if (fds.empty())
+        {
+            std::cerr << "All workers exited with " << tiles.size() - done << " tiles left\n";
+            return false;
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+            continue;
+
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            WorkerProcess &w = *owners[i];
+            PartialFramebuffer part;
+            // Only the tile it was given may come back, whatever else a worker sends.
+            const Region &tile = tiles[w.current_tile];
+            if (read_partial(w.from_worker, part) && part.image_width == width && part.image_height == height &&
+                part.region.x0 == tile.x0 && part.region.y0 == tile.y0 && part.region.x1 == tile.x1 && part.region.y1 == tile.y1)
+            {
+                insert_region(framebuffer, part);
+                ++w.tiles_done;
+                ++done;
+                w.current_tile = -1;
+            }
+            else
+            {
+                std::cerr << "Worker " << w.pid << " failed, requeueing its tile\n";
+                queue.push_back(w.current_tile);
+                w.current_tile = -1;
+                std::fclose(w.from_worker);
+                w.from_worker = nullptr;
+                if (w.to_worker)
+                    std::fclose(w.to_worker);
+                w.to_worker = nullptr;
+            }
+        }
+    }
+
+    // Closing stdin lets each worker leave its loop.
+    for (size_t i = 0; i < pool.size(); ++i)
+    {
+        WorkerProcess &w = pool[i];
+        if (w.to_worker)
+            std::fclose(w.to_worker);
+        if (w.from_worker)
+            std::fclose(w.from_worker);
+        waitpid(w.pid, nullptr, 0);
+        std::cout << "Worker " << i << ": " << w.tiles_done << " tiles\n";
+    }
+    return true;
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Cylinder.hpp"
+#include "Denoise.hpp"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+
+using Color = Vector3;
+
+// Emissive shapes as light sources for the path tracer. Next-event estimation
+// picks an emitter with probability proportional to its power (emitted
+// luminance times area) and then a point uniformly on its surface, so the
+// density of any point on any emitter is luminance(emission) / total power.
+// It depends only on the emission there, which is all a BSDF-sampled ray that
+// lands on an emitter knows, and all MIS needs to weigh the two strategies.
+
+struct EmitterSample
+{
+    Vector3 p;
+    Vector3 normal;
+    Color emission;
+    float pdf_area; // per unit area
+    uint32_t index; // which emitter, for the shadow-ray occluder cache
+};
+
+// MIS weight of a sample drawn with density pdf, when other_pdf is the
+// density the other strategy would have drawn it with (power heuristic).
+inline float power_heuristic(float pdf, float other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+class EmissiveLights
+{
+public:
+    // Copies the emissive spheres, triangles and cylinders among shapes, so
+    // the distribution outlives them (out of core they are freed once built).
+    void add(const std::vector<std::shared_ptr<Hittable>> &shapes)
+    {
+        for (const auto &shape : shapes)
+        {
+            Emitter e{};
+            const Material *material = nullptr;
+            if (auto s = dynamic_cast<const Sphere *>(shape.get()))
+            {
+                e = Emitter{SPHERE, s->center, Vector3(0, 0, 0), Vector3(0, 0, 0), s->radius, 0, Color(0, 0, 0),
+                            static_cast<float>(4 * pi * s->radius * s->radius)};
+                material = s->material_ptr.get();
+            }
+            else if (auto t = dynamic_cast<const Triangle *>(shape.get()))
+            {
+                e = Emitter{TRIANGLE, t->v1, t->v2, t->v3, 0, 0, Color(0, 0, 0),
+                            static_cast<float>(0.5 * (t->v2 - t->v1).cross(t->v3 - t->v1).length())};
+                material = t->material_ptr.get();
+            }
+            else if (auto c = dynamic_cast<const Cylinder *>(shape.get()))
+            {
+                // The side runs from center - height * axis to center + height * axis.
+                float r = static_cast<float>(c->radius), h = static_cast<float>(c->height);
+                e = Emitter{CYLINDER, c->center - h * c->axis, c->axis, Vector3(0, 0, 0), r, 2 * h, Color(0, 0, 0),
+                            static_cast<float>(2 * pi * r * 2 * h + 2 * pi * r * r)};
+                material = c->material_ptr.get();
+            }
+            if (!material || e.area <= 0)
+                continue;
+            e.emission = material->emit();
+            float power = luminance(e.emission) * e.area;
+            if (!(power > 0))
+                continue;
+            emitters.push_back(e);
+            total_power += power;
+            cdf.push_back(total_power);
+        }
+    }
+
+    void clear()
+    {
+        emitters.clear();
+        cdf.clear();
+        total_power = 0;
+    }
+
+    bool empty() const { return emitters.empty(); }
+    size_t size() const { return emitters.size(); }
+    double power() const { return total_power; }
+
+    // u_select picks the emitter (and, rescaled within its share, one more
+    // dimension of the point); u places the point.
+    EmitterSample sample(double u_select, double u) const
+    {
+        double target = u_select * total_power;
+        size_t i = std::min(size_t(std::upper_bound(cdf.begin(), cdf.end(), target) - cdf.begin()), emitters.size() - 1);
+        double below = i > 0 ? cdf[i - 1] : 0;
+        double v = std::min(std::max((target - below) / (cdf[i] - below), 0.0), 0.99999999);
+        const Emitter &e = emitters[i];
+
+        EmitterSample s;
+        s.emission = e.emission;
+        s.pdf_area = pdf_area(e.emission);
+        s.index = static_cast<uint32_t>(i);
+        switch (e.kind)
+        {
+        case SPHERE:
+            s.normal = sample_unit_vector(v, u);
+            s.p = e.a + e.radius * s.normal;
+            break;
+        case TRIANGLE:
+        {
+            // Uniform barycentrics by the square-root warp.
+            float su = static_cast<float>(std::sqrt(v));
+            float b0 = 1 - su, b1 = static_cast<float>(u) * su;
+            s.p = e.a * b0 + e.b * b1 + e.c * (1 - b0 - b1);
+            s.normal = (e.b - e.a).cross(e.c - e.a).normalized();
+            break;
+        }
+        default:
+        {
+            // Side or one of the two caps, in proportion to their areas.
+            Vector3 axis = e.b, t1, t2;
+            orthonormal_basis(axis, t1, t2);
+            float side = static_cast<float>(2 * pi * e.radius * e.height), cap = static_cast<float>(pi * e.radius * e.radius);
+            float at = static_cast<float>(v) * e.area, phi = static_cast<float>(2 * pi * u);
+            Vector3 radial = std::cos(phi) * t1 + std::sin(phi) * t2;
+            if (at < side)
+            {
+                s.p = e.a + (at / side * e.height) * axis + e.radius * radial;
+                s.normal = radial;
+            }
+            else
+            {
+                bool top = at - side >= cap;
+                float w = (at - side - (top ? cap : 0)) / cap;
+                s.p = e.a + (top ? e.height : 0.0f) * axis + (e.radius * std::sqrt(std::min(w, 1.0f))) * radial;
+                s.normal = top ? axis : -axis;
+            }
+        }
+        }
+        return s;
+    }
+
+    // Density per unit area with which sample() returns a point emitting emission.
+    float pdf_area(const Color &emission) const
+    {
+        return total_power > 0 ? static_cast<float>(std::max(luminance(emission), 0.0f) / total_power) : 0.0f;
+    }
+
+private:
+    enum Kind
+    {
+        SPHERE,
+        TRIANGLE,
+        CYLINDER
+    };
+    // Sphere: a = centre. Triangle: a, b, c = vertices. Cylinder: a = base
+    // centre, b = axis, height = full length.
+    struct Emitter
+    {
+        Kind kind;
+        Vector3 a, b, c;
+        float radius, height;
+        Color emission;
+        float area;
+    };
+    std::vector<Emitter> emitters;
+    std::vector<double> cdf; // running sum of power
+    double total_power = 0;
+
+    static void orthonormal_basis(const Vector3 &n, Vector3 &t1, Vector3 &t2)
+    {
+        t1 = (std::fabs(n.x) > 0.9f ? Vector3(0, 1, 0) : Vector3(1, 0, 0)).cross(n).normalized();
+        t2 = n.cross(t1);
+    }
+};
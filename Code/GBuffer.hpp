@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "Material.hpp"
+#include "Vector2.hpp"
+#include "Vector3.hpp"
+
+// Per-sample record of what each Phong camera ray hit, so lights and material
+// coefficients can be changed and the image shaded again without tracing the
+// camera rays: shadow rays, Blinn-Phong and reflections are all that rerun.
+
+// One camera sample's first hit; material is null when the ray escaped.
+struct GBufferSample
+{
+    Vector3 p, normal;
+    Vector3 direction;   // of the camera ray, for the view vector and reflections
+    Vector2 uv;
+    double uv_per_unit = 0;
+    float footprint = 0; // ray cone width at the hit
+    float cone_spread = 0;
+    const Material *material = nullptr;
+};
+
+class GBuffer
+{
+public:
+    void resize(size_t pixels, int samples_per_pixel)
+    {
+        samples = samples_per_pixel;
+        entries.assign(pixels * samples_per_pixel, GBufferSample());
+    }
+
+    bool empty() const { return entries.empty(); }
+    int samples_per_pixel() const { return samples; }
+    size_t bytes() const { return entries.size() * sizeof(GBufferSample); }
+
+    // Where render_image records a sample; null past the samples the buffer was sized for.
+    GBufferSample *record(size_t pixel, int sample)
+    {
+        return sample < samples ? &entries[pixel * samples + sample] : nullptr;
+    }
+    const GBufferSample &at(size_t pixel, int sample) const { return entries[pixel * samples + sample]; }
+
+private:
+    int samples = 0;
+    std::vector<GBufferSample> entries;
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "CompiledScene.hpp"
+
+// Uniform grid over a compiled scene's primitives, walked cell by cell with a
+// 3D DDA (Amanatides and Woo). For many similar shapes spread evenly through
+// the scene (particle clouds) stepping cells is cheaper than a tree walk.
+// Cells list the primitives whose boxes overlap them, in one flat array.
+class UniformGrid : public Hittable
+{
+public:
+    // Aims for about cells_per_primitive cells per primitive, as cubic as the
+    // scene's bounds allow. The scene must outlive the grid.
+    explicit UniformGrid(const CompiledScene &scene, float cells_per_primitive = 2.0f)
+        : scene(scene)
+    {
+        std::vector<uint32_t> primitives = scene.primitives();
+        size_t n = primitives.size();
+        std::vector<Vector3> mins(n), maxs(n);
+        for (size_t i = 0; i < n; ++i)
+            scene.leaf_bounds(primitives[i], mins[i], maxs[i]);
+        box_ab bounds;
+        scene.bounding_box(0, 0, bounds);
+        grid_min = bounds.min();
+        Vector3 extent = bounds.max() - bounds.min();
+
+        // Cube cells of the size that gives the wanted count; flat axes get one cell.
+        double volume = 1;
+        int flat_axes = 0;
+        for (int a = 0; a < 3; ++a)
+            if ((&extent.x)[a] > 0)
+                volume *= (&extent.x)[a];
+            else
+                ++flat_axes;
+        double cell = std::pow(volume / (cells_per_primitive * std::max<size_t>(n, 1)), 1.0 / (3 - std::min(flat_axes, 2)));
+        for (int a = 0; a < 3; ++a)
+        {
+            float e = (&extent.x)[a];
+            resolution[a] = e > 0 ? static_cast<int>(std::clamp(std::ceil(e / cell), 1.0, 512.0)) : 1;
+            cell_size[a] = e > 0 ? e / resolution[a] : 1;
+        }
+
+        // Count, prefix-sum, then fill: two passes over the primitives.
+        size_t cells = size_t(resolution[0]) * resolution[1] * resolution[2];
+        cell_start.assign(cells + 1, 0);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            if (pass == 1)
+            {
+                for (size_t c = 0; c < cells; ++c)
+                    cell_start[c + 1] += cell_start[c];
+                cell_items.resize(cell_start[cells]);
+            }
+            std::vector<uint32_t> filled(pass == 1 ? cells : 0, 0);
+            for (size_t i = 0; i < n; ++i)
+            {
+                int lo[3], hi[3];
+                for (int a = 0; a < 3; ++a)
+                {
+                    lo[a] = cell_of((&mins[i].x)[a], a);
+                    hi[a] = cell_of((&maxs[i].x)[a], a);
+                }
+                for (int z = lo[2]; z <= hi[2]; ++z)
+                    for (int y = lo[1]; y <= hi[1]; ++y)
+                        for (int x = lo[0]; x <= hi[0]; ++x)
+                        {
+                            size_t c = cell_index(x, y, z);
+                            if (pass == 0)
+                                ++cell_start[c + 1];
+                            else
+                                cell_items[cell_start[c] + filled[c]++] = primitives[i];
+                        }
+            }
+        }
+        grid_max = bounds.max();
+    }
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
+    {
+        return walk(r, t_min, t_max, &rec) != 0;
+    }
+
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override
+    {
+        uint32_t child = walk(r, t_min, t_max, nullptr);
+        return child ? scene.source(child) : nullptr;
+    }
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        output_box = box_ab(grid_min, grid_max);
+        return true;
+    }
+
+    size_t cell_count() const { return cell_start.size() - 1; }
+    size_t reference_count() const { return cell_items.size(); }
+    const int *dimensions() const { return resolution; }
+
+private:
+    const CompiledScene &scene;
+    Vector3 grid_min, grid_max;
+    int resolution[3];
+    float cell_size[3];
+    std::vector<uint32_t> cell_start; // cell c lists cell_items[cell_start[c], cell_start[c + 1])
+    std::vector<uint32_t> cell_items;
+
+    int cell_of(float v, int axis) const
+    {
+        int c = static_cast<int>((v - (&grid_min.x)[axis]) / cell_size[axis]);
+        return std::clamp(c, 0, resolution[axis] - 1);
+    }
+
+    size_t cell_index(int x, int y, int z) const
+    {
+        return (size_t(z) * resolution[1] + y) * resolution[0] + x;
+    }
+
+    // With rec, finds the closest hit and returns its primitive; without,
+    // returns the first primitive found that blocks the ray. 0 for a miss.
+    uint32_t walk(const Ray &r, double t_min, double t_max, Hit_record *rec) const
+    {
+        // Clip the ray to the grid.
+        double t_enter = t_min, t_leave = t_max;
+        for (int a = 0; a < 3; ++a)
+        {
+            double inv = 1.0 / (&r.direction.x)[a];
+            double t0 = ((&grid_min.x)[a] - (&r.origin.x)[a]) * inv;
+            double t1 = ((&grid_max.x)[a] - (&r.origin.x)[a]) * inv;
+            t_enter = std::fmax(std::fmin(t0, t1), t_enter);
+            t_leave = std::fmin(std::fmax(t0, t1), t_leave);
+            if (t_leave < t_enter)
+                return 0;
+        }
+
+        Vector3 start = r.at(t_enter);
+        int cell[3], step[3], out[3];
+        double t_next[3], t_delta[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            double d = (&r.direction.x)[a], o = (&r.origin.x)[a];
+            cell[a] = cell_of((&start.x)[a], a);
+            if (d > 0)
+            {
+                step[a] = 1;
+                out[a] = resolution[a];
+                t_next[a] = ((&grid_min.x)[a] + (cell[a] + 1) * cell_size[a] - o) / d;
+                t_delta[a] = cell_size[a] / d;
+            }
+            else if (d < 0)
+            {
+                step[a] = -1;
+                out[a] = -1;
+                t_next[a] = ((&grid_min.x)[a] + cell[a] * cell_size[a] - o) / d;
+                t_delta[a] = -cell_size[a] / d;
+            }
+            else
+            {
+                step[a] = 0;
+                out[a] = -1;
+                t_next[a] = t_delta[a] = INFINITY;
+            }
+        }
+
+        // Fetched per ray: the scene's material table can grow after a hot reload.
+        CompiledArrays arrays = scene.arrays();
+        Hit_record scratch;
+        uint32_t closest = 0;
+        while (true)
+        {
+            size_t c = cell_index(cell[0], cell[1], cell[2]);
+            for (uint32_t k = cell_start[c]; k < cell_start[c + 1]; ++k)
+            {
+                uint32_t child = cell_items[k];
+                if (arrays.hit_primitive(child, r, t_min, t_max, rec ? *rec : scratch))
+                {
+                    if (!rec)
+                        return child;
+                    closest = child;
+                    t_max = rec->t;
+                }
+            }
+
+            int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            // A hit inside this cell cannot be beaten by a later cell.
+            if (closest && t_max <= t_next[axis])
+                return closest;
+            if (t_next[axis] > t_leave)
+                return closest;
+            cell[axis] += step[axis];
+            if (cell[axis] == out[axis])
+                return closest;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+};
@@ -22,7 +22,7 @@ public:
     virtual bool bounding_box(double t0, double t1, box_ab &output_box) const;
 };
 
-bool hittable_list::hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
+inline bool hittable_list::hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
 {
     Hit_record temp_rec;
     bool hit_anything = false;
@@ -40,7 +40,7 @@ bool hittable_list::hit(const Ray &r, double t_min, double t_max, Hit_record &re
     return hit_anything;
 }
 
-bool hittable_list::bounding_box(double t0, double t1, box_ab &output_box) const
+inline bool hittable_list::bounding_box(double t0, double t1, box_ab &output_box) const
 {
     if (objects.empty())
     {
@@ -1,5 +1,6 @@
 #pragma once
 #include "classbox_ab.hpp"
+#include "Vector2.hpp"
 
 class Material;
 
@@ -10,7 +11,9 @@ public:
   Vector3 normal;
   shared_ptr<Material> material_ptr;
   double t;
-  bool front_face;
+  bool front_face = true;
+  Vector2 uv;              // texture coordinates at p
+  double uv_per_unit = 0;  // uv units per world unit around p, for mip selection
 
   inline void set_face_normal(const Ray &r, const Vector3 &outward_normal)
   {
@@ -25,6 +28,18 @@ public:
   virtual bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const = 0;
   virtual bool bounding_box(double t0, double t1, box_ab &output_box) const = 0;
 
+  // Any-hit query for shadow rays: returns the primitive blocking the ray
+  // inside (t_min, t_max), or nullptr. A plain primitive answers for itself.
+  virtual const Hittable *any_hit(const Ray &r, double t_min, double t_max) const
+  {
+    Hit_record rec;
+    return hit(r, t_min, t_max, rec) ? this : nullptr;
+  }
+
+  // Moves the shape, for dynamic geometry between frames. Shapes that cannot
+  // be moved ignore it.
+  virtual void translate(const Vector3 &offset) {}
+
 public:
   Vector3 center = Vector3(0, 0, 0);
 };
\ No newline at end of file
@@ -0,0 +1,210 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "json/include/nlohmann/json.hpp"
+#include "Camera.hpp"
+#include "Hittable.hpp"
+#include "Light.hpp"
+#include "Material.hpp"
+#include "Parallel.hpp"
+#include "Region.hpp"
+#include "classbox_ab.hpp"
+
+using json = nlohmann::json;
+
+// Watch mode: when the scene file changes, the new JSON is compared with the
+// loaded one entry by entry, only the shapes, materials and lights that differ
+// are updated, and only the tiles whose pixels could see a difference are
+// rendered again. Anything that changes the scene's structure (shape count or
+// types, image size, render settings) needs a full reload instead.
+
+struct SceneChanges
+{
+    std::string reload_reason; // set when only a full reload will do
+    bool camera = false, background = false, lights = false;
+    std::vector<size_t> moved;    // shape entries with new geometry (and maybe a new material)
+    std::vector<size_t> restyled; // shape entries with only a new material
+    bool static_moved = false, dynamic_moved = false; // which kinds of shape are among the moved
+
+    bool empty() const
+    {
+        return reload_reason.empty() && !camera && !background && !lights && moved.empty() && restyled.empty();
+    }
+};
+
+inline bool valid_scene_json(const json &j)
+{
+    return j.is_object() && j.contains("camera") && j["camera"].is_object() && j.contains("scene") &&
+           j["scene"].contains("shapes") && j["scene"]["shapes"].is_array();
+}
+
+inline json without(json j, std::initializer_list<const char *> keys)
+{
+    for (const char *key : keys)
+        j.erase(key);
+    return j;
+}
+
+inline SceneChanges diff_scenes(const json &before, const json &after)
+{
+    SceneChanges changes;
+    if (without(before, {"camera", "scene"}) != without(after, {"camera", "scene"}))
+        changes.reload_reason = "render settings changed";
+    else if (without(before["scene"], {"shapes", "lightsources", "backgroundcolor"}) !=
+             without(after["scene"], {"shapes", "lightsources", "backgroundcolor"}))
+        changes.reload_reason = "scene settings changed";
+    else if (before["camera"].value("width", 0) != after["camera"].value("width", 0) ||
+             before["camera"].value("height", 0) != after["camera"].value("height", 0))
+        changes.reload_reason = "image size changed";
+    else if (before["scene"]["shapes"].size() != after["scene"]["shapes"].size())
+        changes.reload_reason = "shapes were added or removed";
+    if (!changes.reload_reason.empty())
+        return changes;
+
+    changes.camera = before["camera"] != after["camera"];
+    changes.background = before["scene"].value("backgroundcolor", json()) != after["scene"].value("backgroundcolor", json());
+    changes.lights = before["scene"].value("lightsources", json()) != after["scene"].value("lightsources", json());
+
+    const json &old_shapes = before["scene"]["shapes"], &new_shapes = after["scene"]["shapes"];
+    for (size_t i = 0; i < old_shapes.size(); ++i)
+    {
+        const json &a = old_shapes[i], &b = new_shapes[i];
+        if (a == b)
+            continue;
+        if (a.value("type", "") != b.value("type", "") || a.value("dynamic", false) != b.value("dynamic", false))
+        {
+            changes.reload_reason = "shape " + std::to_string(i) + " changed type";
+            return changes;
+        }
+        if (without(a, {"material"}) != without(b, {"material"}))
+        {
+            changes.moved.push_back(i);
+            (b.value("dynamic", false) ? changes.dynamic_moved : changes.static_moved) = true;
+        }
+        else
+            changes.restyled.push_back(i);
+    }
+    return changes;
+}
+
+// A restyled entry with its own material before and after, of the same kind,
+// has that material updated in place.
+inline bool restyled_in_place(const json &before, const json &after, size_t i)
+{
+    const json &a = before["scene"]["shapes"][i], &b = after["scene"]["shapes"][i];
+    return a.contains("material") && b.contains("material") &&
+           a["material"].value("isreflective", false) == b["material"].value("isreflective", false) &&
+           a["material"].value("isrefractive", false) == b["material"].value("isrefractive", false);
+}
+
+inline std::filesystem::file_time_type scene_file_stamp(const std::string &path)
+{
+    std::error_code error;
+    return std::filesystem::last_write_time(path, error);
+}
+
+// What the camera ray through a pixel centre sees.
+struct PrimaryHit
+{
+    bool hit = false;
+    bool reflective = false;
+    Vector3 p;
+};
+
+inline std::vector<PrimaryHit> trace_primary_hits(const Camera &camera, const Hittable &world, int width, int height)
+{
+    std::vector<PrimaryHit> hits(size_t(width) * height);
+    parallel_for(static_cast<size_t>(height), [&](size_t y)
+                 {
+        Hit_record rec;
+        for (int x = 0; x < width; ++x)
+        {
+            size_t pixel = y * width + x;
+            seed_sample(pixel, 0);
+            start_sample(nullptr, x, y, 0);
+            Ray ray = camera.get_ray((x + 0.5) / (width - 1), (y + 0.5) / (height - 1));
+            if (world.hit(ray, 0.001, inf, rec))
+                hits[pixel] = PrimaryHit{true, rec.material_ptr->isreflective, rec.p};
+        } });
+    return hits;
+}
+
+inline bool inside(const box_ab &box, const Vector3 &p)
+{
+    return p.x >= box._min.x && p.y >= box._min.y && p.z >= box._min.z &&
+           p.x <= box._max.x && p.y <= box._max.y && p.z <= box._max.z;
+}
+
+// The tiles to render again after a change, from what each pixel centre saw
+// before and after it. surfaces are the boxes (old and new) of every changed
+// shape, occluders those of the shapes that moved. A pixel is dirty when its
+// camera ray hits something else, lands in a changed shape, reflects (so it
+// can see anything), or (trace_type 2) has a shadow ray crossing a moved
+// shape. Dirty pixels mark the tiles within one pixel of them, since samples
+// are jittered across the pixel.
+inline std::vector<Region> dirty_tiles(const std::vector<PrimaryHit> &before, const std::vector<PrimaryHit> &after,
+                                       std::vector<box_ab> surfaces, std::vector<box_ab> occluders,
+                                       const std::vector<Light> &lights, bool lights_changed, int trace_type,
+                                       int width, int height, int tile_size)
+{
+    for (std::vector<box_ab> *boxes : {&surfaces, &occluders})
+        for (box_ab &box : *boxes)
+        {
+            Vector3 pad = (box.max() - box.min()) * 1e-3f + Vector3(1e-4f, 1e-4f, 1e-4f);
+            box = box_ab(box.min() - pad, box.max() + pad);
+        }
+
+    std::vector<char> dirty(before.size(), 0);
+    parallel_for(before.size(), [&](size_t pixel)
+                 {
+        const PrimaryHit &a = before[pixel], &b = after[pixel];
+        if (a.hit != b.hit || (a.hit && (a.p - b.p).length() > 1e-4f))
+        {
+            dirty[pixel] = 1;
+            return;
+        }
+        if (!a.hit)
+            return;
+        if ((lights_changed && trace_type == 2) || (trace_type == 2 && (a.reflective || b.reflective)))
+        {
+            dirty[pixel] = 1;
+            return;
+        }
+        for (const box_ab &box : surfaces)
+            if (inside(box, a.p))
+            {
+                dirty[pixel] = 1;
+                return;
+            }
+        if (trace_type != 2)
+            return;
+        for (const Light &light : lights)
+        {
+            Vector3 to_light = light.position - a.p;
+            Ray shadow_ray(a.p, to_light.normalized());
+            for (const box_ab &box : occluders)
+                if (box.hit(shadow_ray, 0.001, to_light.length()))
+                {
+                    dirty[pixel] = 1;
+                    return;
+                }
+        } });
+
+    std::vector<Region> tiles;
+    for (int ty = 0; ty < height; ty += tile_size)
+        for (int tx = 0; tx < width; tx += tile_size)
+        {
+            Region tile{tx, ty, std::min(tx + tile_size, width), std::min(ty + tile_size, height)};
+            Region margin = Region{tile.x0 - 1, tile.y0 - 1, tile.x1 + 1, tile.y1 + 1}.clipped(width, height);
+            bool any = false;
+            for (int y = margin.y0; y < margin.y1 && !any; ++y)
+                for (int x = margin.x0; x < margin.x1 && !any; ++x)
+                    any = dirty[size_t(y) * width + x];
+            if (any)
+                tiles.push_back(tile);
+        }
+    return tiles;
+}
@@ -0,0 +1,233 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "CompiledScene.hpp"
+
+// kd-tree over a compiled scene's primitives, with splits chosen by the
+// surface area heuristic over binned candidate planes. Unlike a BVH, the
+// children of a node never overlap, so the closest hit can stop at the first
+// leaf that has one inside its own stretch of the ray.
+class KdTree : public Hittable
+{
+public:
+    static const int SAH_BINS = 32;
+    static constexpr float TRAVERSAL_COST = 1.0f, INTERSECTION_COST = 1.5f;
+
+    // The scene must outlive the tree.
+    explicit KdTree(const CompiledScene &scene) : scene(scene)
+    {
+        std::vector<uint32_t> primitives = scene.primitives();
+        mins.resize(primitives.size());
+        maxs.resize(primitives.size());
+        std::vector<uint32_t> items(primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i)
+        {
+            scene.leaf_bounds(primitives[i], mins[i], maxs[i]);
+            items[i] = static_cast<uint32_t>(i);
+        }
+        refs = primitives;
+        scene.bounding_box(0, 0, bounds);
+        int max_depth = static_cast<int>(8 + 1.3 * std::log2(std::max<size_t>(primitives.size(), 1)));
+        nodes.emplace_back();
+        build(0, items, bounds, max_depth);
+        // Leaves now refer to primitives by child reference.
+        for (uint32_t &item : leaf_items)
+            item = refs[item];
+        std::vector<Vector3>().swap(mins);
+        std::vector<Vector3>().swap(maxs);
+    }
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
+    {
+        return walk(r, t_min, t_max, &rec) != 0;
+    }
+
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override
+    {
+        uint32_t child = walk(r, t_min, t_max, nullptr);
+        return child ? scene.source(child) : nullptr;
+    }
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        output_box = bounds;
+        return true;
+    }
+
+    size_t node_count() const { return nodes.size(); }
+    size_t reference_count() const { return leaf_items.size(); }
+
+private:
+    struct Node
+    {
+        float split = 0;
+        uint32_t axis = 3;  // 0-2 for an inner node, 3 for a leaf
+        uint32_t first = 0; // inner: index of the child below the plane (the other follows); leaf: into leaf_items
+        uint32_t count = 0; // leaf only
+    };
+
+    const CompiledScene &scene;
+    box_ab bounds;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> leaf_items;
+    std::vector<uint32_t> refs;      // primitive index -> child reference, while building
+    std::vector<Vector3> mins, maxs; // primitive boxes, while building
+
+    static float half_area(const Vector3 &d) { return d.x * d.y + d.y * d.z + d.z * d.x; }
+
+    void make_leaf(uint32_t index, const std::vector<uint32_t> &items)
+    {
+        nodes[index].axis = 3;
+        nodes[index].first = static_cast<uint32_t>(leaf_items.size());
+        nodes[index].count = static_cast<uint32_t>(items.size());
+        leaf_items.insert(leaf_items.end(), items.begin(), items.end());
+    }
+
+    void build(uint32_t index, std::vector<uint32_t> &items, const box_ab &box, int depth_left)
+    {
+        Vector3 extent = box.max() - box.min();
+        float area = half_area(extent);
+        float leaf_cost = INTERSECTION_COST * items.size();
+        if (items.size() <= 2 || depth_left == 0 || area <= 0)
+        {
+            make_leaf(index, items);
+            return;
+        }
+
+        // Binned SAH: count box starts and ends per bin (boxes clipped to the
+        // node), then sweep the planes between bins on every axis.
+        float best_cost = leaf_cost, best_split = 0;
+        int best_axis = -1;
+        for (int a = 0; a < 3; ++a)
+        {
+            float lo = (&box._min.x)[a], width = (&extent.x)[a];
+            if (width <= 0)
+                continue;
+            int starts[SAH_BINS] = {0}, ends[SAH_BINS] = {0};
+            for (uint32_t item : items)
+            {
+                auto bin = [&](float v)
+                { return std::clamp(static_cast<int>((v - lo) / width * SAH_BINS), 0, SAH_BINS - 1); };
+                ++starts[bin((&mins[item].x)[a])];
+                ++ends[bin((&maxs[item].x)[a])];
+            }
+            int below = 0, above = static_cast<int>(items.size());
+            for (int plane = 1; plane < SAH_BINS; ++plane)
+            {
+                below += starts[plane - 1];
+                above -= ends[plane - 1];
+                float split = lo + width * plane / SAH_BINS;
+                Vector3 below_extent = extent, above_extent = extent;
+                (&below_extent.x)[a] = split - lo;
+                (&above_extent.x)[a] = lo + width - split;
+                float cost = TRAVERSAL_COST + INTERSECTION_COST * (half_area(below_extent) * below + half_area(above_extent) * above) / area;
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_split = split;
+                }
+            }
+        }
+        if (best_axis < 0)
+        {
+            make_leaf(index, items);
+            return;
+        }
+
+        std::vector<uint32_t> below_items, above_items;
+        for (uint32_t item : items)
+        {
+            if ((&mins[item].x)[best_axis] < best_split)
+                below_items.push_back(item);
+            if ((&maxs[item].x)[best_axis] >= best_split)
+                above_items.push_back(item);
+        }
+        std::vector<uint32_t>().swap(items);
+
+        box_ab below_box = box, above_box = box;
+        (&below_box._max.x)[best_axis] = best_split;
+        (&above_box._min.x)[best_axis] = best_split;
+        uint32_t child = static_cast<uint32_t>(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        nodes[index].axis = static_cast<uint32_t>(best_axis);
+        nodes[index].split = best_split;
+        nodes[index].first = child;
+        build(child, below_items, below_box, depth_left - 1);
+        build(child + 1, above_items, above_box, depth_left - 1);
+    }
+
+    // With rec, finds the closest hit and returns its primitive; without,
+    // returns the first primitive found that blocks the ray. 0 for a miss.
+    uint32_t walk(const Ray &r, double t_min, double t_max, Hit_record *rec) const
+    {
+        double t_enter = t_min, t_leave = t_max;
+        double inv[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            inv[a] = 1.0 / (&r.direction.x)[a];
+            double t0 = ((&bounds._min.x)[a] - (&r.origin.x)[a]) * inv[a];
+            double t1 = ((&bounds._max.x)[a] - (&r.origin.x)[a]) * inv[a];
+            t_enter = std::fmax(std::fmin(t0, t1), t_enter);
+            t_leave = std::fmin(std::fmax(t0, t1), t_leave);
+            if (t_leave < t_enter)
+                return 0;
+        }
+
+        struct Entry
+        {
+            uint32_t node;
+            double t0, t1;
+        };
+        Entry stack[64];
+        int top = 0;
+        Entry current{0, t_enter, t_leave};
+        // Fetched per ray: the scene's material table can grow after a hot reload.
+        CompiledArrays arrays = scene.arrays();
+        Hit_record scratch;
+        uint32_t closest = 0;
+
+        while (true)
+        {
+            if (closest && t_max < current.t0)
+                return closest;
+            const Node &node = nodes[current.node];
+            if (node.axis < 3)
+            {
+                int a = static_cast<int>(node.axis);
+                double o = (&r.origin.x)[a];
+                double t_plane = (node.split - o) * inv[a];
+                bool below_first = o < node.split || (o == node.split && (&r.direction.x)[a] <= 0);
+                uint32_t near = node.first + (below_first ? 0 : 1), far = node.first + (below_first ? 1 : 0);
+                if (t_plane > current.t1 || t_plane <= 0)
+                    current.node = near;
+                else if (t_plane < current.t0)
+                    current.node = far;
+                else
+                {
+                    stack[top++] = Entry{far, t_plane, current.t1};
+                    current = Entry{near, current.t0, t_plane};
+                }
+                continue;
+            }
+
+            for (uint32_t k = node.first; k < node.first + node.count; ++k)
+            {
+                uint32_t child = leaf_items[k];
+                if (arrays.hit_primitive(child, r, t_min, t_max, rec ? *rec : scratch))
+                {
+                    if (!rec)
+                        return child;
+                    closest = child;
+                    t_max = rec->t;
+                }
+            }
+            // Leaves are visited front to back: a hit inside this one is final.
+            if ((closest && t_max <= current.t1) || top == 0)
+                return closest;
+            current = stack[--top];
+        }
+    }
+};
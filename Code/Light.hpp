@@ -1,12 +1,16 @@
 #pragma once
 #include "Ray.hpp"
 
+class ShadowCubemap;
+
 // Define a simple point light class
 class Light
 {
 public:
     Vector3 position;  // Position of the light in the scene
     Vector3 intensity; // Intensity of the light
+    // Set for previews: shadows are looked up here instead of traced.
+    const ShadowCubemap *shadow_map = nullptr;
 
     Light(const Vector3 &pos, const Vector3 &intensity)
         : position(pos), intensity(intensity) {}
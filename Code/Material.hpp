@@ -2,6 +2,8 @@
 #include "utility.hpp"
 //#include "json/include/nlohmann/json.hpp"
 #include "Hittable.hpp"
+#include "Texture.hpp"
+#include "Sampler.hpp"
 #include <memory>
 using Color = Vector3;
 
@@ -12,6 +14,7 @@ public:
     Vector3 diffusecolor, specularcolor, emissioncolor;
     bool isreflective, isrefractive;
     float reflectivity, refractiveindex;
+    std::shared_ptr<Texture> texture; // optional, modulates diffusecolor
 
     Material()
         : ks(0), kd(0), specularexponent(0),
@@ -31,13 +34,23 @@ public:
           specularexponent(mat_json.value("specularexponent", 0.0f)),
           diffusecolor(Vector3(mat_json["diffusecolor"][0], mat_json["diffusecolor"][1], mat_json["diffusecolor"][2])),
           specularcolor(Vector3(mat_json["specularcolor"][0], mat_json["specularcolor"][1], mat_json["specularcolor"][2])),
-          emissioncolor(Vector3(mat_json.value("emissioncolor", std::vector<float>{0.0, 0.0, 0.0})[0],
-                             mat_json.value("emissioncolor", std::vector<float>{0.0, 0.0, 0.0})[1],
-                             mat_json.value("emissioncolor", std::vector<float>{0.0, 0.0, 0.0})[2])),
+          emissioncolor(mat_json.contains("emissioncolor") ? Vector3(mat_json["emissioncolor"]) : Vector3(0, 0, 0)),
           isreflective(mat_json.value("isreflective", false)),
           reflectivity(mat_json.value("reflectivity", 0.0f)),
           isrefractive(mat_json.value("isrefractive", false)),
-          refractiveindex(mat_json.value("refractiveindex", 1.0f)) {}
+          refractiveindex(mat_json.value("refractiveindex", 1.0f))
+    {
+        if (mat_json.contains("texture"))
+            texture = Texture::load(mat_json["texture"].get<std::string>());
+    }
+
+    // Diffuse colour at the hit, filtered over a lookup footprint in world units.
+    Color albedo(const Hit_record &rec, float footprint) const
+    {
+        if (!texture)
+            return diffusecolor;
+        return diffusecolor * texture->sample(rec.uv, footprint * rec.uv_per_unit);
+    }
 
     // Return emission color if the material is emissive
     Color emit() const
@@ -45,7 +58,19 @@ public:
         return emissioncolor;
     }
 
-    virtual bool scatter(const Ray &rayIn, const Hit_record &rec, Vector3 &attenuation, Ray &scattered) const {}
+    virtual bool scatter(const Ray &rayIn, const Hit_record &rec, Vector3 &attenuation, Ray &scattered) const
+    {
+        return false;
+    }
+
+    // Density (per solid angle) with which scatter picks direction at rec;
+    // 0 where it only scatters into single directions (mirrors, glass), which
+    // sampling a light can never hit. Where it is not 0, scatter's attenuation
+    // times this is the BSDF times the cosine for that direction.
+    virtual float scatter_pdf(const Hit_record &rec, const Vector3 &direction) const
+    {
+        return 0;
+    }
 };
 
 class Dielectric : public Material
@@ -74,7 +99,7 @@ public:
         }
 
         float reflect_prob = schlick(cos_theta, etai_over_etat);
-        if (random_double() < reflect_prob)
+        if (sample_1d() < reflect_prob)
         {
             Vector3 reflected = reflect(unit_direction, rec.normal);
             scattered = Ray(rec.p, reflected);
@@ -98,11 +123,21 @@ public:
 
     virtual bool scatter(const Ray &rayIn, const Hit_record &rec, Vector3 &attenuation, Ray &scattered) const override
     {
-        Vector3 scatter_direction = rec.normal + random_unit_vector();
+        Vector2 u = sample_2d();
+        Vector3 scatter_direction = rec.normal + sample_unit_vector(u.x, u.y);
+        // The random vector can cancel the normal almost exactly.
+        if (scatter_direction.length_squared() < 1e-12)
+            scatter_direction = rec.normal;
         scattered = Ray(rec.p, scatter_direction);
         attenuation = diffusecolor;
         return true;
     }
+
+    // The normal plus a uniform unit vector is cosine distributed.
+    virtual float scatter_pdf(const Hit_record &rec, const Vector3 &direction) const override
+    {
+        return static_cast<float>(std::max(0.0, rec.normal.dot(direction) / direction.length()) / pi);
+    }
 };
 
 class Metal : public Material
@@ -119,7 +154,9 @@ public:
     virtual bool scatter(const Ray &rayIn, const Hit_record &rec, Vector3 &attenuation, Ray &scattered) const override
     {
         Vector3 reflected = reflect(unit(rayIn.direction), rec.normal);
-        scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere());
+        Vector2 u = sample_2d();
+        double u3 = sample_1d();
+        scattered = Ray(rec.p, reflected + fuzz * sample_unit_sphere(u.x, u.y, u3));
         attenuation = diffusecolor;
         return (scattered.direction.dot(rec.normal) > 0);
     }
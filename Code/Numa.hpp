@@ -0,0 +1,304 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include "Parallel.hpp"
+#include "Region.hpp"
+#include "Vector3.hpp"
+
+using Color = Vector3;
+
+// NUMA-aware tile rendering without any library: the topology comes from
+// /sys/devices/system/node, every worker thread is pinned to one CPU, and
+// memory is placed on a node simply by having one of its threads touch it
+// first (Linux's default policy). Each node renders a band of the image into
+// a buffer it allocated itself, and can be given its own copy of the scene.
+
+struct NumaNode
+{
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+inline std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0])))
+            continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// The nodes with CPUs this process may run on, in id order. Without /sys
+// (or outside Linux) everything is one node.
+inline std::vector<NumaNode> detect_numa_nodes()
+{
+    std::vector<int> allowed;
+#ifdef __linux__
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &mask))
+                allowed.push_back(cpu);
+#endif
+    if (allowed.empty())
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+            allowed.push_back(static_cast<int>(cpu));
+
+    std::vector<NumaNode> nodes;
+    if (DIR *dir = opendir("/sys/devices/system/node"))
+    {
+        while (dirent *entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name.size() <= 4 || name.compare(0, 4, "node") != 0 || !std::isdigit(static_cast<unsigned char>(name[4])))
+                continue;
+            std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+            std::string list;
+            std::getline(file, list);
+            NumaNode node;
+            node.id = std::stoi(name.substr(4));
+            for (int cpu : parse_cpu_list(list))
+                if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+                    node.cpus.push_back(cpu);
+            if (!node.cpus.empty())
+                nodes.push_back(node);
+        }
+        closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode &a, const NumaNode &b)
+              { return a.id < b.id; });
+    if (nodes.empty())
+        nodes.push_back(NumaNode{0, allowed});
+    return nodes;
+}
+
+inline bool pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+    return false;
+#endif
+}
+
+// One thread per CPU of the given nodes, each pinned for its whole life.
+// run() hands the same job to every worker and waits for all of them;
+// run_chunks() shares chunks of a job out among them.
+class NumaThreadPool : public ChunkExecutor
+{
+public:
+    explicit NumaThreadPool(std::vector<NumaNode> numa_nodes) : node_list(std::move(numa_nodes))
+    {
+        for (size_t n = 0; n < node_list.size(); ++n)
+        {
+            first_worker.push_back(worker_node.size());
+            for (int cpu : node_list[n].cpus)
+            {
+                size_t worker = worker_node.size();
+                worker_node.push_back(n);
+                threads.emplace_back([this, worker, cpu]
+                                     { work(worker, cpu); });
+            }
+        }
+    }
+
+    ~NumaThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    NumaThreadPool(const NumaThreadPool &) = delete;
+    NumaThreadPool &operator=(const NumaThreadPool &) = delete;
+
+    const std::vector<NumaNode> &nodes() const { return node_list; }
+    size_t size() const { return threads.size(); }
+    size_t pinned() const { return pinned_count.load(); }
+
+    // job(worker, node) on every worker.
+    void run(const std::function<void(size_t, size_t)> &task)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job = &task;
+        pending = threads.size();
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [this]
+                  { return pending == 0; });
+        job = nullptr;
+    }
+
+    size_t thread_count() const override { return threads.size(); }
+
+    // fn(chunk) for chunks [0, chunks), handed to the workers as they free up.
+    void run_chunks(size_t chunks, const std::function<void(size_t)> &fn) override
+    {
+        if (threads.empty())
+        {
+            for (size_t c = 0; c < chunks; ++c)
+                fn(c);
+            return;
+        }
+        std::atomic<size_t> next{0};
+        run([&](size_t, size_t)
+            {
+            for (size_t c; (c = next.fetch_add(1)) < chunks;)
+                fn(c); });
+    }
+
+    // job(node) on one worker of every node, e.g. to allocate memory there.
+    void run_once_per_node(const std::function<void(size_t)> &task)
+    {
+        run([&](size_t worker, size_t node)
+            {
+            if (worker == first_worker[node])
+                task(node); });
+    }
+
+private:
+    std::vector<NumaNode> node_list;
+    std::vector<size_t> worker_node, first_worker;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> pinned_count{0};
+
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t, size_t)> *job = nullptr;
+    uint64_t generation = 0;
+    size_t pending = 0;
+    bool stopping = false;
+
+    void work(size_t worker, int cpu)
+    {
+        if (pin_current_thread(cpu))
+            ++pinned_count;
+        uint64_t seen = 0;
+        while (true)
+        {
+            const std::function<void(size_t, size_t)> *task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]
+                          { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                task = job;
+            }
+            (*task)(worker, worker_node[worker]);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                done.notify_one();
+        }
+    }
+};
+
+struct NumaNodeStats
+{
+    int rows = 0;
+    size_t tiles = 0, stolen = 0; // tiles rendered by this node's threads, and how many came from other nodes
+    double busy_seconds = 0;      // summed over the node's threads
+};
+
+// Renders region in tiles on the pool. Each node owns a band of rows, in
+// proportion to its CPU count, and a band buffer allocated by its own
+// threads; its threads take tiles from their band first and only then help
+// other nodes. render_tile(node, tile, band, band_first_row) adds the tile's
+// samples to band, which holds whole image rows from band_first_row on. The
+// bands are added to framebuffer (whole image rows) at the end.
+template <typename RenderTile>
+std::vector<NumaNodeStats> render_tiles_numa(NumaThreadPool &pool, std::vector<Color> &framebuffer, int width,
+                                             const Region &region, int tile_size, RenderTile render_tile)
+{
+    const std::vector<NumaNode> &nodes = pool.nodes();
+    size_t cpus = 0;
+    for (const NumaNode &node : nodes)
+        cpus += node.cpus.size();
+
+    struct Band
+    {
+        int y0 = 0, y1 = 0;
+        std::vector<Color> pixels;
+        std::vector<Region> tiles;
+        std::atomic<size_t> next{0};
+    };
+    std::vector<Band> bands(nodes.size());
+    size_t cpus_before = 0;
+    for (size_t n = 0; n < nodes.size(); ++n)
+    {
+        bands[n].y0 = region.y0 + int(int64_t(region.height()) * cpus_before / cpus);
+        cpus_before += nodes[n].cpus.size();
+        bands[n].y1 = region.y0 + int(int64_t(region.height()) * cpus_before / cpus);
+        for (int ty = bands[n].y0; ty < bands[n].y1; ty += tile_size)
+            for (int tx = region.x0; tx < region.x1; tx += tile_size)
+                bands[n].tiles.push_back(Region{tx, ty, std::min(tx + tile_size, region.x1), std::min(ty + tile_size, bands[n].y1)});
+    }
+    // First touch by the owning node puts each band's pages in its memory.
+    pool.run_once_per_node([&](size_t n)
+                           { bands[n].pixels.assign(size_t(bands[n].y1 - bands[n].y0) * width, Color(0, 0, 0)); });
+
+    std::vector<NumaNodeStats> stats(nodes.size());
+    std::mutex stats_mutex;
+    pool.run([&](size_t, size_t node)
+             {
+        auto start = std::chrono::steady_clock::now();
+        size_t done = 0, stolen = 0;
+        for (size_t k = 0; k < nodes.size(); ++k)
+        {
+            Band &band = bands[(node + k) % nodes.size()];
+            for (size_t t; (t = band.next.fetch_add(1)) < band.tiles.size();)
+            {
+                render_tile(node, band.tiles[t], band.pixels, band.y0);
+                ++done;
+                stolen += k > 0;
+            }
+        }
+        std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats[node].tiles += done;
+        stats[node].stolen += stolen;
+        stats[node].busy_seconds += busy.count(); });
+
+    pool.run_once_per_node([&](size_t n)
+                           {
+        const Band &band = bands[n];
+        for (int y = band.y0; y < band.y1; ++y)
+            for (int x = region.x0; x < region.x1; ++x)
+                framebuffer[size_t(y) * width + x] += band.pixels[size_t(y - band.y0) * width + x]; });
+
+    for (size_t n = 0; n < nodes.size(); ++n)
+        stats[n].rows = bands[n].y1 - bands[n].y0;
+    return stats;
+}
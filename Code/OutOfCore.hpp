@@ -0,0 +1,421 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "BVH.hpp"
+#include "CompiledScene.hpp"
+
+// Out-of-core static geometry. Shapes are sorted along a Morton curve and cut
+// into chunks of neighbouring shapes; each chunk is compiled (CompiledScene
+// layout, with its own BVH) and written to a scratch file, page aligned. Only
+// a small proxy per chunk stays resident, under a top-level BVH over the
+// chunk bounds. A chunk's arrays are mapped in from the file when a ray first
+// reaches it, and an LRU of mapped chunks keeps them under a byte budget,
+// like the texture tile cache.
+
+struct GeometryCacheStats
+{
+    uint64_t lookups = 0;
+    uint64_t page_ins = 0; // chunks mapped in from the file
+    uint64_t evictions = 0;
+    uint64_t bytes_read = 0;
+    size_t resident_bytes = 0;
+};
+
+// A chunk's arrays mapped from the file; unmapped once the cache and every
+// ray using it have let go.
+struct MappedChunk
+{
+    void *address = nullptr;
+    size_t length = 0;
+    CompiledArrays arrays{};
+
+    ~MappedChunk()
+    {
+        if (address)
+            munmap(address, length);
+    }
+};
+
+class GeometryCache
+{
+public:
+    static GeometryCache &shared()
+    {
+        static GeometryCache cache;
+        return cache;
+    }
+
+    void set_budget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget_bytes = bytes;
+        evict_over_budget();
+    }
+
+    size_t budget() const { return budget_bytes; }
+
+    GeometryCacheStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        GeometryCacheStats s = counters;
+        s.resident_bytes = resident_bytes;
+        return s;
+    }
+
+    // Keys are (scene serial, chunk id), so scenes never see each other's chunks.
+    static uint64_t key(uint64_t scene, uint32_t id) { return scene << 32 | id; }
+
+    // Returns the chunk stored under key, calling load() to map it on a miss.
+    template <typename Loader>
+    std::shared_ptr<const MappedChunk> fetch(uint64_t key, Loader load)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++counters.lookups;
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+        ++counters.page_ins;
+
+        // Read outside the lock so other threads keep using resident chunks.
+        lock.unlock();
+        std::shared_ptr<const MappedChunk> chunk = load();
+        lock.lock();
+
+        counters.bytes_read += chunk->length;
+        it = index.find(key);
+        if (it != index.end())
+            return it->second->second; // another thread mapped it meanwhile
+
+        lru.emplace_front(key, chunk);
+        index[key] = lru.begin();
+        resident_bytes += chunk->length;
+        evict_over_budget();
+        return chunk;
+    }
+
+    // Forgets every chunk of a scene that is going away; their arrays point
+    // into its material table.
+    void drop(uint64_t scene)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end();)
+        {
+            if (it->first >> 32 != scene)
+            {
+                ++it;
+                continue;
+            }
+            resident_bytes -= it->second->length;
+            index.erase(it->first);
+            it = lru.erase(it);
+        }
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<const MappedChunk>>;
+
+    mutable std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t budget_bytes = size_t(256) << 20;
+    size_t resident_bytes = 0;
+    GeometryCacheStats counters;
+
+    void evict_over_budget()
+    {
+        // Always keep the chunk just mapped, even with a tiny budget.
+        while (resident_bytes > budget_bytes && lru.size() > 1)
+        {
+            resident_bytes -= lru.back().second->length;
+            index.erase(lru.back().first);
+            lru.pop_back();
+            ++counters.evictions;
+        }
+    }
+};
+
+// Interleaves the low 10 bits of x, y and z.
+inline uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z)
+{
+    auto spread = [](uint32_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    };
+    return (spread(x) << 2) | (spread(y) << 1) | spread(z);
+}
+
+class OutOfCoreScene;
+
+// The resident part of a chunk: its bounds and where its arrays are in the file.
+class GeometryChunk : public Hittable
+{
+public:
+    GeometryChunk(const OutOfCoreScene *scene, uint32_t id, const box_ab &bounds) : scene(scene), id(id), bounds(bounds) {}
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override;
+
+    // The chunk itself is the occluder ShadowCache keeps.
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override;
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        output_box = bounds;
+        return true;
+    }
+
+    off_t offset = 0; // page aligned
+    size_t bytes = 0;
+    uint32_t nodes = 0, spheres = 0, triangles = 0, cylinders = 0;
+
+private:
+    const OutOfCoreScene *scene;
+    uint32_t id;
+    box_ab bounds;
+};
+
+class OutOfCoreScene : public Hittable
+{
+public:
+    // Writes objects out in chunks of up to shapes_per_chunk shapes. Spheres,
+    // triangles and cylinders only (all parseScene makes); the caller may free
+    // the shapes afterwards. objects is reordered.
+    OutOfCoreScene(std::vector<shared_ptr<Hittable>> &objects, size_t shapes_per_chunk)
+    {
+        file = std::tmpfile();
+        if (!file)
+        {
+            std::cerr << "Could not create the out-of-core geometry file." << std::endl;
+            return;
+        }
+        fd = fileno(file);
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+        // Morton order of the box centres keeps each chunk spatially compact.
+        std::vector<box_ab> boxes(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i)
+            objects[i]->bounding_box(0, 0, boxes[i]);
+        box_ab scene_box = boxes[0];
+        for (const box_ab &box : boxes)
+            scene_box = surrounding_box(scene_box, box);
+        Vector3 extent = scene_box.max() - scene_box.min();
+        std::vector<std::pair<uint32_t, uint32_t>> order(objects.size()); // (code, shape)
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            Vector3 c = (boxes[i].min() + boxes[i].max()) * 0.5f - scene_box.min();
+            auto cell = [](float v, float e)
+            { return static_cast<uint32_t>(e > 0 ? std::min(1023.0f, v / e * 1024) : 0); };
+            order[i] = {morton_code(cell(c.x, extent.x), cell(c.y, extent.y), cell(c.z, extent.z)), static_cast<uint32_t>(i)};
+        }
+        std::sort(order.begin(), order.end());
+        std::vector<shared_ptr<Hittable>> sorted(objects.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            sorted[i] = objects[order[i].second];
+        objects.swap(sorted);
+
+        std::vector<shared_ptr<Hittable>> proxies;
+        off_t end = 0;
+        for (size_t begin = 0; begin < objects.size(); begin += shapes_per_chunk)
+        {
+            size_t last = std::min(objects.size(), begin + shapes_per_chunk);
+            BVHNode chunk_bvh(objects, begin, last, 0.0, 0);
+            CompiledScene compiled(chunk_bvh);
+            CompiledSceneStats counts = compiled.stats();
+            CompiledArrays arrays = compiled.arrays();
+
+            box_ab bounds;
+            compiled.bounding_box(0, 0, bounds);
+            auto chunk = std::make_shared<GeometryChunk>(this, static_cast<uint32_t>(chunks.size()), bounds);
+            chunk->offset = end;
+            chunk->nodes = static_cast<uint32_t>(counts.nodes);
+            chunk->spheres = static_cast<uint32_t>(counts.spheres);
+            chunk->triangles = static_cast<uint32_t>(counts.triangles);
+            chunk->cylinders = static_cast<uint32_t>(counts.cylinders);
+
+            // Materials stay resident; the file refers to them by index.
+            std::vector<CompiledSphere> spheres(arrays.spheres, arrays.spheres + counts.spheres);
+            std::vector<CompiledTriangle> triangles(arrays.triangles, arrays.triangles + counts.triangles);
+            std::vector<CompiledCylinder> cylinders(arrays.cylinders, arrays.cylinders + counts.cylinders);
+            for (auto &s : spheres)
+                s = relocated(s, arrays);
+            for (auto &t : triangles)
+                t = relocated(t, arrays);
+            for (auto &c : cylinders)
+                c = relocated(c, arrays);
+
+            off_t at = end;
+            ok = ok && write_all(arrays.nodes, counts.nodes * sizeof(CompiledNode), at) &&
+                 write_all(spheres.data(), spheres.size() * sizeof(CompiledSphere), at) &&
+                 write_all(triangles.data(), triangles.size() * sizeof(CompiledTriangle), at) &&
+                 write_all(cylinders.data(), cylinders.size() * sizeof(CompiledCylinder), at);
+            chunk->bytes = static_cast<size_t>(at - end);
+            end = static_cast<off_t>((static_cast<size_t>(at) + page - 1) / page * page);
+            file_bytes = static_cast<size_t>(end);
+
+            chunks.push_back(chunk.get());
+            proxies.push_back(chunk);
+        }
+        if (!ok)
+            std::cerr << "Could not write the out-of-core geometry file." << std::endl;
+        top_bvh = std::make_unique<BVHNode>(proxies, 0, proxies.size(), 0.0, 0);
+        // Compiled and quantized, the top level visits chunks nearest first and
+        // stops at the closest hit, so far chunks are rarely paged in.
+        top = std::make_unique<CompiledScene>(*top_bvh, true);
+    }
+
+    ~OutOfCoreScene()
+    {
+        GeometryCache::shared().drop(serial);
+        if (file)
+            std::fclose(file);
+    }
+    OutOfCoreScene(const OutOfCoreScene &) = delete;
+    OutOfCoreScene &operator=(const OutOfCoreScene &) = delete;
+
+    bool valid() const { return ok && top; }
+    size_t chunk_count() const { return chunks.size(); }
+    size_t bytes_on_disk() const { return file_bytes; }
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
+    {
+        return top->hit(r, t_min, t_max, rec);
+    }
+
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override
+    {
+        return top->any_hit(r, t_min, t_max);
+    }
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        return top->bounding_box(t0, t1, output_box);
+    }
+
+    // Repeated visits to one chunk by a thread skip the shared cache; the
+    // reference held keeps the chunk mapped even if the cache evicts it.
+    const MappedChunk &mapped(uint32_t id) const
+    {
+        struct Last
+        {
+            uint64_t scene = 0;
+            uint32_t id = 0;
+            std::shared_ptr<const MappedChunk> chunk;
+        };
+        thread_local Last last;
+        if (last.scene != serial || last.id != id)
+        {
+            last.chunk = map(id);
+            last.scene = serial;
+            last.id = id;
+        }
+        return *last.chunk;
+    }
+
+    std::shared_ptr<const MappedChunk> map(uint32_t id) const
+    {
+        return GeometryCache::shared().fetch(GeometryCache::key(serial, id), [&]
+                                             {
+            const GeometryChunk &chunk = *chunks[id];
+            auto mapped = std::make_shared<MappedChunk>();
+            // MAP_POPULATE reads the whole chunk now rather than fault by fault.
+            void *address = mmap(nullptr, chunk.bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, chunk.offset);
+            if (address == MAP_FAILED)
+            {
+                std::cerr << "Could not map geometry chunk " << id << "." << std::endl;
+                std::abort();
+            }
+            mapped->address = address;
+            mapped->length = chunk.bytes;
+            const char *p = static_cast<const char *>(address);
+            mapped->arrays.nodes = reinterpret_cast<const CompiledNode *>(p);
+            p += chunk.nodes * sizeof(CompiledNode);
+            mapped->arrays.spheres = reinterpret_cast<const CompiledSphere *>(p);
+            p += chunk.spheres * sizeof(CompiledSphere);
+            mapped->arrays.triangles = reinterpret_cast<const CompiledTriangle *>(p);
+            p += chunk.triangles * sizeof(CompiledTriangle);
+            mapped->arrays.cylinders = reinterpret_cast<const CompiledCylinder *>(p);
+            mapped->arrays.others = nullptr;
+            mapped->arrays.materials = materials.data();
+            return std::shared_ptr<const MappedChunk>(mapped); });
+    }
+
+private:
+    uint64_t serial = next_serial();
+    std::FILE *file = nullptr;
+    int fd = -1;
+    bool ok = true;
+    size_t file_bytes = 0;
+    std::vector<const GeometryChunk *> chunks; // owned by top_bvh
+    std::unique_ptr<BVHNode> top_bvh;
+    std::unique_ptr<CompiledScene> top;
+    std::vector<shared_ptr<Material>> materials;
+    std::unordered_map<const Material *, uint32_t> material_index;
+
+    static uint64_t next_serial()
+    {
+        static std::atomic<uint64_t> counter(0);
+        return ++counter;
+    }
+
+    // A copy with its material index into our table and no pointer back to the shape.
+    template <typename Primitive>
+    Primitive relocated(Primitive primitive, const CompiledArrays &arrays)
+    {
+        const shared_ptr<Material> &material = arrays.materials[primitive.material];
+        auto found = material_index.find(material.get());
+        if (found == material_index.end())
+        {
+            materials.push_back(material);
+            found = material_index.emplace(material.get(), static_cast<uint32_t>(materials.size() - 1)).first;
+        }
+        primitive.material = found->second;
+        primitive.source = nullptr;
+        return primitive;
+    }
+
+    bool write_all(const void *data, size_t size, off_t &offset)
+    {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            ssize_t n = pwrite(fd, p, size, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+};
+
+inline bool GeometryChunk::hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
+{
+    return scene->mapped(id).arrays.hit(r, t_min, t_max, rec);
+}
+
+inline const Hittable *GeometryChunk::any_hit(const Ray &r, double t_min, double t_max) const
+{
+    return scene->mapped(id).arrays.any_hit(r, t_min, t_max) ? this : nullptr;
+}
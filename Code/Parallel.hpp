@@ -0,0 +1,74 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+
+inline unsigned worker_count()
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Threads kept for running chunks of work, so a caller that runs many short
+// stages (the wavefront path tracer) does not start threads for each one.
+class ChunkExecutor
+{
+public:
+    virtual ~ChunkExecutor() = default;
+    virtual size_t thread_count() const = 0;
+    // fn(chunk) for every chunk in [0, chunks), in any order on any thread;
+    // returns once all have run.
+    virtual void run_chunks(size_t chunks, const std::function<void(size_t)> &fn) = 0;
+};
+
+// Splits [0, count) into contiguous chunks and runs fn(chunk, begin, end) for
+// each one: on executor's threads if given, else chunk 0 on the calling
+// thread and the rest through std::async. The split is the same either way.
+template <typename F>
+void parallel_chunks(size_t count, size_t chunks, F fn, ChunkExecutor *executor = nullptr)
+{
+    if (count == 0)
+        return;
+    chunks = std::max<size_t>(1, std::min(chunks, count));
+    size_t per_chunk = (count + chunks - 1) / chunks;
+
+    if (executor)
+    {
+        executor->run_chunks(chunks, [&](size_t c)
+                             {
+            size_t begin = c * per_chunk;
+            size_t end = std::min(count, begin + per_chunk);
+            if (begin < end)
+                fn(c, begin, end); });
+        return;
+    }
+
+    std::vector<std::future<void>> pending;
+    for (size_t c = 1; c < chunks; ++c)
+    {
+        size_t begin = c * per_chunk;
+        size_t end = std::min(count, begin + per_chunk);
+        if (begin >= end)
+            break;
+        pending.push_back(std::async(std::launch::async, [&fn, c, begin, end]
+                                     { fn(c, begin, end); }));
+    }
+    fn(0, 0, std::min(count, per_chunk));
+
+    for (auto &f : pending)
+        f.get();
+}
+
+// fn(i) for every i in [0, count), spread over all hardware threads (or over
+// executor's, in a few chunks per thread so none sits idle at the end).
+template <typename F>
+void parallel_for(size_t count, F fn, ChunkExecutor *executor = nullptr)
+{
+    size_t chunks = executor ? executor->thread_count() * 4 : worker_count();
+    parallel_chunks(count, chunks, [&fn](size_t, size_t begin, size_t end)
+                    {
+        for (size_t i = begin; i < end; ++i)
+            fn(i); }, executor);
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "HitRecord.hpp"
+#include "Hittable.hpp"
+#include "Parallel.hpp"
+#include "Ray.hpp"
+#include "Vector3.hpp"
+
+using Color = Vector3;
+
+// Fast previews: shadows from precomputed depth cubemaps instead of shadow
+// rays, and an image rendered at a fraction of the resolution and scaled up.
+
+// Distance from a point light to the nearest surface in every direction, on
+// the six faces of a cube around it. Texel (i, j) of face 2k (+axis k) or
+// 2k + 1 (-axis k) looks along axis k with the next two axes at
+// ((i + 0.5) / size * 2 - 1, (j + 0.5) / size * 2 - 1).
+class ShadowCubemap
+{
+public:
+    // One ray per texel through the scene's acceleration structure, rows in parallel.
+    ShadowCubemap(const Vector3 &light_position, const Hittable &world, int size)
+        : light(light_position), size(size), depth(size_t(6) * size * size)
+    {
+        parallel_for(size_t(6) * size, [&](size_t row)
+                     {
+            int face = int(row / size), j = int(row % size);
+            float *texel = &depth[row * size];
+            for (int i = 0; i < size; ++i)
+            {
+                Ray ray(light, direction(face, (i + 0.5f) / size * 2 - 1, (j + 0.5f) / size * 2 - 1));
+                Hit_record rec;
+                texel[i] = world.hit(ray, 0.001, std::numeric_limits<double>::infinity(), rec)
+                               ? static_cast<float>(rec.t * ray.direction.length())
+                               : std::numeric_limits<float>::infinity();
+            } });
+    }
+
+    // Fraction of the light reaching p (on a surface with the given normal),
+    // from the four nearest texels' depth tests weighted bilinearly (2x2 PCF).
+    float visibility(const Vector3 &p, const Vector3 &normal) const
+    {
+        Vector3 d = p - light;
+        float dist = static_cast<float>(d.length());
+        if (dist == 0)
+            return 1;
+        float ax = std::fabs(d.x), ay = std::fabs(d.y), az = std::fabs(d.z);
+        int axis = (ax >= ay && ax >= az) ? 0 : (ay >= az ? 1 : 2);
+        float major = axis == 0 ? d.x : axis == 1 ? d.y : d.z;
+        float u = axis == 0 ? d.y : axis == 1 ? d.z : d.x;
+        float v = axis == 0 ? d.z : axis == 1 ? d.x : d.y;
+        int face = 2 * axis + (major < 0);
+        float inv = 1 / std::fabs(major);
+
+        // A texel spans about 2 / size radians; on a surface tilted away from
+        // the light the depths across it differ by that times the slope.
+        float cos_theta = std::min(1.0f, static_cast<float>(std::fabs(normal.dot(d)) / dist));
+        float slope = std::min(4.0f, std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta)) / std::max(cos_theta, 1e-3f));
+        float bias = dist * (2.0f / size) * (1 + slope) + 1e-3f;
+
+        float s = (u * inv + 1) * 0.5f * size - 0.5f, t = (v * inv + 1) * 0.5f * size - 0.5f;
+        int i0 = std::min(std::max(int(std::floor(s)), 0), size - 1), j0 = std::min(std::max(int(std::floor(t)), 0), size - 1);
+        int i1 = std::min(i0 + 1, size - 1), j1 = std::min(j0 + 1, size - 1);
+        float fs = std::min(std::max(s - i0, 0.0f), 1.0f), ft = std::min(std::max(t - j0, 0.0f), 1.0f);
+        auto lit = [&](int i, int j)
+        { return dist <= depth[(size_t(face) * size + j) * size + i] + bias ? 1.0f : 0.0f; };
+        return (lit(i0, j0) * (1 - fs) + lit(i1, j0) * fs) * (1 - ft) + (lit(i0, j1) * (1 - fs) + lit(i1, j1) * fs) * ft;
+    }
+
+    size_t bytes() const { return depth.size() * sizeof(float); }
+
+private:
+    Vector3 light;
+    int size;
+    std::vector<float> depth;
+
+    static Vector3 direction(int face, float u, float v)
+    {
+        float major = face & 1 ? -1.0f : 1.0f;
+        switch (face / 2)
+        {
+        case 0:
+            return Vector3(major, u, v);
+        case 1:
+            return Vector3(v, major, u);
+        default:
+            return Vector3(u, v, major);
+        }
+    }
+};
+
+// A width x height framebuffer resampled to out_width x out_height with
+// bilinear filtering between pixel centres, rows in parallel.
+inline std::vector<Color> upscale_bilinear(const std::vector<Color> &framebuffer, int width, int height, int out_width, int out_height)
+{
+    std::vector<Color> out(size_t(out_width) * out_height);
+    float sx = float(width) / out_width, sy = float(height) / out_height;
+    parallel_for(static_cast<size_t>(out_height), [&](size_t y)
+                 {
+        float fy = std::min(std::max((y + 0.5f) * sy - 0.5f, 0.0f), float(height - 1));
+        int y0 = int(fy), y1 = std::min(y0 + 1, height - 1);
+        float ty = fy - y0;
+        for (int x = 0; x < out_width; ++x)
+        {
+            float fx = std::min(std::max((x + 0.5f) * sx - 0.5f, 0.0f), float(width - 1));
+            int x0 = int(fx), x1 = std::min(x0 + 1, width - 1);
+            float tx = fx - x0;
+            const Color *row0 = &framebuffer[size_t(y0) * width], *row1 = &framebuffer[size_t(y1) * width];
+            out[y * out_width + x] = (row0[x0] * (1 - tx) + row0[x1] * tx) * (1 - ty) + (row1[x0] * (1 - tx) + row1[x1] * tx) * ty;
+        } });
+    return out;
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "Region.hpp"
+#include "Parallel.hpp"
+#include "Vector3.hpp"
+
+using Color = Vector3;
+
+// Progressive rendering: the image is built from successive full passes of a
+// few samples per pixel each, accumulated into the framebuffer. After any pass
+// the buffer is a complete (if noisy) image, so the loop can stop at a
+// wall-clock budget, at a noise target or on Ctrl-C without losing anything.
+
+struct ProgressiveSettings
+{
+    int samples_per_pass = 1;
+    int max_samples = 0;         // 0: no sample limit
+    double time_budget = 0;      // seconds, 0: no deadline
+    double target_error = 0;     // relative RMS noise estimate, 0: off
+    double snapshot_seconds = 0; // write a snapshot this often, 0: off
+    int snapshot_passes = 0;     // ... or every this many passes, 0: off
+};
+
+struct ProgressiveResult
+{
+    int samples = 0;
+    int passes = 0;
+    double seconds = 0;
+    double error = 0; // last noise estimate (only tracked with a target)
+    std::string stop_reason;
+};
+
+inline volatile std::sig_atomic_t &progressive_cancel_flag()
+{
+    static volatile std::sig_atomic_t flag = 0;
+    return flag;
+}
+
+inline void progressive_on_sigint(int)
+{
+    progressive_cancel_flag() = 1;
+    // A second Ctrl-C kills the process as usual.
+    std::signal(SIGINT, SIG_DFL);
+}
+
+// "30s", "500ms", "2m", "1h" or a bare number of seconds. Returns -1 if unparsable.
+inline double parse_duration(const std::string &text)
+{
+    size_t used = 0;
+    double value;
+    try
+    {
+        value = std::stod(text, &used);
+    }
+    catch (...)
+    {
+        return -1;
+    }
+    std::string unit = text.substr(used);
+    if (unit.empty() || unit == "s")
+        return value;
+    if (unit == "ms")
+        return value / 1000;
+    if (unit == "m")
+        return value * 60;
+    if (unit == "h")
+        return value * 3600;
+    return -1;
+}
+
+// Relative RMS difference between the image from all samples and the image
+// from the even passes only. It shrinks like the noise does, so it serves as
+// a convergence measure without a reference image.
+inline double estimate_noise(const std::vector<Color> &all, int all_samples, const std::vector<Color> &half,
+                             int half_samples, const Region &region, int width)
+{
+    size_t chunks = worker_count();
+    std::vector<double> diff_sums(chunks, 0), level_sums(chunks, 0);
+    parallel_chunks(region.area(), chunks, [&](size_t c, size_t begin, size_t end)
+                    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            size_t pixel = size_t(region.y0 + i / region.width()) * width + region.x0 + i % region.width();
+            Color a = all[pixel] / all_samples;
+            Color b = half[i] / half_samples;
+            Color d = a - b;
+            diff_sums[c] += d.length_squared() / 3;
+            level_sums[c] += (a.x + a.y + a.z) / 3;
+        } });
+
+    double diff = 0, level = 0;
+    for (size_t c = 0; c < chunks; ++c)
+    {
+        diff += diff_sums[c];
+        level += level_sums[c];
+    }
+    double n = static_cast<double>(region.area());
+    return std::sqrt(diff / n) / std::max(level / n, 1e-6);
+}
+
+// render_pass(first_sample, samples) must add those samples of every pixel in
+// region to framebuffer; snapshot(samples) is called to publish the image.
+template <typename RenderPass, typename Snapshot>
+ProgressiveResult render_progressive(std::vector<Color> &framebuffer, const Region &region, int width,
+                                     const ProgressiveSettings &settings, RenderPass render_pass, Snapshot snapshot)
+{
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point t)
+    { return std::chrono::duration<double>(clock::now() - t).count(); };
+
+    progressive_cancel_flag() = 0;
+    auto previous_handler = std::signal(SIGINT, progressive_on_sigint);
+
+    ProgressiveResult result;
+    std::vector<Color> even_passes, before_pass;
+    int even_samples = 0;
+    if (settings.target_error > 0)
+        even_passes.assign(region.area(), Color(0, 0, 0));
+
+    auto start = clock::now();
+    auto last_snapshot = start;
+    double last_pass_seconds = 0;
+    int per_pass = std::max(1, settings.samples_per_pass);
+
+    while (true)
+    {
+        if (progressive_cancel_flag())
+        {
+            result.stop_reason = "interrupt";
+            break;
+        }
+        if (settings.max_samples > 0 && result.samples >= settings.max_samples)
+        {
+            result.stop_reason = "sample limit";
+            break;
+        }
+        // Only start a pass that is expected to finish inside the budget.
+        if (settings.time_budget > 0 && result.passes > 0 && seconds_since(start) + last_pass_seconds > settings.time_budget)
+        {
+            result.stop_reason = "time budget";
+            break;
+        }
+
+        int samples = per_pass;
+        if (settings.max_samples > 0)
+            samples = std::min(samples, settings.max_samples - result.samples);
+
+        bool even = settings.target_error > 0 && result.passes % 2 == 0;
+        if (even)
+        {
+            before_pass.resize(region.area());
+            for (size_t i = 0; i < region.area(); ++i)
+                before_pass[i] = framebuffer[size_t(region.y0 + i / region.width()) * width + region.x0 + i % region.width()];
+        }
+
+        auto pass_start = clock::now();
+        render_pass(result.samples, samples);
+        last_pass_seconds = seconds_since(pass_start);
+        result.samples += samples;
+        ++result.passes;
+
+        if (settings.target_error > 0)
+        {
+            if (even)
+            {
+                for (size_t i = 0; i < region.area(); ++i)
+                    even_passes[i] += framebuffer[size_t(region.y0 + i / region.width()) * width + region.x0 + i % region.width()] - before_pass[i];
+                even_samples += samples;
+            }
+            // Needs at least one odd pass to compare against.
+            if (result.passes >= 2)
+            {
+                result.error = estimate_noise(framebuffer, result.samples, even_passes, even_samples, region, width);
+                if (result.error <= settings.target_error)
+                {
+                    result.stop_reason = "noise target";
+                    break;
+                }
+            }
+        }
+
+        bool snapshot_due = (settings.snapshot_passes > 0 && result.passes % settings.snapshot_passes == 0) ||
+                            (settings.snapshot_seconds > 0 && seconds_since(last_snapshot) >= settings.snapshot_seconds);
+        if (snapshot_due)
+        {
+            snapshot(result.samples);
+            last_snapshot = clock::now();
+        }
+    }
+
+    std::signal(SIGINT, previous_handler);
+    result.seconds = seconds_since(start);
+    return result;
+}
@@ -5,6 +5,10 @@ class Ray
 public:
     Vector3 origin;
     Vector3 direction;
+    // Ray cone for texture filtering: width at the origin and growth per unit
+    // of travelled distance. Zero means "no footprint" (finest mip level).
+    float cone_width = 0;
+    float cone_spread = 0;
 
     Ray() {}
     //default contr with no values
@@ -16,4 +20,9 @@ public:
     {
         return origin + direction * t;
     }
+
+    float cone_width_at(double t) const
+    {
+        return cone_width + cone_spread * t * direction.length();
+    }
 };
\ No newline at end of file
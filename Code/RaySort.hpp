@@ -0,0 +1,111 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "classbox_ab.hpp"
+#include "Parallel.hpp"
+
+// Morton-code ray reordering. Secondary rays leave surfaces in scattered
+// directions; tracing them in pixel order makes neighbouring rays walk
+// unrelated parts of the BVH. Sorting by a key whose high bits are the Morton
+// code of the origin and whose low bits are the Morton code of the direction
+// puts rays that start close together and head the same way next to each other.
+
+// Spreads the low 10 bits of v so two zero bits separate each of them.
+inline uint32_t expand_bits(uint32_t v)
+{
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+inline uint32_t morton3(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+
+inline uint32_t quantize(float value, float lo, float hi, uint32_t levels)
+{
+    float t = hi > lo ? (value - lo) / (hi - lo) : 0.0f;
+    t = std::min(std::max(t, 0.0f), 1.0f);
+    return static_cast<uint32_t>(t * (levels - 1));
+}
+
+// 48-bit key: 10 bits per axis of origin inside the scene bounds, then 6 bits
+// per axis of the (normalised) direction.
+inline uint64_t ray_sort_key(const Ray &r, const box_ab &bounds)
+{
+    const Vector3 &lo = bounds._min;
+    const Vector3 &hi = bounds._max;
+    uint64_t origin_code = morton3(quantize(r.origin.x, lo.x, hi.x, 1024),
+                                   quantize(r.origin.y, lo.y, hi.y, 1024),
+                                   quantize(r.origin.z, lo.z, hi.z, 1024));
+
+    Vector3 d = r.direction.normalized();
+    uint64_t direction_code = morton3(quantize(d.x, -1, 1, 64),
+                                      quantize(d.y, -1, 1, 64),
+                                      quantize(d.z, -1, 1, 64));
+
+    return (origin_code << 18) | direction_code;
+}
+
+struct RaySortScratch
+{
+    std::vector<uint64_t> keys, keys_tmp;
+    std::vector<uint32_t> order, order_tmp;
+};
+
+// Reorders items (anything with a .ray member) by ray_sort_key. The key fits
+// in 48 bits, so an LSD radix sort of four 12-bit digits is enough.
+template <typename T>
+void sort_rays_morton(std::vector<T> &items, const box_ab &bounds, RaySortScratch &scratch, std::vector<T> &reordered,
+                      ChunkExecutor *executor = nullptr)
+{
+    const size_t n = items.size();
+    const int digit_bits = 12;
+    const size_t buckets = size_t(1) << digit_bits;
+
+    auto &keys = scratch.keys;
+    auto &order = scratch.order;
+    keys.resize(n);
+    order.resize(n);
+    scratch.keys_tmp.resize(n);
+    scratch.order_tmp.resize(n);
+
+    parallel_for(n, [&](size_t i)
+                 {
+        keys[i] = ray_sort_key(items[i].ray, bounds);
+        order[i] = static_cast<uint32_t>(i); }, executor);
+
+    std::vector<size_t> offsets(buckets);
+    for (int shift = 0; shift < 48; shift += digit_bits)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for (size_t i = 0; i < n; ++i)
+            ++offsets[(keys[i] >> shift) & (buckets - 1)];
+
+        size_t sum = 0;
+        for (auto &o : offsets)
+        {
+            size_t c = o;
+            o = sum;
+            sum += c;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t dst = offsets[(keys[i] >> shift) & (buckets - 1)]++;
+            scratch.keys_tmp[dst] = keys[i];
+            scratch.order_tmp[dst] = order[i];
+        }
+        keys.swap(scratch.keys_tmp);
+        order.swap(scratch.order_tmp);
+    }
+
+    reordered.resize(n);
+    parallel_for(n, [&](size_t i)
+                 { reordered[i] = items[order[i]]; }, executor);
+    items.swap(reordered);
+}
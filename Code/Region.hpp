@@ -0,0 +1,28 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1).
+struct Region
+{
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    size_t area() const { return size_t(width()) * height(); }
+    bool empty() const { return x1 <= x0 || y1 <= y0; }
+
+    static Region full(int width, int height) { return Region{0, 0, width, height}; }
+
+    // Band of rows i of n (0-based), as used by --shard i/n.
+    static Region shard(int i, int n, int width, int height)
+    {
+        return Region{0, int(int64_t(height) * i / n), width, int(int64_t(height) * (i + 1) / n)};
+    }
+
+    Region clipped(int width, int height) const
+    {
+        return Region{std::max(x0, 0), std::max(y0, 0), std::min(x1, width), std::min(y1, height)};
+    }
+};
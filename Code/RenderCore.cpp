@@ -0,0 +1,683 @@
+#include <cstdio>
+#include "RenderCore.hpp"
+
+Vector3 barycentric(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c)
+{
+    Vector3 v0 = b - a, v1 = c - a, v2 = p - a;
+    float d00 = v0.dot(v0);
+    float d01 = v0.dot(v1);
+    float d11 = v1.dot(v1);
+    float d20 = v2.dot(v0);
+    float d21 = v2.dot(v1);
+    float denom = d00 * d11 - d01 * d01;
+    float v = (d11 * d20 - d01 * d21) / denom;
+    float w = (d00 * d21 - d01 * d20) / denom;
+    float u = 1.0f - v - w;
+    return Vector3(u, v, w);
+}
+
+Color textureMappingTriangle(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c, const Vector2 &ta, const Vector2 &tb, const Vector2 &tc, const Texture &texture)
+{
+    Vector3 bary = barycentric(p, a, b, c);
+    Vector2 texCoord = ta * bary.x + tb * bary.y + tc * bary.z;
+    return texture.sample(texCoord);
+}
+
+// Tone maps the framebuffer and writes it as a P3 PPM via a temporary file and
+// a rename, so a reader polling the file (e.g. for progressive snapshots) never
+// sees half an image.
+bool write_image(const std::string &path, const std::vector<Color> &framebuffer, int width, int height, int samples_per_pixel, const ToneMapper &tone)
+{
+    std::string body = format_p3_body(tone.encode_image(framebuffer, width, height, samples_per_pixel), width, height);
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    out << "P3\n"
+        << width << ' ' << height << "\n255\n";
+    out.write(body.data(), body.size());
+    out.close();
+    return out && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// Writes values already in [0,1] as a P3 PPM, without gamma (for the AOV images).
+bool write_linear_image(const std::string &path, const std::vector<Color> &values, int width, int height)
+{
+    std::ofstream out(path);
+    out << "P3\n"
+        << width << ' ' << height << "\n255\n";
+    for (const Color &c : values)
+    {
+        out << static_cast<int>(255 * clamp(c.x, 0.0, 1.0)) << ' '
+            << static_cast<int>(255 * clamp(c.y, 0.0, 1.0)) << ' '
+            << static_cast<int>(255 * clamp(c.z, 0.0, 1.0)) << '\n';
+    }
+    return bool(out);
+}
+
+// Writes <base>_albedo/_normal/_depth/_variance.ppm next to the image. Depth
+// and the noise standard deviation are scaled by their maximum.
+bool write_aov_images(const std::string &base, const std::vector<Color> &framebuffer, const AOVBuffers &aovs, int width, int height, int samples_per_pixel)
+{
+    DenoiseInput in = prepare_denoise_input(framebuffer, aovs, samples_per_pixel);
+    float max_depth = 0, max_deviation = 0;
+    for (size_t i = 0; i < in.depth.size(); ++i)
+    {
+        max_depth = std::max(max_depth, in.depth[i]);
+        max_deviation = std::max(max_deviation, std::sqrt(in.variance[i]));
+    }
+
+    std::vector<Color> normal(in.normal.size()), depth(in.depth.size()), deviation(in.variance.size());
+    for (size_t i = 0; i < normal.size(); ++i)
+    {
+        normal[i] = in.normal[i] * 0.5f + Vector3(0.5f, 0.5f, 0.5f);
+        float d = max_depth > 0 ? in.depth[i] / max_depth : 0;
+        depth[i] = Color(d, d, d);
+        float v = max_deviation > 0 ? std::sqrt(in.variance[i]) / max_deviation : 0;
+        deviation[i] = Color(v, v, v);
+    }
+    return write_linear_image(base + "_albedo.ppm", in.albedo, width, height) &&
+           write_linear_image(base + "_normal.ppm", normal, width, height) &&
+           write_linear_image(base + "_depth.ppm", depth, width, height) &&
+           write_linear_image(base + "_variance.ppm", deviation, width, height);
+}
+
+Camera parseCamera(const json &j)
+{
+    auto cam_data = j["camera"];
+    return Camera(Vector3(cam_data["position"]),
+                  Vector3(cam_data["lookAt"]),
+                  Vector3(cam_data["upVector"]),
+                  cam_data["fov"].get<float>(),
+                  static_cast<float>(cam_data["width"].get<int>()) / cam_data["height"].get<int>(),
+                  cam_data["exposure"].get<float>(),
+                  cam_data["width"].get<int>(),
+                  cam_data["height"].get<int>());
+}
+
+void parseLights(const json &j, std::vector<Light> &lights)
+{
+    if (j["scene"].contains("lightsources"))
+    {
+        for (const auto &light : j["scene"]["lightsources"])
+        {
+            Vector3 position(light["position"]);
+            Color intensity(light["intensity"]);
+            lights.emplace_back(position, intensity);
+        }
+    }
+}
+
+// With an arena, shapes only point at materials in the same arena, so
+// releasing it needs no per-shape destructor.
+template <>
+struct arena_skips_destructor<Sphere> : std::true_type
+{
+};
+template <>
+struct arena_skips_destructor<Cylinder> : std::true_type
+{
+};
+template <>
+struct arena_skips_destructor<Triangle> : std::true_type
+{
+};
+
+// A shape entry's material; entries without one share default_material
+// (a red Diffuse, made on first use). Placed in the arena when there is one.
+std::shared_ptr<Material> parseMaterial(const json &obj, Arena *arena, std::shared_ptr<Material> &default_material)
+{
+    if (!obj.contains("material"))
+    {
+        if (!default_material)
+            default_material = arena_make_shared<Diffuse>(arena, Vector3(1, 0, 0));
+        return default_material;
+    }
+    const auto &mat_json = obj["material"];
+    if (mat_json.contains("isrefractive") && mat_json["isrefractive"].get<bool>())
+        return arena_make_shared<Dielectric>(arena, mat_json);
+    if (mat_json.contains("isreflective") && mat_json["isreflective"].get<bool>())
+        return arena_make_shared<Metal>(arena, mat_json);
+    return arena_make_shared<Diffuse>(arena, mat_json);
+}
+
+// One shape entry; null for an unknown type.
+std::shared_ptr<Hittable> parseShape(const json &obj, std::shared_ptr<Material> material, Arena *arena)
+{
+    const std::string type = obj["type"];
+    if (type == "sphere")
+    {
+        return arena_make_shared<Sphere>(
+            arena,
+            Vector3(obj["center"]),
+            obj["radius"].get<float>(),
+            material);
+    }
+    else if (type == "cylinder")
+    {
+        return arena_make_shared<Cylinder>(
+            arena,
+            Vector3(obj["center"]),
+            Vector3(obj["axis"]),
+            obj["radius"].get<float>(),
+            obj["height"].get<float>(),
+            material);
+    }
+    else if (type == "triangle")
+    {
+        if (obj.contains("uv0") && obj.contains("uv1") && obj.contains("uv2"))
+        {
+            return arena_make_shared<Triangle>(
+                arena,
+                Vector3(obj["v0"]),
+                Vector3(obj["v1"]),
+                Vector3(obj["v2"]),
+                material,
+                Vector2(obj["uv0"][0], obj["uv0"][1]),
+                Vector2(obj["uv1"][0], obj["uv1"][1]),
+                Vector2(obj["uv2"][0], obj["uv2"][1]));
+        }
+        return arena_make_shared<Triangle>(
+            arena,
+            Vector3(obj["v0"]),
+            Vector3(obj["v1"]),
+            Vector3(obj["v2"]),
+            material);
+    }
+    return nullptr;
+}
+
+// Builds one shape per JSON entry. With an arena, shapes and materials are
+// placed in it (objects then only borrows them); otherwise each is its own
+// heap allocation. Shapes without a material share one red Diffuse. Shapes
+// marked "dynamic": true go to dynamic_objects instead, when it is given.
+// entries, when given, gets every entry's shape in file order (null for
+// unknown types), since building the BVH reorders objects.
+void parseScene(const json &j, std::vector<std::shared_ptr<Hittable>> &objects, Arena *arena,
+                std::vector<std::shared_ptr<Hittable>> *dynamic_objects,
+                std::vector<std::shared_ptr<Hittable>> *entries)
+{
+    std::shared_ptr<Material> default_material;
+    objects.reserve(objects.size() + j["scene"]["shapes"].size());
+
+    for (const auto &obj : j["scene"]["shapes"])
+    {
+        std::shared_ptr<Hittable> shape = parseShape(obj, parseMaterial(obj, arena, default_material), arena);
+        if (entries)
+            entries->push_back(shape);
+        if (!shape)
+            continue;
+        auto &shapes = dynamic_objects && obj.contains("dynamic") && obj["dynamic"].get<bool>() ? *dynamic_objects : objects;
+        shapes.push_back(shape);
+    }
+}
+
+// Copies fresh, parsed from a shape's edited JSON entry, over the shape, so
+// everything pointing at the shape sees the change. The types must match.
+bool assignShape(Hittable &shape, const Hittable &fresh)
+{
+    if (auto s = dynamic_cast<Sphere *>(&shape))
+        if (auto f = dynamic_cast<const Sphere *>(&fresh))
+        {
+            *s = *f;
+            return true;
+        }
+    if (auto t = dynamic_cast<Triangle *>(&shape))
+        if (auto f = dynamic_cast<const Triangle *>(&fresh))
+        {
+            *t = *f;
+            return true;
+        }
+    if (auto c = dynamic_cast<Cylinder *>(&shape))
+        if (auto f = dynamic_cast<const Cylinder *>(&fresh))
+        {
+            *c = *f;
+            return true;
+        }
+    return false;
+}
+
+// The material a shape was built with; null for other kinds of shape.
+Material *shapeMaterial(Hittable &shape)
+{
+    if (auto s = dynamic_cast<Sphere *>(&shape))
+        return s->material_ptr.get();
+    if (auto t = dynamic_cast<Triangle *>(&shape))
+        return t->material_ptr.get();
+    if (auto c = dynamic_cast<Cylinder *>(&shape))
+        return c->material_ptr.get();
+    return nullptr;
+}
+
+// Copies fresh over material when both are the same kind, so every shape,
+// compiled primitive and G-buffer sample pointing at it sees the new values.
+bool assignMaterial(Material &material, const Material &fresh)
+{
+    if (typeid(material) != typeid(fresh))
+        return false;
+    if (auto metal = dynamic_cast<Metal *>(&material))
+        *metal = static_cast<const Metal &>(fresh);
+    else
+        material = fresh; // the other kinds add no fields
+    return true;
+}
+
+Color blinn_phong_shading(const Vector3 &view_dir, const Vector3 &light_dir, const Vector3 &normal, const Material &material, const Color &albedo, const Color &light_intensity)
+{
+    // Ambient component
+    Color ambient = 0.1 * albedo; // Adjust ambient factor as needed
+
+    // Specular component
+    Vector3 halfway_dir = (view_dir + light_dir).normalized();
+    float spec = std::pow(std::max(0.0f, normal.dot(halfway_dir)), material.specularexponent);
+    Color specular = spec * material.ks * material.specularcolor * light_intensity;
+
+    // Diffuse component
+    float diff = std::max(0.0f, normal.dot(light_dir));
+    Color diffuse = diff * material.kd * albedo * light_intensity;
+
+    // Combine all components
+    return ambient + specular + diffuse;
+}
+
+Color lerp(const Color &a, const Color &b, float t)
+{
+    return a * (1 - t) + b * t;
+}
+
+// Binary colour for a ray whose closest hit (or miss, when rec is null) is known.
+Color binary_color_for_hit(const Ray &r, const Hit_record *rec, const Color &background_color, AOVSample *aov)
+{
+    if (rec)
+    {
+        Color lighting(1, 0, 0);
+        if (aov)
+            *aov = AOVSample{lighting, rec->normal, static_cast<float>(rec->t * r.direction.length())};
+        return lighting;
+    }
+
+    if (aov)
+        *aov = AOVSample{background_color, Vector3(0, 0, 0), 0};
+    return background_color;
+}
+
+Color Binary_Ray_Color(const Ray &r, const Hittable &world, const Color &background_color, AOVSample *aov)
+{
+    Hit_record rec;
+    bool hit = world.hit(r, 0.001, inf, rec);
+    return binary_color_for_hit(r, hit ? &rec : nullptr, background_color, aov);
+}
+
+// Lights a hit: ambient, Blinn-Phong for every light the shadow ray reaches
+// (or, for a light with a shadow map, as far as the map says it reaches),
+// then the mirror bounce. Only needs the ray's direction and cone.
+Color shade_phong(const Ray &r, const Hit_record &rec, const Material &material, float footprint, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int depth, AOVSample *aov)
+{
+    Color lighting(0.1, 0.1, 0.1);
+    Vector3 view_dir = -r.direction.normalized();
+    Color albedo = material.albedo(rec, footprint);
+    if (aov)
+        *aov = AOVSample{albedo, rec.normal, static_cast<float>(rec.t * r.direction.length())};
+
+    ShadowCache &shadow_cache = ShadowCache::local();
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        const Light &light = lights[i];
+        Vector3 light_dir = (light.position - rec.p).normalized();
+        Ray shadow_ray(rec.p, light_dir);
+
+        if (light.shadow_map)
+        {
+            float lit = light.shadow_map->visibility(rec.p, rec.normal);
+            if (lit > 0)
+                lighting += blinn_phong_shading(view_dir, light_dir, rec.normal, material, albedo, light.intensity) * lit;
+        }
+        else if (!shadow_cache.occluded(shadow_ray, 0.001, (light.position - rec.p).length(), world, i))
+        {
+            // Use the blinn_phong_shading function for each light
+            lighting += blinn_phong_shading(view_dir, light_dir, rec.normal, material, albedo, light.intensity);
+        }
+    }
+
+    // Reflection handling
+    if (material.isreflective && depth > 0)
+    {
+        Vector3 reflected_dir = reflect(r.direction.normalized(), rec.normal);
+        Ray reflected_ray(rec.p, reflected_dir);
+        reflected_ray.cone_width = footprint;
+        reflected_ray.cone_spread = r.cone_spread;
+
+        float cos_theta = std::max(-reflected_dir.dot(rec.normal), 0.0f);
+        float fresnel = material.reflectivity + (1.0f - material.reflectivity) * std::pow(1.0f - cos_theta, 5);
+
+        Color reflected_color = ray_color_phong(reflected_ray, world, lights, background_color, depth - 1);
+        lighting = lerp(lighting, reflected_color, fresnel);
+    }
+
+    return lighting;
+}
+
+// aov, if given, receives what this ray hit (only the camera ray passes one);
+// primary likewise, for relighting later.
+// ray_color_phong once the ray's closest hit (or miss, when rec is null) is known.
+Color phong_color_for_hit(const Ray &r, const Hit_record *rec, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int depth, AOVSample *aov, GBufferSample *primary)
+{
+    if (rec)
+    {
+        float footprint = r.cone_width_at(rec->t);
+        if (primary)
+            *primary = GBufferSample{rec->p, rec->normal, r.direction, rec->uv, rec->uv_per_unit, footprint, r.cone_spread, rec->material_ptr.get()};
+        return shade_phong(r, *rec, *rec->material_ptr, footprint, world, lights, background_color, depth, aov);
+    }
+
+    if (primary)
+        *primary = GBufferSample();
+    if (aov)
+        *aov = AOVSample{background_color, Vector3(0, 0, 0), 0};
+    return background_color;
+}
+
+Color ray_color_phong(const Ray &r, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int depth, AOVSample *aov, GBufferSample *primary)
+{
+    if (depth <= 0)
+        return Color(0, 0, 0);
+
+    Hit_record rec;
+    bool hit = world.hit(r, 0.001, inf, rec);
+    return phong_color_for_hit(r, hit ? &rec : nullptr, world, lights, background_color, depth, aov, primary);
+}
+
+// Adds samples [first_sample, first_sample + samples) of each pixel in region to
+// framebuffer, and to the auxiliary buffers when aovs is given. Both may hold
+// just the image rows from first_row on. Pixel and lens positions come from
+// sampler (the random stream if it is nullptr). With gbuffer (Phong only),
+// each sample's camera hit is recorded for relight_image. With visibility
+// (built for this camera), camera rays start from its rasterized hits.
+void render_image(std::vector<Color> &framebuffer, const Camera &camera, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int width, int height, int first_sample, int samples, int max_depth, int TraceType, const Region &region, AOVBuffers *aovs, int first_row, const Sampler *sampler, GBuffer *gbuffer, const VisibilityBuffer *visibility)
+{
+    VisibilityCounts visibility_counts;
+    for (int y = region.y0; y < region.y1; ++y)
+    {
+        for (int x = region.x0; x < region.x1; ++x)
+        {
+            // Each sample goes straight onto the pixel's sum, so rendering the
+            // samples in one call or over several passes gives the same bits.
+            Color &pixel_sum = framebuffer[size_t(y - first_row) * width + x];
+            Color pixel_color = pixel_sum;
+            for (int s = first_sample; s < first_sample + samples; ++s)
+            {
+                // Seeded by image position so any split of the image gives the same pixels.
+                seed_sample(static_cast<uint64_t>(y) * width + x, s);
+                start_sample(sampler, x, y, s);
+                Vector2 jitter = sample_2d();
+                float u = (x + jitter.x) / (width - 1);
+                float v = (y + jitter.y) / (height - 1);
+                Ray ray = camera.get_ray(u, v);
+
+                Color sample_color(0, 0, 0);
+                AOVSample aov;
+                GBufferSample *primary = gbuffer ? gbuffer->record(size_t(y) * width + x, s) : nullptr;
+                if (visibility && (TraceType == 1 || TraceType == 2))
+                {
+                    Hit_record rec;
+                    const Hit_record *hit = visibility->closest_hit(size_t(y) * width + x, ray, rec, visibility_counts) ? &rec : nullptr;
+                    if (TraceType == 1)
+                        sample_color = binary_color_for_hit(ray, hit, background_color, aovs ? &aov : nullptr);
+                    else
+                        sample_color = phong_color_for_hit(ray, hit, world, lights, background_color, max_depth, aovs ? &aov : nullptr, primary);
+                }
+                else if (TraceType == 1)
+                {
+                    sample_color = Binary_Ray_Color(ray, world, background_color, aovs ? &aov : nullptr);
+                }
+                else if (TraceType == 2)
+                {
+                    sample_color = ray_color_phong(ray, world, lights, background_color, max_depth, aovs ? &aov : nullptr, primary);
+                }
+                pixel_color += sample_color;
+                if (aovs)
+                    aovs->add(size_t(y - first_row) * width + x, aov, sample_color);
+            }
+            pixel_sum = pixel_color;
+        }
+    }
+    if (visibility)
+        visibility->add(visibility_counts);
+}
+
+// Shades region again from the G-buffer, into a framebuffer holding the whole
+// image: the same colours render_image would give for the same camera hits,
+// without tracing the camera rays.
+void relight_image(std::vector<Color> &framebuffer, const GBuffer &gbuffer, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int width, int max_depth, const Region &region)
+{
+    for (int y = region.y0; y < region.y1; ++y)
+    {
+        for (int x = region.x0; x < region.x1; ++x)
+        {
+            size_t pixel = size_t(y) * width + x;
+            Color pixel_color(0, 0, 0);
+            for (int s = 0; s < gbuffer.samples_per_pixel(); ++s)
+            {
+                const GBufferSample &g = gbuffer.at(pixel, s);
+                if (!g.material)
+                {
+                    pixel_color += background_color;
+                    continue;
+                }
+                Ray ray(Vector3(0, 0, 0), g.direction);
+                ray.cone_spread = g.cone_spread;
+                Hit_record rec;
+                rec.p = g.p;
+                rec.normal = g.normal;
+                rec.uv = g.uv;
+                rec.uv_per_unit = g.uv_per_unit;
+                pixel_color += shade_phong(ray, rec, *g.material, g.footprint, world, lights, background_color, max_depth);
+            }
+            framebuffer[pixel] = pixel_color;
+        }
+    }
+}
+
+std::future<std::vector<Light>> async_parseLights(const json &j)
+{
+    return std::async(std::launch::async, [](const json &j)
+                      {
+        std::vector<Light> lights;
+        parseLights(j, lights);
+        return lights; }, j);
+}
+
+std::future<Camera> async_parseCamera(const json &j)
+{
+    return std::async(std::launch::async, parseCamera, j);
+}
+
+
+// Moves every dynamic shape a random step per frame and times the two-level
+// update, against the full scene build. The image is then rendered with the
+// shapes where the last frame left them.
+void run_update_benchmark(TwoLevelScene &scene, const std::vector<std::shared_ptr<Hittable>> &dynamic_objects,
+                          int frames, double full_build_seconds)
+{
+    // Each shape steps 5% of its own size per frame.
+    std::vector<float> steps(dynamic_objects.size());
+    for (size_t i = 0; i < dynamic_objects.size(); ++i)
+    {
+        box_ab box;
+        dynamic_objects[i]->bounding_box(0, 0, box);
+        steps[i] = 0.05f * (box.max() - box.min()).length();
+    }
+    int rebuilds = 0;
+    std::chrono::duration<double> update_time(0);
+
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < dynamic_objects.size(); ++i)
+            dynamic_objects[i]->translate(random_unit_vector() * steps[i]);
+        rebuilds += scene.update();
+        update_time += std::chrono::high_resolution_clock::now() - start;
+    }
+
+    std::cout << "Dynamic updates: " << frames << " frames, " << frames - rebuilds << " refits, " << rebuilds
+              << " rebuilds, " << 1000 * update_time.count() / frames << " ms per update (full scene build: "
+              << 1000 * full_build_seconds << " ms)\n";
+}
+
+// "--accel auto": a grid when there are many shapes of similar size spread
+// evenly through the scene, where stepping cells beats a tree walk; the BVH
+// otherwise. Everything looked at is cheap: the primitives' box sizes and how
+// many cells of a coarse grid they touch.
+std::string choose_accel(const CompiledScene &scene)
+{
+    std::vector<uint32_t> primitives = scene.primitives();
+    size_t n = primitives.size();
+    box_ab bounds;
+    scene.bounding_box(0, 0, bounds);
+    Vector3 extent = bounds.max() - bounds.min();
+
+    // Spread of sizes: coefficient of variation of the box diagonals.
+    double sum = 0, sum_sq = 0;
+    std::vector<Vector3> centres(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        Vector3 lo, hi;
+        scene.leaf_bounds(primitives[i], lo, hi);
+        double d = (hi - lo).length();
+        sum += d;
+        sum_sq += d * d;
+        centres[i] = (lo + hi) * 0.5f;
+    }
+    double mean = sum / n;
+    double variation = mean > 0 ? std::sqrt(std::max(0.0, sum_sq / n - mean * mean)) / mean : 0;
+
+    // Evenness: share of the cells of an n / 8 cell grid holding a box centre.
+    int side = std::max(1, static_cast<int>(std::cbrt(n / 8.0)));
+    std::vector<char> occupied(size_t(side) * side * side, 0);
+    for (const Vector3 &c : centres)
+    {
+        int cell[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            float e = (&extent.x)[a];
+            cell[a] = e > 0 ? std::min(side - 1, static_cast<int>(((&c.x)[a] - (&bounds._min.x)[a]) / e * side)) : 0;
+        }
+        occupied[(size_t(cell[2]) * side + cell[1]) * side + cell[0]] = 1;
+    }
+    double filled = double(std::count(occupied.begin(), occupied.end(), 1)) / occupied.size();
+
+    std::string choice = n >= 1000 && variation < 0.25 && filled > 0.6 ? "grid" : "bvh";
+    std::cout << "Auto acceleration: " << n << " primitives, size variation " << variation << ", "
+              << 100 * filled << "% of coarse cells filled: " << choice << "\n";
+    return choice;
+}
+
+// Builds the BVH, the grid and the kd-tree over the scene and traces one
+// closest-hit ray through each pixel centre with each, for comparing them.
+int run_accel_benchmark(const CompiledScene &compiled, std::vector<std::shared_ptr<Hittable>> &objects, const Camera &camera,
+                        int width, int height)
+{
+    auto trace = [&](const Hittable &world, uint64_t &hits)
+    {
+        std::vector<uint64_t> row_hits(height, 0);
+        auto start = std::chrono::high_resolution_clock::now();
+        parallel_for(static_cast<size_t>(height), [&](size_t y)
+                     {
+            Hit_record rec;
+            for (int x = 0; x < width; ++x)
+            {
+                Ray ray = camera.get_ray((x + 0.5) / (width - 1), (y + 0.5) / (height - 1));
+                row_hits[y] += world.hit(ray, 0.001, inf, rec);
+            } });
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        hits = 0;
+        for (uint64_t h : row_hits)
+            hits += h;
+        return elapsed.count();
+    };
+
+    std::cout << "\nStructure     build (s)   trace (s)     Mrays/s        hits\n";
+    auto report = [&](const char *name, double build, const Hittable &world)
+    {
+        uint64_t hits;
+        double seconds = trace(world, hits);
+        std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(4)
+                  << std::setw(12) << build << std::setw(12) << seconds << std::setw(12) << std::setprecision(2)
+                  << width * double(height) / seconds / 1e6 << std::setw(12) << hits << "\n";
+    };
+
+    // The BVH is timed from scratch (tree and compilation) on a copy of the shape list.
+    std::vector<std::shared_ptr<Hittable>> shapes = objects;
+    auto start = std::chrono::high_resolution_clock::now();
+    BVHNode tree(shapes, 0, shapes.size(), 0.0, 0);
+    CompiledScene bvh(tree);
+    std::chrono::duration<double> bvh_build = std::chrono::high_resolution_clock::now() - start;
+    report("bvh", bvh_build.count(), bvh);
+
+    start = std::chrono::high_resolution_clock::now();
+    UniformGrid grid(compiled);
+    std::chrono::duration<double> grid_build = std::chrono::high_resolution_clock::now() - start;
+    report("grid", grid_build.count(), grid);
+
+    start = std::chrono::high_resolution_clock::now();
+    KdTree kd_tree(compiled);
+    std::chrono::duration<double> kd_build = std::chrono::high_resolution_clock::now() - start;
+    report("kdtree", kd_build.count(), kd_tree);
+
+    choose_accel(compiled);
+    return 0;
+}
+
+// Times the camera rays of one sample per pixel through world against the
+// rasterized visibility buffer (build included), and checks that both give
+// the same hits.
+int run_raster_benchmark(const CompiledScene &compiled, const Hittable &world, const Camera &camera, int width, int height)
+{
+    auto camera_ray = [&](int x, int y)
+    {
+        seed_sample(static_cast<uint64_t>(y) * width + x, 0);
+        start_sample(nullptr, x, y, 0);
+        Vector2 jitter = sample_2d();
+        return camera.get_ray((x + jitter.x) / (width - 1), (y + jitter.y) / (height - 1));
+    };
+    std::vector<Hit_record> traced(size_t(width) * height);
+    std::vector<char> traced_hit(traced.size());
+    auto start = std::chrono::high_resolution_clock::now();
+    parallel_for(static_cast<size_t>(height), [&](size_t y)
+                 {
+        for (int x = 0; x < width; ++x)
+            traced_hit[y * width + x] = world.hit(camera_ray(x, int(y)), 0.001, inf, traced[y * width + x]); });
+    std::chrono::duration<double> trace_time = std::chrono::high_resolution_clock::now() - start;
+
+    start = std::chrono::high_resolution_clock::now();
+    VisibilityBuffer visibility(compiled, world, camera, width, height);
+    std::chrono::duration<double> build_time = std::chrono::high_resolution_clock::now() - start;
+    std::vector<uint64_t> mismatches(height, 0);
+    start = std::chrono::high_resolution_clock::now();
+    parallel_for(static_cast<size_t>(height), [&](size_t y)
+                 {
+        VisibilityCounts counts;
+        Hit_record rec;
+        for (int x = 0; x < width; ++x)
+        {
+            size_t pixel = y * width + x;
+            bool hit = visibility.closest_hit(pixel, camera_ray(x, int(y)), rec, counts);
+            mismatches[y] += hit != bool(traced_hit[pixel]) || (hit && (rec.t != traced[pixel].t || rec.material_ptr != traced[pixel].material_ptr));
+        }
+        visibility.add(counts); });
+    std::chrono::duration<double> resolve_time = std::chrono::high_resolution_clock::now() - start;
+
+    VisibilityBuildStats stats = visibility.stats();
+    VisibilityCounts counts = visibility.counts();
+    double rays = double(width) * height;
+    uint64_t differing = 0;
+    for (uint64_t m : mismatches)
+        differing += m;
+    std::cout << "\nVisibility buffer: " << stats.primitives << " primitives (" << stats.full_screen << " full screen), "
+              << stats.bin_entries << " tile bin entries, " << 100.0 * stats.covered_pixels / rays << "% of pixels covered\n"
+              << std::fixed << std::setprecision(4)
+              << "Traversal:  " << trace_time.count() << " s, " << std::setprecision(2) << rays / trace_time.count() / 1e6 << " Mrays/s\n"
+              << std::setprecision(4) << "Rasterized: " << build_time.count() << " s build + " << resolve_time.count() << " s resolve, "
+              << std::setprecision(2) << rays / (build_time.count() + resolve_time.count()) / 1e6 << " Mrays/s\n"
+              << std::setprecision(1) << 100.0 * counts.resolved / rays << "% resolved, " << 100.0 * counts.background / rays
+              << "% background, " << 100.0 * counts.traced / rays << "% traced; " << differing << " hits differ from traversal\n";
+    return differing ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <future>
+#include <iomanip>
+#include <chrono>
+#include "json/include/nlohmann/json.hpp"
+#include "BVH.hpp"
+#include "Camera.hpp"
+#include "Light.hpp"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+#include "Cylinder.hpp"
+#include "CompiledScene.hpp"
+#include "TwoLevel.hpp"
+#include "OutOfCore.hpp"
+#include "Grid.hpp"
+#include "KdTree.hpp"
+#include "GBuffer.hpp"
+#include "Texture.hpp"
+#include "Material.hpp"
+#include "Hittable.hpp"
+#include "HitRecord.hpp"
+#include "ShadowCache.hpp"
+#include "Wavefront.hpp"
+#include "Denoise.hpp"
+#include "ToneMap.hpp"
+#include "Visibility.hpp"
+#include "Preview.hpp"
+#include "Arena.hpp"
+#include "Sampler.hpp"
+#include "utility.hpp"
+#include "Vector2.hpp"
+
+using Color = Vector3;
+using json = nlohmann::json;
+
+// The renderer's core, compiled once into libcgrrt (RenderCore.cpp): scene
+// parsing, shading, the tile renderer and the output writers. Scene.hpp and
+// Renderer.hpp build the library's object API on top of these.
+
+// Output
+bool write_image(const std::string &path, const std::vector<Color> &framebuffer, int width, int height, int samples_per_pixel, const ToneMapper &tone);
+bool write_linear_image(const std::string &path, const std::vector<Color> &values, int width, int height);
+bool write_aov_images(const std::string &base, const std::vector<Color> &framebuffer, const AOVBuffers &aovs, int width, int height, int samples_per_pixel);
+
+// Scene files
+Camera parseCamera(const json &j);
+void parseLights(const json &j, std::vector<Light> &lights);
+std::shared_ptr<Material> parseMaterial(const json &obj, Arena *arena, std::shared_ptr<Material> &default_material);
+std::shared_ptr<Hittable> parseShape(const json &obj, std::shared_ptr<Material> material, Arena *arena);
+void parseScene(const json &j, std::vector<std::shared_ptr<Hittable>> &objects, Arena *arena = nullptr,
+                std::vector<std::shared_ptr<Hittable>> *dynamic_objects = nullptr,
+                std::vector<std::shared_ptr<Hittable>> *entries = nullptr);
+std::future<std::vector<Light>> async_parseLights(const json &j);
+std::future<Camera> async_parseCamera(const json &j);
+bool assignShape(Hittable &shape, const Hittable &fresh);
+Material *shapeMaterial(Hittable &shape);
+bool assignMaterial(Material &material, const Material &fresh);
+
+// Shading
+Vector3 barycentric(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c);
+Color textureMappingTriangle(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c, const Vector2 &ta, const Vector2 &tb, const Vector2 &tc, const Texture &texture);
+Color blinn_phong_shading(const Vector3 &view_dir, const Vector3 &light_dir, const Vector3 &normal, const Material &material, const Color &albedo, const Color &light_intensity);
+Color lerp(const Color &a, const Color &b, float t);
+Color binary_color_for_hit(const Ray &r, const Hit_record *rec, const Color &background_color, AOVSample *aov = nullptr);
+Color Binary_Ray_Color(const Ray &r, const Hittable &world, const Color &background_color, AOVSample *aov = nullptr);
+Color ray_color_phong(const Ray &r, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int depth, AOVSample *aov = nullptr, GBufferSample *primary = nullptr);
+Color shade_phong(const Ray &r, const Hit_record &rec, const Material &material, float footprint, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int depth, AOVSample *aov = nullptr);
+Color phong_color_for_hit(const Ray &r, const Hit_record *rec, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int depth, AOVSample *aov = nullptr, GBufferSample *primary = nullptr);
+
+// Rendering (modes 1 and 2; mode 3 is render_image_wavefront in Wavefront.hpp)
+void render_image(std::vector<Color> &framebuffer, const Camera &camera, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int width, int height, int first_sample, int samples, int max_depth, int TraceType, const Region &region, AOVBuffers *aovs = nullptr, int first_row = 0, const Sampler *sampler = nullptr, GBuffer *gbuffer = nullptr, const VisibilityBuffer *visibility = nullptr);
+void relight_image(std::vector<Color> &framebuffer, const GBuffer &gbuffer, const Hittable &world, const std::vector<Light> &lights, const Color &background_color, int width, int max_depth, const Region &region);
+
+// Benchmarks
+void run_update_benchmark(TwoLevelScene &scene, const std::vector<std::shared_ptr<Hittable>> &dynamic_objects,
+                          int frames, double full_build_seconds);
+std::string choose_accel(const CompiledScene &scene);
+int run_accel_benchmark(const CompiledScene &compiled, std::vector<std::shared_ptr<Hittable>> &objects, const Camera &camera,
+                        int width, int height);
+int run_raster_benchmark(const CompiledScene &compiled, const Hittable &world, const Camera &camera, int width, int height);
+
+// Renders the image at 1, 2, 4, ... up to max_samples spp with every sampler
+// and prints the RMSE (in 8-bit output values) against a high-spp reference.
+template <typename RenderSamples>
+int run_convergence_benchmark(const std::string &reference_file, std::vector<Color> &framebuffer, int width, int height,
+                              int max_samples, const ToneMapper &tone, RenderSamples render_samples)
+{
+    int ref_width, ref_height;
+    std::vector<unsigned char> reference;
+    if (!read_ppm(reference_file, ref_width, ref_height, reference) || ref_width != width || ref_height != height)
+    {
+        std::cout << "Could not read a " << width << "x" << height << " reference from " << reference_file << std::endl;
+        return 1;
+    }
+
+    const char *names[] = {"independent", "halton", "sobol", "bluenoise"};
+    std::vector<int> sample_counts;
+    for (int spp = 1; spp <= max_samples; spp *= 2)
+        sample_counts.push_back(spp);
+    std::vector<std::vector<double>> rmse(4);
+
+    for (int k = 0; k < 4; ++k)
+    {
+        std::unique_ptr<Sampler> sampler = make_sampler(names[k]);
+        std::fill(framebuffer.begin(), framebuffer.end(), Color(0, 0, 0));
+        int done = 0;
+        for (int spp : sample_counts)
+        {
+            render_samples(sampler.get(), done, spp - done);
+            done = spp;
+            rmse[k].push_back(::rmse(tone.encode_image(framebuffer, width, height, spp), reference));
+        }
+        std::cout << "Measured " << names[k] << std::endl;
+    }
+
+    std::cout << "\nRMSE vs " << reference_file << "\n   spp";
+    for (const char *name : names)
+        std::cout << std::setw(13) << name;
+    std::cout << "\n";
+    for (size_t s = 0; s < sample_counts.size(); ++s)
+    {
+        std::cout << std::setw(6) << sample_counts[s];
+        for (int k = 0; k < 4; ++k)
+            std::cout << std::setw(13) << std::fixed << std::setprecision(3) << rmse[k][s];
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+// Path traces the image at 1, 2, 4, ... up to max_samples spp twice: with
+// emissive shapes found only by bounces into them, then also sampled directly
+// with MIS. Prints both RMSEs (in 8-bit output values) against a high-spp
+// reference, the time per sample, and how much less error variance direct
+// sampling leaves for the same time.
+template <typename RenderSamples>
+int run_emitter_benchmark(const std::string &reference_file, std::vector<Color> &framebuffer, int width, int height,
+                          int max_samples, const ToneMapper &tone, RenderSamples render_samples)
+{
+    int ref_width, ref_height;
+    std::vector<unsigned char> reference;
+    if (!read_ppm(reference_file, ref_width, ref_height, reference) || ref_width != width || ref_height != height)
+    {
+        std::cout << "Could not read a " << width << "x" << height << " reference from " << reference_file << std::endl;
+        return 1;
+    }
+
+    const char *names[] = {"bounces only", "emitters+MIS"};
+    std::vector<int> sample_counts;
+    for (int spp = 1; spp <= max_samples; spp *= 2)
+        sample_counts.push_back(spp);
+    std::vector<std::vector<double>> errors(2);
+    double seconds_per_sample[2];
+
+    for (int k = 0; k < 2; ++k)
+    {
+        std::fill(framebuffer.begin(), framebuffer.end(), Color(0, 0, 0));
+        double seconds = 0;
+        int done = 0;
+        for (int spp : sample_counts)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            render_samples(k == 1, done, spp - done);
+            seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            done = spp;
+            errors[k].push_back(rmse(tone.encode_image(framebuffer, width, height, spp), reference));
+        }
+        seconds_per_sample[k] = seconds / done;
+        std::cout << "Measured " << names[k] << std::endl;
+    }
+
+    std::cout << "\nRMSE vs " << reference_file << "\n   spp";
+    for (const char *name : names)
+        std::cout << std::setw(15) << name;
+    std::cout << "\n";
+    for (size_t s = 0; s < sample_counts.size(); ++s)
+    {
+        std::cout << std::setw(6) << sample_counts[s];
+        for (int k = 0; k < 2; ++k)
+            std::cout << std::setw(15) << std::fixed << std::setprecision(3) << errors[k][s];
+        std::cout << "\n";
+    }
+    // Error variance falls like 1 / samples, so this is how many times longer
+    // bouncing alone would need to render to match.
+    double variance_ratio = (errors[0].back() * errors[0].back()) / std::max(errors[1].back() * errors[1].back(), 1e-12);
+    std::cout << "Seconds per sample: " << std::setprecision(4) << seconds_per_sample[0] << " vs " << seconds_per_sample[1]
+              << "; at " << sample_counts.back() << " spp, sampling emitters leaves " << std::setprecision(2) << variance_ratio
+              << "x less error variance, " << variance_ratio * seconds_per_sample[0] / seconds_per_sample[1]
+              << "x after accounting for time" << std::endl;
+    return 0;
+}
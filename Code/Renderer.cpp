@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include "Renderer.hpp"
+
+Renderer::Renderer(RenderOptions render_options, std::vector<NumaNode> nodes)
+    : options(render_options), threads(std::move(nodes)), default_sampler(make_sampler("sobol"))
+{
+}
+
+RenderResult Renderer::render(Scene &scene, const Camera &camera)
+{
+    RenderResult result;
+    if (!scene.ready())
+    {
+        if (!scene.build(result.error))
+            return result;
+        scene.compile();
+    }
+    if (!scene.ready())
+    {
+        result.error = "The scene has nothing to trace.";
+        return result;
+    }
+
+    result.width = camera.width;
+    result.height = camera.height;
+    result.samples = options.samples;
+    result.framebuffer.assign(size_t(result.width) * result.height, Color(0, 0, 0));
+    Region region = Region::full(result.width, result.height);
+
+    const EmissiveLights *emitters = options.path.emitters;
+    if (options.sample_emitters)
+        options.path.emitters = &scene.emitters;
+    auto start = std::chrono::high_resolution_clock::now();
+    result.stats.path = render_region(result.framebuffer, 0, camera, scene.world(), scene.lights, scene.background,
+                                      result.width, result.height, region, 0, options.samples);
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    options.path.emitters = emitters;
+
+    result.stats.seconds = elapsed.count();
+    result.stats.tiles = options.mode == 3 ? 1 : size_t((result.width + options.tile_size - 1) / options.tile_size) *
+                                                     ((result.height + options.tile_size - 1) / options.tile_size);
+    result.stats.msamples_per_second = region.area() * double(options.samples) / std::max(elapsed.count(), 1e-9) / 1e6;
+    return result;
+}
+
+WavefrontStats Renderer::render_region(std::vector<Color> &target, int first_row, const Camera &camera, const Hittable &world,
+                                       const std::vector<Light> &lights, const Color &background, int width, int height,
+                                       const Region &region, int first_sample, int samples, const RenderTargets &targets)
+{
+    ShadowCache::forget_occluders();
+    WavefrontSettings path = options.path;
+    if (!path.sampler)
+        path.sampler = default_sampler.get();
+    path.executor = &threads;
+    if (options.mode == 3)
+        return render_image_wavefront(target, camera, world, lights, background, width, height, region, first_sample, samples,
+                                      path, targets.aovs, first_row);
+
+    // Every pixel is seeded by its position, so any split into tiles and any
+    // order of rendering them gives the same image.
+    std::vector<Region> tiles;
+    for (int y = region.y0; y < region.y1; y += options.tile_size)
+        for (int x = region.x0; x < region.x1; x += options.tile_size)
+            tiles.push_back(Region{x, y, std::min(x + options.tile_size, region.x1), std::min(y + options.tile_size, region.y1)});
+    std::atomic<size_t> next{0};
+    threads.run([&](size_t, size_t)
+                {
+        for (size_t t; (t = next.fetch_add(1)) < tiles.size();)
+            render_image(target, camera, world, lights, background, width, height, first_sample, samples, options.max_depth,
+                         options.mode, tiles[t], targets.aovs, first_row, path.sampler, targets.gbuffer, targets.visibility); });
+    return WavefrontStats();
+}
+
+void Renderer::render_pass(std::vector<Color> &framebuffer, const RenderJob &job, int first_sample, int samples, WavefrontStats *path_stats)
+{
+    const EmissiveLights *emitters = options.path.emitters;
+    if (options.sample_emitters && job.emitters)
+        options.path.emitters = job.emitters;
+    WavefrontStats stats = render_region(framebuffer, 0, *job.camera, *job.world, *job.lights, job.background, job.width, job.height,
+                                         job.region, first_sample, samples, job.targets);
+    options.path.emitters = emitters;
+    if (path_stats)
+        path_stats->add(stats);
+}
+
+ProgressiveResult Renderer::render_progressive(std::vector<Color> &framebuffer, const RenderJob &job, const ProgressiveSettings &settings,
+                                               const std::function<void(int)> &snapshot, WavefrontStats *path_stats)
+{
+    return ::render_progressive(framebuffer, job.region, job.width, settings,
+                                [&](int first_sample, int samples)
+                                { render_pass(framebuffer, job, first_sample, samples, path_stats); },
+                                [&](int samples)
+                                {
+                                    if (snapshot)
+                                        snapshot(samples);
+                                });
+}
+
+int Renderer::resume_checkpoint(std::vector<Color> &framebuffer, const RenderJob &job, int samples, const CheckpointSettings &settings,
+                                std::string &error)
+{
+    RenderCheckpoint checkpoint;
+    if (!read_checkpoint(settings.path, checkpoint))
+    {
+        error = settings.path + " is not a readable checkpoint.";
+        return -1;
+    }
+    int first_sample = checkpoint.next_sample();
+    const Region &r = checkpoint.region;
+    if (checkpoint.width != job.width || checkpoint.height != job.height || r.x0 != job.region.x0 || r.y0 != job.region.y0 ||
+        r.x1 != job.region.x1 || r.y1 != job.region.y1 || checkpoint.fingerprint != settings.fingerprint ||
+        checkpoint.sampler != sampler().name() || first_sample < 0)
+    {
+        error = settings.path + " belongs to another scene, image size, region, mode or sampler.";
+        return -1;
+    }
+    if (first_sample > samples)
+    {
+        error = settings.path + " already holds " + std::to_string(first_sample) + " samples per pixel, more than the " +
+                std::to_string(samples) + " asked for.";
+        return -1;
+    }
+    framebuffer = std::move(checkpoint.pixels);
+    return first_sample;
+}
+
+CheckpointedResult Renderer::render_checkpointed(std::vector<Color> &framebuffer, const RenderJob &job, int first_sample, int samples,
+                                                 const CheckpointSettings &settings, WavefrontStats *path_stats)
+{
+    // Checkpoints go to disk on the writer's thread; the render only stops
+    // to copy the framebuffer.
+    CheckpointWriter checkpoints(settings.path);
+    auto save_checkpoint = [&](int done)
+    {
+        RenderCheckpoint checkpoint{job.width, job.height, job.region, settings.fingerprint, sampler().name(), framebuffer,
+                                    std::vector<uint32_t>(framebuffer.size(), 0)};
+        for (int y = job.region.y0; y < job.region.y1; ++y)
+            std::fill(checkpoint.counts.begin() + size_t(y) * job.width + job.region.x0,
+                      checkpoint.counts.begin() + size_t(y) * job.width + job.region.x1, uint32_t(done));
+        checkpoints.save(std::move(checkpoint));
+    };
+
+    checkpoint_stop_flag() = 0;
+    auto previous_term = std::signal(SIGTERM, checkpoint_on_signal);
+    auto previous_int = std::signal(SIGINT, checkpoint_on_signal);
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    CheckpointedResult result;
+    result.samples = first_sample;
+    while (result.samples < samples && !checkpoint_stop_flag())
+    {
+        render_pass(framebuffer, job, result.samples++, 1, path_stats);
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count() >= settings.seconds)
+        {
+            save_checkpoint(result.samples);
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
+    }
+    std::signal(SIGTERM, previous_term);
+    std::signal(SIGINT, previous_int);
+
+    result.stopped = result.samples < samples;
+    if (result.stopped)
+        save_checkpoint(result.samples);
+    result.write_failed = !checkpoints.wait();
+    result.written = checkpoints.written();
+    return result;
+}
+
+std::vector<ViewStats> Renderer::render_batch(const RenderJob &job, const std::vector<Camera> &cameras,
+                                              const std::function<void(size_t, std::vector<Color> &)> &finish_view,
+                                              WavefrontStats *path_stats)
+{
+    if (options.mode != 3)
+    {
+        ShadowCache::forget_occluders();
+        return render_views(cameras.size(), job.width, job.height, options.tile_size,
+                            [&](size_t v, const Region &tile, std::vector<Color> &image)
+                            {
+                                render_image(image, cameras[v], *job.world, *job.lights, job.background, job.width, job.height, 0,
+                                             options.samples, options.max_depth, options.mode, tile, nullptr, 0, &sampler());
+                            },
+                            finish_view, &threads);
+    }
+
+    // The wavefront renderer already spreads one image over every thread, so
+    // the views simply take turns.
+    using clock = std::chrono::steady_clock;
+    std::vector<ViewStats> stats(cameras.size());
+    auto batch_start = clock::now();
+    for (size_t v = 0; v < cameras.size(); ++v)
+    {
+        RenderJob view = job;
+        view.camera = &cameras[v];
+        view.region = Region::full(job.width, job.height);
+        view.targets = RenderTargets();
+        auto view_start = clock::now();
+        std::vector<Color> image(size_t(job.width) * job.height, Color(0, 0, 0));
+        render_pass(image, view, 0, options.samples, path_stats);
+        finish_view(v, image);
+        stats[v].tiles = 1;
+        stats[v].started = std::chrono::duration<double>(view_start - batch_start).count();
+        stats[v].finished = std::chrono::duration<double>(clock::now() - batch_start).count();
+        stats[v].busy_seconds = (stats[v].finished - stats[v].started) * threads.size();
+    }
+    return stats;
+}
+
+EditResult Renderer::apply_edit(Scene &scene, const json &current, const json &next, const SceneChanges &changes,
+                                std::vector<Color> &framebuffer, RenderJob &job, const std::function<void()> &prepare)
+{
+    EditResult result;
+    result.reload_reason = scene.edit_reload_reason(changes);
+    if (!result.reload_reason.empty())
+        return result;
+
+    // If nothing but lights and materials of the same kind changed, the
+    // camera hits are still valid and the G-buffer can be shaded again
+    // without tracing them.
+    const GBuffer *gbuffer = job.targets.gbuffer;
+    result.relit = gbuffer && !gbuffer->empty() && changes.moved.empty() && !changes.camera && !changes.background &&
+                   std::all_of(changes.restyled.begin(), changes.restyled.end(),
+                               [&](size_t i)
+                               { return restyled_in_place(current, next, i); });
+    std::vector<PrimaryHit> hits_before;
+    if (result.relit)
+    {
+        hits_before.resize(framebuffer.size());
+        for (size_t pixel = 0; pixel < hits_before.size(); ++pixel)
+        {
+            const GBufferSample &g = gbuffer->at(pixel, 0);
+            if (g.material)
+                hits_before[pixel] = PrimaryHit{true, g.material->isreflective, g.p};
+        }
+    }
+    else
+        hits_before = trace_primary_hits(*job.camera, *job.world, job.width, job.height);
+
+    std::vector<box_ab> surfaces, occluders;
+    result.geometry_update = scene.apply_edit(current, next, changes, surfaces, occluders);
+    job.world = &scene.world();
+    job.background = scene.background;
+    if (prepare)
+        prepare();
+
+    // Path tracing bounces everywhere, a new camera or background shows in
+    // every pixel, and shadow maps rebuilt around moved shapes can change any.
+    bool shadow_maps = std::any_of(job.lights->begin(), job.lights->end(), [](const Light &light)
+                                   { return light.shadow_map != nullptr; });
+    std::vector<Region> tiles;
+    if (result.relit)
+        tiles = dirty_tiles(hits_before, hits_before, surfaces, occluders, *job.lights, changes.lights, options.mode,
+                            job.width, job.height, options.tile_size);
+    else if (options.mode == 3 || changes.camera || changes.background || (shadow_maps && !changes.moved.empty()))
+        for (int ty = 0; ty < job.height; ty += options.tile_size)
+            for (int tx = 0; tx < job.width; tx += options.tile_size)
+                tiles.push_back(Region{tx, ty, std::min(tx + options.tile_size, job.width), std::min(ty + options.tile_size, job.height)});
+    else
+        tiles = dirty_tiles(hits_before, trace_primary_hits(*job.camera, *job.world, job.width, job.height), surfaces, occluders,
+                            *job.lights, changes.lights, options.mode, job.width, job.height, options.tile_size);
+
+    RenderJob tile_job = job;
+    for (const Region &tile : tiles)
+    {
+        if (result.relit)
+        {
+            relight_image(framebuffer, *gbuffer, *job.world, *job.lights, job.background, job.width, options.max_depth, tile);
+            continue;
+        }
+        for (int y = tile.y0; y < tile.y1; ++y)
+            std::fill(framebuffer.begin() + size_t(y) * job.width + tile.x0, framebuffer.begin() + size_t(y) * job.width + tile.x1,
+                      Color(0, 0, 0));
+        tile_job.region = tile;
+        render_pass(framebuffer, tile_job, 0, options.samples, nullptr);
+    }
+    result.tiles = tiles.size();
+    return result;
+}
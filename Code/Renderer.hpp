@@ -0,0 +1,153 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Batch.hpp"
+#include "Checkpoint.hpp"
+#include "Numa.hpp"
+#include "Progressive.hpp"
+#include "Region.hpp"
+#include "Scene.hpp"
+
+struct RenderOptions
+{
+    int mode = 2;           // 1 binary, 2 Blinn-Phong, 3 path tracing
+    int samples = 10;       // per pixel
+    int max_depth = 5;      // mirror bounces in mode 2
+    int tile_size = 64;     // modes 1 and 2 are rendered in tiles of this size
+    WavefrontSettings path; // mode 3; path.sampler also places the camera samples of modes 1 and 2
+    bool sample_emitters = true; // render() has mode 3 sample the scene's emissive shapes (path.emitters)
+};
+
+struct RenderStats
+{
+    double seconds = 0;
+    size_t tiles = 0;
+    double msamples_per_second = 0;
+    WavefrontStats path; // mode 3
+};
+
+struct RenderResult
+{
+    std::vector<Color> framebuffer; // summed samples, width x height
+    int width = 0, height = 0, samples = 0;
+    RenderStats stats;
+    std::string error; // why nothing was rendered (the scene did not build); empty on success
+
+    bool ok() const { return error.empty(); }
+
+    bool write(const std::string &path, const ToneMapper &tone = ToneMapper()) const
+    {
+        return write_image(path, framebuffer, width, height, samples, tone);
+    }
+};
+
+// What render_region fills in besides the image, and the visibility buffer
+// the camera rays may start from (built for the same camera and size).
+struct RenderTargets
+{
+    AOVBuffers *aovs = nullptr;
+    GBuffer *gbuffer = nullptr;
+    const VisibilityBuffer *visibility = nullptr;
+};
+
+// One image, or a region of it, as render_region takes it, for the drivers
+// that render it pass by pass. The scene must outlive the job and be built.
+struct RenderJob
+{
+    const Camera *camera = nullptr;
+    const Hittable *world = nullptr;
+    const std::vector<Light> *lights = nullptr;
+    Color background = Color(0, 0, 0);
+    int width = 0, height = 0;
+    Region region;
+    RenderTargets targets;
+    const EmissiveLights *emitters = nullptr; // the scene's, for options.sample_emitters as in render()
+
+    RenderJob() = default;
+    // The camera's whole image of scene.
+    RenderJob(const Scene &scene, const Camera &scene_camera)
+        : camera(&scene_camera), world(&scene.world()), lights(&scene.lights), background(scene.background),
+          width(scene_camera.width), height(scene_camera.height), region(Region::full(width, height)),
+          emitters(&scene.emitters)
+    {
+    }
+};
+
+// What Renderer::apply_edit did with one edit of the scene file.
+struct EditResult
+{
+    std::string reload_reason;   // why the edit needs a full reload instead; nothing was applied
+    std::string geometry_update; // how the BVH followed the moved shapes (Scene::apply_edit)
+    size_t tiles = 0;            // rendered again, or relit from the G-buffer
+    bool relit = false;
+};
+
+// Renders scenes with one pool of pinned threads that lives as long as the
+// renderer, so repeated renders pay neither thread start-up nor a scene load.
+// Modes 1 and 2 go tile by tile through the pool; mode 3 is the wavefront
+// path tracer, each of whose stages runs on the pool too. Not to be called
+// from the pool's own threads.
+class Renderer
+{
+public:
+    RenderOptions options;
+
+    explicit Renderer(RenderOptions render_options = RenderOptions(), std::vector<NumaNode> nodes = detect_numa_nodes());
+
+    // The camera's width x height image of scene, built first if it is not yet.
+    RenderResult render(Scene &scene, const Camera &camera);
+
+    // Adds samples [first_sample, first_sample + samples) of region to target,
+    // which holds the width x height image's rows from first_row on (as do the
+    // AOVs; the G-buffer and visibility buffer cover the whole image).
+    WavefrontStats render_region(std::vector<Color> &target, int first_row, const Camera &camera, const Hittable &world,
+                                 const std::vector<Light> &lights, const Color &background, int width, int height,
+                                 const Region &region, int first_sample, int samples, const RenderTargets &targets = RenderTargets());
+
+    // Passes of job.region into framebuffer (the whole width x height image)
+    // until settings say stop; see render_progressive in Progressive.hpp.
+    // snapshot(samples) may publish the image between passes.
+    ProgressiveResult render_progressive(std::vector<Color> &framebuffer, const RenderJob &job, const ProgressiveSettings &settings,
+                                         const std::function<void(int)> &snapshot = nullptr, WavefrontStats *path_stats = nullptr);
+
+    // Loads the checkpoint at settings.path into framebuffer if it belongs to
+    // job (same size, region, fingerprint and sampler) and holds no more than
+    // samples per pixel. Returns the sample to carry on from, or -1 with error.
+    int resume_checkpoint(std::vector<Color> &framebuffer, const RenderJob &job, int samples, const CheckpointSettings &settings,
+                          std::string &error);
+
+    // Samples [first_sample, samples) of job.region into framebuffer, one per
+    // pass, checkpointed to settings.path every settings.seconds. SIGTERM or
+    // SIGINT stop it after the current pass with a last checkpoint.
+    CheckpointedResult render_checkpointed(std::vector<Color> &framebuffer, const RenderJob &job, int first_sample, int samples,
+                                           const CheckpointSettings &settings, WavefrontStats *path_stats = nullptr);
+
+    // One whole job.width x job.height image per camera (job.camera and
+    // job.region aside), for a batch of views of one scene. Modes 1 and 2 put
+    // the tiles of every view into one queue on the pool (see render_views);
+    // in mode 3 the views take turns. finish_view(view, framebuffer) gets each
+    // image once it is done, on whichever thread finished it.
+    std::vector<ViewStats> render_batch(const RenderJob &job, const std::vector<Camera> &cameras,
+                                        const std::function<void(size_t, std::vector<Color> &)> &finish_view,
+                                        WavefrontStats *path_stats = nullptr);
+
+    // Watch mode: applies the edit of the scene file from current to next
+    // (changes, as diff_scenes found them) to scene in place and renders again
+    // the tiles of job in framebuffer that it can affect, relit from
+    // job.targets.gbuffer when only lights and materials changed. prepare()
+    // runs once the scene has taken the edit and job.world follows it, before
+    // any tile is rendered (to update *job.camera, for instance).
+    EditResult apply_edit(Scene &scene, const json &current, const json &next, const SceneChanges &changes,
+                          std::vector<Color> &framebuffer, RenderJob &job, const std::function<void()> &prepare = nullptr);
+
+    NumaThreadPool &pool() { return threads; }
+
+private:
+    NumaThreadPool threads;
+    std::unique_ptr<Sampler> default_sampler;
+
+    const Sampler &sampler() const { return options.path.sampler ? *options.path.sampler : *default_sampler; }
+    void render_pass(std::vector<Color> &framebuffer, const RenderJob &job, int first_sample, int samples, WavefrontStats *path_stats);
+};
@@ -0,0 +1,248 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "utility.hpp"
+#include "Vector2.hpp"
+
+// Where the sample values of a camera sample come from. Every sampler is a
+// pure function of (pixel, sample index, dimension), so any split of the image
+// or of the sample count gives the same values, like seed_sample does for the
+// random stream. Dimensions are used in a fixed order: 0-1 pixel jitter, 2-3
+// lens, then SAMPLE_DIMENSIONS_PER_BOUNCE per path-tracing bounce.
+
+const uint32_t SAMPLE_DIMENSIONS_PER_BOUNCE = 4;
+
+class Sampler
+{
+public:
+    virtual ~Sampler() = default;
+    virtual const char *name() const = 0;
+    // Dimension `dimension` of sample `index` of pixel (x, y), in [0, 1).
+    virtual double sample(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) const = 0;
+};
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return static_cast<uint32_t>(hash_seed((static_cast<uint64_t>(seed) << 32) | v));
+}
+
+// Laine-Karras hash: flips each bit depending only on the bits below it.
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of a 32-bit fixed-point value in [0, 1) (Burley 2020):
+// each bit is flipped depending on the bits above it.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// First two Sobol dimensions: the van der Corput sequence and the one from
+// the polynomial x + 1, whose direction numbers are v[k] = v[k-1] ^ (v[k-1] >> 1).
+inline uint32_t sobol_2d(uint32_t index, int dimension)
+{
+    if (dimension == 0)
+        return reverse_bits(index);
+    uint32_t result = 0, v = 1u << 31;
+    for (; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+inline double to_unit_interval(uint32_t x)
+{
+    return std::min(x * (1.0 / 4294967296.0), 0.99999999);
+}
+
+// Each pixel's own random stream: what rendering always used.
+class IndependentSampler : public Sampler
+{
+public:
+    const char *name() const override { return "independent"; }
+    double sample(uint32_t, uint32_t, uint32_t, uint32_t) const override { return random_double(); }
+};
+
+// Owen-scrambled Sobol, padded in pairs of dimensions: every pair is the
+// two-dimensional Sobol set with its own index shuffle and scramble, seeded
+// per pixel (Burley, "Practical Hash-based Owen Scrambling").
+class SobolSampler : public Sampler
+{
+public:
+    const char *name() const override { return "sobol"; }
+    double sample(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) const override
+    {
+        uint32_t seed = hash_combine(hash_combine(x, y), dimension / 2);
+        uint32_t shuffled = nested_uniform_scramble(index, seed);
+        uint32_t value = sobol_2d(shuffled, dimension % 2);
+        return to_unit_interval(nested_uniform_scramble(value, hash_combine(seed, dimension % 2 + 1)));
+    }
+};
+
+// Halton with a nested random digit permutation per pixel and dimension.
+// Dimensions past the prime table fall back to the random stream.
+class HaltonSampler : public Sampler
+{
+public:
+    const char *name() const override { return "halton"; }
+    double sample(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) const override
+    {
+        static const uint32_t primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+        if (dimension >= sizeof(primes) / sizeof(primes[0]))
+            return random_double();
+        uint32_t base = primes[dimension];
+        uint32_t seed = hash_combine(hash_combine(x, y), dimension);
+
+        // Enough digits for 32-bit precision; the scramble also fills the
+        // digits past the index's own, so values don't cluster near 0.
+        double inv_base = 1.0 / base, scale = 1, result = 0;
+        uint64_t prefix = 0;
+        for (int digit = 0; scale * base > 1e-9; ++digit)
+        {
+            uint32_t d = index % base;
+            index /= base;
+            // The permutation of a digit depends on all digits before it.
+            uint32_t shift = hash_combine(seed, static_cast<uint32_t>(prefix * 31 + digit)) % base;
+            uint32_t permuted = (d + shift) % base;
+            scale *= inv_base;
+            result += permuted * scale;
+            prefix = prefix * base + d;
+        }
+        return std::min(result, 0.99999999);
+    }
+};
+
+// Sobol shared by all pixels, rotated per pixel by a blue-noise mask (Heitz
+// and Belcour style): the per-pixel error is as small as plain Sobol gives, and
+// what is left is spread as high-frequency noise instead of clumps.
+class BlueNoiseSampler : public Sampler
+{
+public:
+    static const int MASK_SIZE = 64;
+
+    const char *name() const override { return "bluenoise"; }
+    double sample(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) const override
+    {
+        const std::vector<float> &mask = blue_noise_mask();
+        // The same shuffle everywhere keeps neighbouring pixels' sequences aligned.
+        uint32_t pair_seed = hash_combine(0xB1E5EEDu, dimension / 2);
+        uint32_t value = sobol_2d(nested_uniform_scramble(index, pair_seed), dimension % 2);
+        // Each dimension reads the mask at its own toroidal offset.
+        uint32_t offset = hash_combine(0xB1E5EEDu, dimension + 1);
+        uint32_t mx = (x + offset) % MASK_SIZE, my = (y + (offset >> 16)) % MASK_SIZE;
+        double rotated = to_unit_interval(value) + mask[my * MASK_SIZE + mx];
+        return rotated >= 1 ? rotated - 1 : rotated;
+    }
+
+    // 64x64 values in [0, 1), built once by void-and-cluster style greedy
+    // filling: each next rank goes to the pixel farthest (by Gaussian energy)
+    // from the ones already placed.
+    static const std::vector<float> &blue_noise_mask()
+    {
+        static const std::vector<float> mask = []
+        {
+            const int n = MASK_SIZE * MASK_SIZE;
+            const double sigma = 1.9;
+            std::vector<double> falloff(n); // energy by toroidal offset
+            for (int dy = 0; dy < MASK_SIZE; ++dy)
+                for (int dx = 0; dx < MASK_SIZE; ++dx)
+                {
+                    int wx = std::min(dx, MASK_SIZE - dx), wy = std::min(dy, MASK_SIZE - dy);
+                    falloff[dy * MASK_SIZE + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+                }
+
+            std::vector<double> energy(n, 0);
+            std::vector<float> ranks(n, -1);
+            for (int rank = 0; rank < n; ++rank)
+            {
+                int best = -1;
+                for (int i = 0; i < n; ++i)
+                {
+                    if (ranks[i] >= 0)
+                        continue;
+                    // A fixed hash breaks ties, so the first picks are spread out too.
+                    if (best < 0 || energy[i] < energy[best] ||
+                        (energy[i] == energy[best] && hash_seed(i) < hash_seed(best)))
+                        best = i;
+                }
+                ranks[best] = (rank + 0.5f) / n;
+                int bx = best % MASK_SIZE, by = best / MASK_SIZE;
+                for (int y = 0; y < MASK_SIZE; ++y)
+                    for (int x = 0; x < MASK_SIZE; ++x)
+                    {
+                        int dx = (x - bx + MASK_SIZE) % MASK_SIZE, dy = (y - by + MASK_SIZE) % MASK_SIZE;
+                        energy[y * MASK_SIZE + x] += falloff[dy * MASK_SIZE + dx];
+                    }
+            }
+            return ranks;
+        }();
+        return mask;
+    }
+};
+
+// nullptr for an unknown name.
+inline std::unique_ptr<Sampler> make_sampler(const std::string &name)
+{
+    if (name == "independent")
+        return std::make_unique<IndependentSampler>();
+    if (name == "sobol")
+        return std::make_unique<SobolSampler>();
+    if (name == "halton")
+        return std::make_unique<HaltonSampler>();
+    if (name == "bluenoise")
+        return std::make_unique<BlueNoiseSampler>();
+    return nullptr;
+}
+
+// The camera sample a thread is working on. Code that needs sample values
+// (the camera, Material::scatter) draws the next dimension from here; with no
+// sampler installed that is just random_double().
+struct SampleStream
+{
+    const Sampler *sampler = nullptr;
+    uint32_t x = 0, y = 0, index = 0, dimension = 0;
+};
+
+inline SampleStream &sample_stream()
+{
+    thread_local SampleStream stream;
+    return stream;
+}
+
+inline void start_sample(const Sampler *sampler, uint32_t x, uint32_t y, uint32_t index)
+{
+    sample_stream() = SampleStream{sampler, x, y, index, 0};
+}
+
+inline double sample_1d()
+{
+    SampleStream &s = sample_stream();
+    if (!s.sampler)
+        return random_double();
+    return s.sampler->sample(s.x, s.y, s.index, s.dimension++);
+}
+
+inline Vector2 sample_2d()
+{
+    double a = sample_1d();
+    double b = sample_1d();
+    return Vector2(a, b);
+}
@@ -0,0 +1,178 @@
+#include <chrono>
+#include "Scene.hpp"
+
+bool Scene::load(const json &j, std::string &error)
+{
+    parseLights(j, lights);
+    if (j["scene"].contains("backgroundcolor"))
+        background = Color(j["scene"]["backgroundcolor"]);
+    // Out of core the shapes must not be kept alive, so edits there need a full reload.
+    parseScene(j, objects, shape_arena(), &dynamic_objects, options.keep_entries && options.chunk_shapes == 0 ? &entries : nullptr);
+    if (objects.empty() && dynamic_objects.empty())
+    {
+        error = "The scene has no shapes.";
+        return false;
+    }
+    return true;
+}
+
+bool Scene::build(std::string &error)
+{
+    if (objects.empty() && dynamic_objects.empty())
+    {
+        error = "The scene has no shapes.";
+        return false;
+    }
+    auto build_start = std::chrono::high_resolution_clock::now();
+    stats.static_shapes = objects.size();
+    stats.dynamic_shapes = dynamic_objects.size();
+    collect_emitters();
+    // The static shapes; null when every shape is dynamic or they are out of core.
+    if (!objects.empty() && options.chunk_shapes > 0)
+    {
+        out_of_core = std::make_unique<OutOfCoreScene>(objects, options.chunk_shapes);
+        if (!out_of_core->valid())
+        {
+            error = "Could not create the out-of-core geometry file."; // already reported by OutOfCoreScene
+            return false;
+        }
+        std::vector<std::shared_ptr<Hittable>>().swap(objects);
+    }
+    else if (!objects.empty())
+        bvh_tree = std::make_unique<BVHNode>(objects, 0, objects.size(), 0.0, 0, shape_arena());
+    static_world = out_of_core ? static_cast<const Hittable *>(out_of_core.get()) : bvh_tree.get();
+    std::chrono::duration<double> build_time = std::chrono::high_resolution_clock::now() - build_start;
+    stats.build_seconds = build_time.count();
+    return true;
+}
+
+void Scene::compile()
+{
+    // Tracing goes through the compiled copy of the tree unless asked not to.
+    auto compile_start = std::chrono::high_resolution_clock::now();
+    if (options.compile && bvh_tree)
+    {
+        compiled = std::make_unique<CompiledScene>(*bvh_tree, options.quantized_bvh);
+        static_world = compiled.get();
+    }
+    std::chrono::duration<double> compile_time = std::chrono::high_resolution_clock::now() - compile_start;
+    stats.compile_seconds = compile_time.count();
+
+    // A grid or kd-tree over the same compiled primitives.
+    if (options.accel != "bvh" && compiled && !options.quantized_bvh)
+    {
+        if (options.accel == "auto")
+            options.accel = choose_accel(*compiled);
+        auto accel_start = std::chrono::high_resolution_clock::now();
+        if (options.accel == "grid")
+            static_world = (grid = std::make_unique<UniformGrid>(*compiled)).get();
+        else if (options.accel == "kdtree")
+            static_world = (kd_tree = std::make_unique<KdTree>(*compiled)).get();
+        std::chrono::duration<double> accel_time = std::chrono::high_resolution_clock::now() - accel_start;
+        stats.accel_seconds = accel_time.count();
+    }
+
+    // Shapes marked dynamic get their own BLAS under a two-level scene, so
+    // moving them never touches the static BVH.
+    if (!dynamic_objects.empty())
+        two_level = std::make_unique<TwoLevelScene>(static_world, dynamic_objects);
+}
+
+void Scene::collect_emitters()
+{
+    emitters.clear();
+    emitters.add(objects);
+    emitters.add(dynamic_objects);
+    stats.emitters = emitters.size();
+}
+
+std::string Scene::update_static()
+{
+    std::string update;
+    if (compiled->refit() <= DynamicBLAS::REBUILD_RATIO)
+        update = "BVH refitted";
+    else
+    {
+        // Too loose after refitting: rebuild the static BVH from scratch, on
+        // the heap, so the tree it replaces is freed (the arena never is).
+        bvh_tree = std::make_unique<BVHNode>(objects, 0, objects.size(), 0.0, 0, nullptr);
+        compiled = std::make_unique<CompiledScene>(*bvh_tree);
+        static_world = compiled.get();
+        update = "BVH rebuilt";
+    }
+    if (grid)
+        static_world = (grid = std::make_unique<UniformGrid>(*compiled)).get();
+    if (kd_tree)
+        static_world = (kd_tree = std::make_unique<KdTree>(*compiled)).get();
+    if (grid || kd_tree)
+        update += ", " + options.accel + " rebuilt";
+    if (two_level)
+        two_level = std::make_unique<TwoLevelScene>(static_world, dynamic_objects);
+    return update;
+}
+
+std::string Scene::edit_reload_reason(const SceneChanges &changes) const
+{
+    if (!changes.reload_reason.empty())
+        return changes.reload_reason;
+    if ((!changes.moved.empty() || !changes.restyled.empty()) && entries.empty())
+        return "shapes changed in an out-of-core scene";
+    if (changes.static_moved && !(compiled && !compiled->quantized()))
+        return "static shapes moved and only a compiled, unquantized BVH can be refitted";
+    return "";
+}
+
+std::string Scene::apply_edit(const json &current, const json &next, const SceneChanges &changes,
+                              std::vector<box_ab> &surfaces, std::vector<box_ab> &occluders)
+{
+    // Shapes take their new entry in place; the compiled copy follows.
+    std::vector<size_t> changed = changes.moved;
+    changed.insert(changed.end(), changes.restyled.begin(), changes.restyled.end());
+    std::shared_ptr<Material> default_material;
+    for (size_t k = 0; k < changed.size(); ++k)
+    {
+        size_t i = changed[k];
+        Hittable *shape = entries[i].get();
+        if (!shape)
+            continue;
+        const json &entry = next["scene"]["shapes"][i];
+        box_ab old_box, new_box;
+        shape->bounding_box(0, 0, old_box);
+        if (k >= changes.moved.size() && restyled_in_place(current, next, i) && shapeMaterial(*shape) &&
+            assignMaterial(*shapeMaterial(*shape), *parseMaterial(entry, nullptr, default_material)))
+        {
+            surfaces.push_back(old_box);
+            continue;
+        }
+        // On the heap, as the shape is: its material is freed with the next edit.
+        std::shared_ptr<Hittable> fresh = parseShape(entry, parseMaterial(entry, nullptr, default_material), nullptr);
+        assignShape(*shape, *fresh);
+        shape->bounding_box(0, 0, new_box);
+        surfaces.insert(surfaces.end(), {old_box, new_box});
+        if (k < changes.moved.size())
+            occluders.insert(occluders.end(), {old_box, new_box});
+        if (compiled)
+            compiled->refresh(shape);
+    }
+
+    std::string geometry_update = "geometry untouched";
+    if (changes.static_moved)
+        geometry_update = update_static();
+    else if (changes.dynamic_moved)
+    {
+        two_level->update();
+        geometry_update = "dynamic BVH refitted";
+    }
+    // Moved or restyled shapes may emit differently now.
+    if (!changed.empty())
+        collect_emitters();
+
+    if (changes.lights)
+    {
+        lights.clear();
+        parseLights(next, lights);
+    }
+    if (changes.background)
+        background = next["scene"].contains("backgroundcolor") ? Color(next["scene"]["backgroundcolor"]) : Color(0.25, 0.25, 0.25);
+    return geometry_update;
+}
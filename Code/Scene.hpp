@@ -1,49 +1,103 @@
 #pragma once
 #include <vector>
 #include <memory>
-#include "Ray.hpp"
-#include "Hittable.hpp"
-#include "Light.hpp"
+#include <string>
+#include "HotReload.hpp"
+#include "RenderCore.hpp"
 
+// How Scene::build and Scene::compile turn the shapes into something to trace.
+struct SceneOptions
+{
+    bool use_arena = true;     // shapes, materials and BVH nodes in one arena (not out of core)
+    bool compile = true;       // trace through the flattened copy of the BVH
+    bool quantized_bvh = false;
+    int chunk_shapes = 0;      // > 0: static shapes out of core, in chunks of this many
+    std::string accel = "bvh"; // or grid, kdtree, auto: over the compiled, unquantized scene
+    bool keep_entries = false; // keep each JSON entry's shape for in-place edits (--watch)
+};
+
+struct SceneStats
+{
+    size_t static_shapes = 0, dynamic_shapes = 0, emitters = 0;
+    double build_seconds = 0, compile_seconds = 0, accel_seconds = 0;
+};
+
+// The shapes, lights and background of one scene and everything built to
+// trace them, loaded once and rendered any number of times (see Renderer).
+// From a scene file: load(), build(), compile(). Programmatically: addObject
+// and addLight, then the same build() and compile().
 class Scene
 {
 public:
-    std::vector<std::shared_ptr<Hittable>> objects; // vector of all hittable objects in the scene
-    std::vector<Light> lights;                      // vector of all light sources in the scene
-    Scene() = default;
-    
+    Arena arena; // declared first, so it is released last
+    SceneOptions options;
+    std::vector<std::shared_ptr<Hittable>> objects;         // vector of all static hittable objects in the scene
+    std::vector<std::shared_ptr<Hittable>> dynamic_objects; // shapes marked "dynamic", under a two-level scene
+    std::vector<std::shared_ptr<Hittable>> entries;         // with keep_entries, the shape of every scene file entry
+    std::vector<Light> lights;                              // vector of all light sources in the scene
+    Color background = Color(0.25, 0.25, 0.25);
+    EmissiveLights emitters;                                // the emissive shapes, sampled by the path tracer
+
+    std::unique_ptr<BVHNode> bvh_tree;
+    std::unique_ptr<OutOfCoreScene> out_of_core;
+    std::unique_ptr<CompiledScene> compiled;
+    std::unique_ptr<UniformGrid> grid;
+    std::unique_ptr<KdTree> kd_tree;
+    std::unique_ptr<TwoLevelScene> two_level;
+    const Hittable *static_world = nullptr; // what the static shapes are traced through
+    SceneStats stats;
+
+    explicit Scene(SceneOptions scene_options = SceneOptions()) : options(scene_options) {}
+    Scene(const Scene &) = delete;
+    Scene &operator=(const Scene &) = delete;
+
     // Add light sources to the scene
     void addLight(const Light &light)
     {
         lights.push_back(light);
     }
-    // Add objects (spheres, triangles, cylinders ) to the scene
-    void addObject(std::shared_ptr<Hittable> object)
+    // Add objects (spheres, triangles, cylinders ) to the scene, before build()
+    void addObject(std::shared_ptr<Hittable> object, bool dynamic = false)
     {
-        objects.push_back(object);
+        (dynamic ? dynamic_objects : objects).push_back(object);
     }
 
-    
+    // Where shapes and materials are allocated; null out of core, where each
+    // shape is freed once written out.
+    Arena *shape_arena() { return options.use_arena && options.chunk_shapes == 0 ? &arena : nullptr; }
+
+    // The lights, background and shapes of a scene file (its cameras are
+    // read with parseCamera and camera_views).
+    bool load(const json &j, std::string &error);
+    // The static tree: a BVH over the shapes, or chunks on disk out of core.
+    // Collects the emitters first, while every shape is still in memory.
+    bool build(std::string &error);
+    // The compiled copy of the BVH, the options.accel structure over it, and
+    // the two-level scene over the dynamic shapes.
+    void compile();
+    // After static shapes moved in place (and compiled->refresh): refit the
+    // compiled BVH, or rebuild it if that leaves it too loose. Says which.
+    std::string update_static();
+    // The emissive shapes as they are now (again after shapes moved).
+    void collect_emitters();
+
+    // Watch mode: why the edit of the scene file that diff_scenes found as
+    // changes cannot be applied in place; empty if apply_edit can take it.
+    std::string edit_reload_reason(const SceneChanges &changes) const;
+    // Gives the changed shapes their entries of next in place, then brings
+    // the BVH, emitters, lights and background up to date. Adds the boxes of
+    // the changed shapes before and after to surfaces (those of moved shapes
+    // also to occluders) and says how the geometry was updated.
+    std::string apply_edit(const json &current, const json &next, const SceneChanges &changes,
+                           std::vector<box_ab> &surfaces, std::vector<box_ab> &occluders);
+
+    bool ready() const { return static_world || two_level; }
+    const Hittable &world() const { return two_level ? static_cast<const Hittable &>(*two_level) : *static_world; }
 
     // Check for intersections with objects in the scene
     bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const
     {
-        Hit_record temp_rec;
-        bool hit_anything = false;
-        auto closest_so_far = t_max;
-
-        // Iterate through all objects and check for hits
-        for (const auto &object : objects)
-        {
-            if (object->hit(r, t_min, closest_so_far, temp_rec))
-            {
-                hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
-            }
-        }
-
-        return hit_anything;
+        return ready() && world().hit(r, t_min, t_max, rec);
     }
 
     // Access lights in the scene
@@ -51,5 +105,4 @@ public:
     {
         return lights;
     }
-    
-};
\ No newline at end of file
+};
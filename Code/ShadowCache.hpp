@@ -0,0 +1,156 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include "Hittable.hpp"
+
+// Shadow statistics summed over every thread that has used a ShadowCache.
+struct ShadowCacheStats
+{
+    uint64_t lookups = 0;    // shadow rays that went through the cache
+    uint64_t cache_hits = 0; // rays blocked by the cached occluder alone
+    uint64_t traversals = 0; // rays that fell back to a full traversal
+    uint64_t occluded = 0;   // rays found blocked, by the cache or the traversal
+
+    double hit_rate() const
+    {
+        return lookups ? static_cast<double>(cache_hits) / lookups : 0.0;
+    }
+
+    // Share of blocked shadow rays that never needed a traversal.
+    double occluded_hit_rate() const
+    {
+        return occluded ? static_cast<double>(cache_hits) / occluded : 0.0;
+    }
+};
+
+// Per-thread, per-light "last occluder" cache. Neighbouring shading points
+// usually find the same blocker for a given light, so that primitive is tested
+// first and the acceleration structure is only walked when it misses.
+class ShadowCache
+{
+public:
+    // Cache owned by the calling thread.
+    static ShadowCache &local()
+    {
+        thread_local ShadowCache cache;
+        return cache;
+    }
+
+    // True if something lies between the ray origin and t_max.
+    bool occluded(const Ray &shadow_ray, double t_min, double t_max, const Hittable &world, size_t light_index)
+    {
+        uint64_t now = epoch().load(std::memory_order_relaxed);
+        if (&world != current_world || now != current_epoch)
+        {
+            // Pointers cached for another scene are meaningless now.
+            std::fill(last_occluder.begin(), last_occluder.end(), nullptr);
+            current_world = &world;
+            current_epoch = now;
+        }
+        if (light_index >= last_occluder.size())
+            last_occluder.resize(light_index + 1, nullptr);
+
+        ++counts.lookups;
+        const Hittable *&cached = last_occluder[light_index];
+        if (cached && cached->any_hit(shadow_ray, t_min, t_max))
+        {
+            ++counts.cache_hits;
+            ++counts.occluded;
+            return true;
+        }
+
+        ++counts.traversals;
+        const Hittable *occluder = world.any_hit(shadow_ray, t_min, t_max);
+        if (occluder)
+        {
+            cached = occluder;
+            ++counts.occluded;
+        }
+        return occluder != nullptr;
+    }
+
+    // Empties every thread's cache before its next lookup. A new scene's world
+    // can land where a freed one was, and threads that outlive a render (the
+    // Renderer's pool) would otherwise keep testing its freed shapes.
+    static void forget_occluders()
+    {
+        epoch().fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Totals across live threads plus those that have already exited. Read it
+    // once rendering has finished so no worker is still counting.
+    static ShadowCacheStats stats()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        ShadowCacheStats total = retired_stats();
+        for (const ShadowCache *cache : registry())
+            add(total, cache->counts);
+        return total;
+    }
+
+    static void reset_stats()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        retired_stats() = ShadowCacheStats();
+        for (ShadowCache *cache : registry())
+            cache->counts = ShadowCacheStats();
+    }
+
+    ShadowCache(const ShadowCache &) = delete;
+    ShadowCache &operator=(const ShadowCache &) = delete;
+
+private:
+    std::vector<const Hittable *> last_occluder;
+    const Hittable *current_world = nullptr;
+    uint64_t current_epoch = 0;
+    ShadowCacheStats counts;
+
+    ShadowCache()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().push_back(this);
+    }
+
+    ~ShadowCache()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        add(retired_stats(), counts);
+        auto &caches = registry();
+        caches.erase(std::remove(caches.begin(), caches.end(), this), caches.end());
+    }
+
+    static void add(ShadowCacheStats &into, const ShadowCacheStats &from)
+    {
+        into.lookups += from.lookups;
+        into.cache_hits += from.cache_hits;
+        into.traversals += from.traversals;
+        into.occluded += from.occluded;
+    }
+
+    static std::atomic<uint64_t> &epoch()
+    {
+        static std::atomic<uint64_t> e(0);
+        return e;
+    }
+
+    static std::mutex &registry_mutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::vector<ShadowCache *> &registry()
+    {
+        static std::vector<ShadowCache *> caches;
+        return caches;
+    }
+
+    static ShadowCacheStats &retired_stats()
+    {
+        static ShadowCacheStats retired;
+        return retired;
+    }
+};
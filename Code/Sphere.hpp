@@ -40,12 +40,20 @@ public:
             Vector3 outward_normal = (rec.p - center) / radius;
             rec.set_face_normal(r, outward_normal);
             rec.material_ptr = material_ptr;
+
+            // Longitude/latitude mapping.
+            float theta = std::acos(clamp(-outward_normal.y, -1.0, 1.0));
+            float phi = std::atan2(-outward_normal.z, outward_normal.x) + pi;
+            rec.uv = Vector2(phi / (2 * pi), theta / pi);
+            rec.uv_per_unit = 1.0 / (pi * radius);
             return true;
         }
         return false;
     }
 
 
+    void translate(const Vector3 &offset) override { center += offset; }
+
     bool bounding_box(double t0, double t1, box_ab &output_box) const
     {
         output_box = box_ab(center - Vector3(radius, radius, radius),
@@ -0,0 +1,134 @@
+#pragma once
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Parallel.hpp"
+#include "Region.hpp"
+#include "ToneMap.hpp"
+#include "utility.hpp"
+
+using Color = Vector3;
+
+// Streaming output for images too big to hold in memory. The image is
+// rendered one band of rows at a time; each finished band is tone mapped
+// and written straight to its place in a binary (P6) PPM, so memory grows
+// with the band, not the image.
+
+// A P6 file whose rows can be written in any order. It is written under
+// path + ".tmp" and renamed by finish(), like write_image does.
+class StreamingImageWriter
+{
+public:
+    ~StreamingImageWriter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool open(const std::string &output_path, int image_width, int image_height)
+    {
+        path = output_path;
+        tmp_path = path + ".tmp";
+        width = image_width;
+        height = image_height;
+        fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        data_offset = static_cast<off_t>(header.size());
+        // Sizing the file up front lets bands land in any order.
+        return write_all(header.data(), header.size(), 0) &&
+               ftruncate(fd, data_offset + static_cast<off_t>(width) * height * 3) == 0;
+    }
+
+    // rows holds summed radiance for image rows [y0, y0 + rows.size() / width).
+    bool write_rows(int y0, const std::vector<Color> &rows, int samples_per_pixel, const ToneMapper &tone)
+    {
+        std::vector<unsigned char> bytes(rows.size() * 3);
+        parallel_for(rows.size() / width, [&](size_t y)
+                     { tone.encode_row(&rows[y * width], width, samples_per_pixel, 0, y0 + int(y), &bytes[3 * y * width]); });
+        return write_all(bytes.data(), bytes.size(), data_offset + static_cast<off_t>(y0) * width * 3);
+    }
+
+    bool finish()
+    {
+        bool ok = fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        fd = -1;
+        return ok && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    uint64_t bytes_written = 0;
+
+private:
+    bool write_all(const void *data, size_t size, off_t offset)
+    {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            ssize_t n = pwrite(fd, p, size, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+            offset += n;
+            bytes_written += n;
+        }
+        return true;
+    }
+
+    std::string path, tmp_path;
+    int fd = -1;
+    int width = 0, height = 0;
+    off_t data_offset = 0;
+};
+
+struct StreamingResult
+{
+    int bands = 0;
+    size_t peak_buffer_bytes = 0; // band framebuffers plus the encoded band in flight
+    bool ok = true;
+};
+
+// render_band(band, region) must render every sample of region into band,
+// which holds image rows from region.y0 on. Two band buffers alternate so
+// the previous band is encoded and written while the next one renders.
+template <typename RenderBand>
+StreamingResult render_streaming(StreamingImageWriter &writer, int width, int height, int band_rows,
+                                 int samples_per_pixel, const ToneMapper &tone, RenderBand render_band)
+{
+    StreamingResult result;
+    band_rows = std::max(1, std::min(band_rows, height));
+    size_t band_pixels = size_t(band_rows) * width;
+    std::vector<Color> bands[2];
+    std::future<bool> pending;
+    result.peak_buffer_bytes = 2 * band_pixels * sizeof(Color) + band_pixels * 3;
+
+    for (int y = 0; y < height; y += band_rows, ++result.bands)
+    {
+        Region region{0, y, width, std::min(y + band_rows, height)};
+        std::vector<Color> &band = bands[result.bands % 2];
+        band.assign(region.area(), Color(0, 0, 0));
+        render_band(band, region);
+
+        // The buffer the last write used is the other one, so only wait now.
+        if (pending.valid())
+            result.ok = pending.get() && result.ok;
+        pending = std::async(std::launch::async, [&writer, &band, &tone, y, samples_per_pixel]
+                             { return writer.write_rows(y, band, samples_per_pixel, tone); });
+        std::cout << "\rBand " << result.bands + 1 << "/" << (height + band_rows - 1) / band_rows << std::flush;
+    }
+    if (pending.valid())
+        result.ok = pending.get() && result.ok;
+    std::cout << "\n";
+    return result;
+}
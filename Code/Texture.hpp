@@ -1,42 +1,411 @@
 #pragma once
+#include <cstdio>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
 #include "Vector2.hpp"
+#include "Vector3.hpp"
 
+using Color = Vector3;
 
-class Texture {
+// Textures are stored as 8-bit RGB in square tiles, one tiled image per mip
+// level, in a scratch file written once at load time. Tiles are read back
+// lazily on first access and kept in one LRU cache shared by all textures,
+// so resident texture memory stays under a fixed byte budget.
+
+const int TEXTURE_TILE_SIZE = 32;
+const size_t TEXTURE_TILE_BYTES = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3;
+
+using TextureTile = std::vector<uint8_t>;
+
+struct TextureCacheStats
+{
+    uint64_t lookups = 0;
+    uint64_t misses = 0; // tiles read from disk
+    uint64_t evictions = 0;
+    uint64_t bytes_read = 0;
+    size_t resident_bytes = 0;
+};
+
+class TextureCache
+{
 public:
-    int width, height;
-    std::vector<Color> data;
+    static TextureCache &shared()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void set_budget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget_bytes = bytes;
+        evict_over_budget();
+    }
+
+    size_t budget() const { return budget_bytes; }
+
+    TextureCacheStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        TextureCacheStats s = counters;
+        s.resident_bytes = resident_bytes;
+        return s;
+    }
+
+    // Returns the tile stored under key, calling load(tile) to fill it on a miss.
+    template <typename Loader>
+    std::shared_ptr<const TextureTile> fetch(uint64_t key, Loader load)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++counters.lookups;
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+        ++counters.misses;
+
+        // Read outside the lock so other threads keep sampling resident tiles.
+        lock.unlock();
+        auto tile = std::make_shared<TextureTile>(TEXTURE_TILE_BYTES);
+        load(*tile);
+        lock.lock();
+
+        counters.bytes_read += TEXTURE_TILE_BYTES;
+        it = index.find(key);
+        if (it != index.end())
+            return it->second->second; // another thread loaded it meanwhile
+
+        lru.emplace_front(key, tile);
+        index[key] = lru.begin();
+        resident_bytes += TEXTURE_TILE_BYTES;
+        evict_over_budget();
+        return tile;
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<const TextureTile>>;
+
+    mutable std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t budget_bytes = size_t(64) << 20;
+    size_t resident_bytes = 0;
+    TextureCacheStats counters;
 
-    Texture(const std::string &filename) {
+    void evict_over_budget()
+    {
+        // Always keep the tile just loaded, even with a tiny budget.
+        while (resident_bytes > budget_bytes && lru.size() > 1)
+        {
+            index.erase(lru.back().first);
+            lru.pop_back();
+            resident_bytes -= TEXTURE_TILE_BYTES;
+            ++counters.evictions;
+        }
+    }
+};
+
+class Texture
+{
+public:
+    int width = 0, height = 0;
+
+    // Converts a binary (P6, 8-bit) PPM into the tiled mip file. Only a band of
+    // one tile row per level is held in memory while doing so.
+    Texture(const std::string &filename)
+    {
         std::ifstream file(filename, std::ios::binary);
-        if (!file) {
+        if (!file)
+        {
             std::cerr << "Cannot open file: " << filename << std::endl;
             return;
         }
 
         std::string header;
         file >> header;
-        if (header != "P6") {
+        if (header != "P6")
+        {
             std::cerr << "Invalid PPM file/Not a PPM file: " << filename << std::endl;
             return;
         }
 
-        file >> width >> height;
         int max_val;
-        file >> max_val;
-        file.ignore(256, '\n'); 
+        file >> width >> height >> max_val;
+        file.get(); // single whitespace before the raster
+        if (!file || width <= 0 || height <= 0 || max_val != 255)
+        {
+            std::cerr << "Unsupported PPM (expected 8-bit P6): " << filename << std::endl;
+            width = height = 0;
+            return;
+        }
+
+        tiles = std::tmpfile();
+        if (!tiles)
+        {
+            std::cerr << "Cannot create texture tile file for " << filename << std::endl;
+            width = height = 0;
+            return;
+        }
+        static std::atomic<int> next_id(0);
+        id = next_id++;
+
+        layout_levels();
+
+        // Level 0 straight from the PPM, one band of tile rows at a time.
+        const Level &base = levels[0];
+        std::vector<uint8_t> band(size_t(base.width) * TEXTURE_TILE_SIZE * 3);
+        for (int ty = 0; ty < base.tiles_y; ++ty)
+        {
+            int rows = std::min(TEXTURE_TILE_SIZE, base.height - ty * TEXTURE_TILE_SIZE);
+            size_t bytes = size_t(base.width) * rows * 3;
+            file.read(reinterpret_cast<char *>(band.data()), bytes);
+            if (size_t(file.gcount()) != bytes)
+            {
+                std::cerr << "Truncated PPM: " << filename << std::endl;
+                width = height = 0;
+                return;
+            }
+            write_band(0, ty, band);
+        }
+
+        // Every further level is a 2x2 box filter of the one above it.
+        for (size_t l = 1; l < levels.size(); ++l)
+            build_level(l);
+    }
+
+    ~Texture()
+    {
+        if (tiles)
+            std::fclose(tiles);
+    }
 
-        data.resize(width * height);
-        for (int i = 0; i < width * height; ++i) {
-            unsigned char rgb[3];
-            file.read(reinterpret_cast<char*>(rgb), 3);
-            data[i] = Color(rgb[0] / 255.0, rgb[1] / 255.0, rgb[2] / 255.0);
+    Texture(const Texture &) = delete;
+    Texture &operator=(const Texture &) = delete;
+
+    // Textures are shared between materials that name the same file.
+    static std::shared_ptr<Texture> load(const std::string &filename)
+    {
+        static std::mutex m;
+        static std::map<std::string, std::weak_ptr<Texture>> loaded;
+        std::lock_guard<std::mutex> lock(m);
+        if (auto existing = loaded[filename].lock())
+            return existing;
+        auto texture = std::make_shared<Texture>(filename);
+        loaded[filename] = texture;
+        return texture;
+    }
+
+    bool valid() const { return width > 0 && height > 0; }
+    int level_count() const { return static_cast<int>(levels.size()); }
+
+    // Bilinear lookup in the finest level.
+    Color sample(const Vector2 &uv) const
+    {
+        return sample(uv, 0.0f);
+    }
+
+    // Trilinear lookup; footprint is the width of the lookup in uv units
+    // (e.g. a ray cone's width at the hit times the surface's uv density).
+    Color sample(const Vector2 &uv, float footprint) const
+    {
+        if (!valid())
+            return Color(1, 1, 1);
+
+        float lod = footprint > 0 ? std::log2(footprint * std::max(width, height)) : 0.0f;
+        lod = std::min(std::max(lod, 0.0f), static_cast<float>(levels.size() - 1));
+        int fine = static_cast<int>(lod);
+        float blend = lod - fine;
+
+        Color c = bilinear(fine, uv);
+        if (blend > 0 && fine + 1 < level_count())
+            c = c * (1 - blend) + bilinear(fine + 1, uv) * blend;
+        return c;
+    }
+
+private:
+    struct Level
+    {
+        int width, height;
+        int tiles_x, tiles_y;
+        long offset; // byte offset of the level's first tile
+    };
+
+    std::vector<Level> levels;
+    std::FILE *tiles = nullptr;
+    int id = 0;
+
+    void layout_levels()
+    {
+        int w = width, h = height;
+        long offset = 0;
+        while (true)
+        {
+            Level level{w, h, (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE, (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE, offset};
+            levels.push_back(level);
+            offset += long(level.tiles_x) * level.tiles_y * TEXTURE_TILE_BYTES;
+            if (w == 1 && h == 1)
+                break;
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
         }
     }
 
-    Color sample(const Vector2 &uv) const {
-        int x = static_cast<int>(uv.x * width) % width;
-        int y = static_cast<int>(uv.y * height) % height;
-        return data[y * width + x];
+    long tile_offset(int level, int tx, int ty) const
+    {
+        const Level &l = levels[level];
+        return l.offset + (long(ty) * l.tiles_x + tx) * long(TEXTURE_TILE_BYTES);
+    }
+
+    // band holds TEXTURE_TILE_SIZE scanlines of the level, row-major.
+    void write_band(int level, int ty, const std::vector<uint8_t> &band) const
+    {
+        const Level &l = levels[level];
+        TextureTile tile(TEXTURE_TILE_BYTES, 0);
+        int rows = std::min(TEXTURE_TILE_SIZE, l.height - ty * TEXTURE_TILE_SIZE);
+        for (int tx = 0; tx < l.tiles_x; ++tx)
+        {
+            int cols = std::min(TEXTURE_TILE_SIZE, l.width - tx * TEXTURE_TILE_SIZE);
+            for (int r = 0; r < rows; ++r)
+            {
+                const uint8_t *src = &band[(size_t(r) * l.width + tx * TEXTURE_TILE_SIZE) * 3];
+                std::copy(src, src + cols * 3, &tile[size_t(r) * TEXTURE_TILE_SIZE * 3]);
+            }
+            if (pwrite(fileno(tiles), tile.data(), TEXTURE_TILE_BYTES, tile_offset(level, tx, ty)) != long(TEXTURE_TILE_BYTES))
+                std::cerr << "Failed to write texture tile\n";
+        }
+    }
+
+    void read_band(int level, int ty, std::vector<uint8_t> &band) const
+    {
+        const Level &l = levels[level];
+        TextureTile tile(TEXTURE_TILE_BYTES);
+        int rows = std::min(TEXTURE_TILE_SIZE, l.height - ty * TEXTURE_TILE_SIZE);
+        for (int tx = 0; tx < l.tiles_x; ++tx)
+        {
+            read_tile(level, tx, ty, tile);
+            int cols = std::min(TEXTURE_TILE_SIZE, l.width - tx * TEXTURE_TILE_SIZE);
+            for (int r = 0; r < rows; ++r)
+            {
+                const uint8_t *src = &tile[size_t(r) * TEXTURE_TILE_SIZE * 3];
+                std::copy(src, src + cols * 3, &band[(size_t(r) * l.width + tx * TEXTURE_TILE_SIZE) * 3]);
+            }
+        }
+    }
+
+    void read_tile(int level, int tx, int ty, TextureTile &tile) const
+    {
+        if (pread(fileno(tiles), tile.data(), TEXTURE_TILE_BYTES, tile_offset(level, tx, ty)) != long(TEXTURE_TILE_BYTES))
+            std::fill(tile.begin(), tile.end(), 0);
+    }
+
+    void build_level(size_t level)
+    {
+        const Level &src = levels[level - 1];
+        const Level &dst = levels[level];
+        std::vector<uint8_t> upper(size_t(src.width) * TEXTURE_TILE_SIZE * 3);
+        std::vector<uint8_t> lower(upper.size());
+        std::vector<uint8_t> out(size_t(dst.width) * TEXTURE_TILE_SIZE * 3);
+
+        for (int ty = 0; ty < dst.tiles_y; ++ty)
+        {
+            // The output tile row covers two tile rows of the source level.
+            read_band(level - 1, 2 * ty, upper);
+            if (2 * ty + 1 < src.tiles_y)
+                read_band(level - 1, 2 * ty + 1, lower);
+
+            int first_src_row = 2 * ty * TEXTURE_TILE_SIZE;
+            auto src_row = [&](int y) -> const uint8_t *
+            {
+                int local = y - first_src_row;
+                return local < TEXTURE_TILE_SIZE ? &upper[size_t(local) * src.width * 3]
+                                                 : &lower[size_t(local - TEXTURE_TILE_SIZE) * src.width * 3];
+            };
+
+            int rows = std::min(TEXTURE_TILE_SIZE, dst.height - ty * TEXTURE_TILE_SIZE);
+            for (int r = 0; r < rows; ++r)
+            {
+                int y = ty * TEXTURE_TILE_SIZE + r;
+                const uint8_t *row0 = src_row(2 * y);
+                const uint8_t *row1 = src_row(std::min(2 * y + 1, src.height - 1));
+                for (int x = 0; x < dst.width; ++x)
+                {
+                    int x0 = 2 * x, x1 = std::min(2 * x + 1, src.width - 1);
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        int sum = row0[x0 * 3 + c] + row0[x1 * 3 + c] + row1[x0 * 3 + c] + row1[x1 * 3 + c];
+                        out[(size_t(r) * dst.width + x) * 3 + c] = static_cast<uint8_t>((sum + 2) / 4);
+                    }
+                }
+            }
+            write_band(level, ty, out);
+        }
+    }
+
+    // The pointer stays valid only until this thread's next texel() call.
+    const uint8_t *texel(int level, int x, int y) const
+    {
+        const Level &l = levels[level];
+        int tx = x / TEXTURE_TILE_SIZE, ty = y / TEXTURE_TILE_SIZE;
+        uint64_t key = (uint64_t(id) << 48) | (uint64_t(level) << 40) | (uint64_t(ty) * l.tiles_x + tx);
+
+        // A few tiles per thread skip the shared cache's lock on repeat lookups.
+        struct Recent
+        {
+            uint64_t key = ~uint64_t(0);
+            std::shared_ptr<const TextureTile> tile;
+        };
+        thread_local Recent recent[4];
+        Recent &slot = recent[(tx + 2 * ty) & 3];
+        if (slot.key != key)
+        {
+            slot.tile = TextureCache::shared().fetch(key, [&](TextureTile &tile)
+                                                     { read_tile(level, tx, ty, tile); });
+            slot.key = key;
+        }
+        int lx = x - tx * TEXTURE_TILE_SIZE, ly = y - ty * TEXTURE_TILE_SIZE;
+        return &(*slot.tile)[(size_t(ly) * TEXTURE_TILE_SIZE + lx) * 3];
+    }
+
+    Color bilinear(int level, const Vector2 &uv) const
+    {
+        const Level &l = levels[level];
+        float fx = uv.x * l.width - 0.5f;
+        float fy = uv.y * l.height - 0.5f;
+        float x_floor = std::floor(fx), y_floor = std::floor(fy);
+        float ax = fx - x_floor, ay = fy - y_floor;
+
+        // Repeat wrapping, as the nearest-texel lookup did.
+        auto wrap = [](int i, int n)
+        {
+            i %= n;
+            return i < 0 ? i + n : i;
+        };
+        int x0 = wrap(static_cast<int>(x_floor), l.width), x1 = wrap(x0 + 1, l.width);
+        int y0 = wrap(static_cast<int>(y_floor), l.height), y1 = wrap(y0 + 1, l.height);
+
+        float weights[4] = {(1 - ax) * (1 - ay), ax * (1 - ay), (1 - ax) * ay, ax * ay};
+        int xs[4] = {x0, x1, x0, x1};
+        int ys[4] = {y0, y0, y1, y1};
+        float rgb[3] = {0, 0, 0};
+        for (int i = 0; i < 4; ++i)
+        {
+            // Read each corner right away: the next lookup may recycle its tile.
+            const uint8_t *t = texel(level, xs[i], ys[i]);
+            for (int c = 0; c < 3; ++c)
+                rgb[c] += weights[i] * t[c];
+        }
+        return Color(rgb[0], rgb[1], rgb[2]) / 255.0f;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Parallel.hpp"
+#include "Vector3.hpp"
+
+using Color = Vector3;
+
+// Output stage: summed radiance in, 8-bit pixels out. Exposure, a tone
+// operator and the transfer curve are applied to whole rows at a time, spread
+// over all threads, in flat branch-free loops the compiler can vectorize.
+
+enum class ToneOperator
+{
+    Gamma,    // the renderer's original look: clamp, square-root gamma, truncate
+    Linear,   // clamp, then sRGB
+    Reinhard, // x / (1 + x), then sRGB
+    Aces      // Narkowicz's fit of the ACES filmic curve, then sRGB
+};
+
+inline bool parse_tone_operator(const std::string &name, ToneOperator &op)
+{
+    if (name == "gamma")
+        op = ToneOperator::Gamma;
+    else if (name == "linear")
+        op = ToneOperator::Linear;
+    else if (name == "reinhard")
+        op = ToneOperator::Reinhard;
+    else if (name == "aces")
+        op = ToneOperator::Aces;
+    else
+        return false;
+    return true;
+}
+
+struct ToneSettings
+{
+    ToneOperator op = ToneOperator::Gamma;
+    float exposure = 1.0f; // multiplier (2^EV) applied before the operator
+    bool dither = false;   // 8x8 ordered dither instead of rounding (not for Gamma, which truncates)
+};
+
+class ToneMapper
+{
+public:
+    static const int LUT_SIZE = 4096;
+
+    explicit ToneMapper(ToneSettings tone = ToneSettings()) : settings(tone)
+    {
+        // Encoded sRGB value at LUT_SIZE + 1 evenly spaced linear values, for
+        // interpolation; the curve's linear toe spans a dozen entries.
+        srgb.resize(LUT_SIZE + 1);
+        for (int i = 0; i <= LUT_SIZE; ++i)
+        {
+            double v = double(i) / LUT_SIZE;
+            srgb[i] = static_cast<float>(v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1 / 2.4) - 0.055);
+        }
+    }
+
+    const ToneSettings &tone() const { return settings; }
+
+    // Encodes count pixels of row y, starting at column x0, into rgb.
+    void encode_row(const Color *sums, size_t count, int samples_per_pixel, int x0, int y, unsigned char *rgb) const
+    {
+        const float *in = &sums[0].x;
+        size_t values = 3 * count;
+        if (settings.op == ToneOperator::Gamma)
+        {
+            // Exactly the original arithmetic (in double), so existing images
+            // are unchanged; only NaN, which the clamp would pass, becomes 0.
+            double scale = 1.0 / samples_per_pixel;
+            for (size_t i = 0; i < values; ++i)
+            {
+                double g = std::sqrt(scale * (in[i] * settings.exposure));
+                rgb[i] = static_cast<unsigned char>(255 * (g > 0 ? std::min(g, 1.0) : 0.0));
+            }
+            return;
+        }
+
+        float scale = settings.exposure / samples_per_pixel;
+        switch (settings.op)
+        {
+        case ToneOperator::Reinhard:
+            encode_values(in, values, scale, x0, y, rgb, [](float v)
+                          { return v / (1 + v); });
+            break;
+        case ToneOperator::Aces:
+            encode_values(in, values, scale, x0, y, rgb, [](float v)
+                          { return v * (2.51f * v + 0.03f) / (v * (2.43f * v + 0.59f) + 0.14f); });
+            break;
+        default:
+            encode_values(in, values, scale, x0, y, rgb, [](float v)
+                          { return v; });
+        }
+    }
+
+    // The whole framebuffer, a row per task.
+    std::vector<unsigned char> encode_image(const std::vector<Color> &framebuffer, int width, int height, int samples_per_pixel) const
+    {
+        std::vector<unsigned char> rgb(framebuffer.size() * 3);
+        parallel_for(static_cast<size_t>(height), [&](size_t y)
+                     { encode_row(&framebuffer[y * width], width, samples_per_pixel, 0, int(y), &rgb[3 * y * width]); });
+        return rgb;
+    }
+
+private:
+    ToneSettings settings;
+    std::vector<float> srgb;
+
+    // curve(value * scale), then sRGB by table and rounding (or dithering) to
+    // 8 bits, one value at a time: no buffer per row. NaN and negative values
+    // fail the comparisons and come out black, infinite ones white, so the
+    // table index always stays in range.
+    template <typename Curve>
+    void encode_values(const float *in, size_t values, float scale, int x0, int y, unsigned char *rgb, Curve curve) const
+    {
+        for (size_t i = 0; i < values; ++i)
+        {
+            float v = in[i] * scale;
+            float mapped = curve(v > 0 ? v : 0.0f);
+            mapped = mapped < 1 ? mapped : 1.0f;
+            float f = mapped * LUT_SIZE;
+            int k = std::min(static_cast<int>(f), LUT_SIZE - 1);
+            float encoded = srgb[k] + (f - k) * (srgb[k + 1] - srgb[k]);
+            float offset = settings.dither ? bayer(x0 + int(i / 3), y) : 0.5f;
+            rgb[i] = static_cast<unsigned char>(std::min(encoded * 255 + offset, 255.0f));
+        }
+    }
+
+    // Threshold in (0, 1) from the 8x8 Bayer matrix.
+    static float bayer(int x, int y)
+    {
+        static const unsigned char matrix[8][8] = {
+            {0, 32, 8, 40, 2, 34, 10, 42},
+            {48, 16, 56, 24, 50, 18, 58, 26},
+            {12, 44, 4, 36, 14, 46, 6, 38},
+            {60, 28, 52, 20, 62, 30, 54, 22},
+            {3, 35, 11, 43, 1, 33, 9, 41},
+            {51, 19, 59, 27, 49, 17, 57, 25},
+            {15, 47, 7, 39, 13, 45, 5, 37},
+            {63, 31, 55, 23, 61, 29, 53, 21}};
+        return (matrix[y & 7][x & 7] + 0.5f) / 64;
+    }
+};
+
+// 8-bit pixels as the body of a P3 PPM, one "r g b" line per pixel, with the
+// rows formatted in parallel from a table of the 256 numbers.
+inline std::string format_p3_body(const std::vector<unsigned char> &rgb, int width, int height)
+{
+    static const std::vector<std::string> numbers = []
+    {
+        std::vector<std::string> n(256);
+        for (int i = 0; i < 256; ++i)
+            n[i] = std::to_string(i);
+        return n;
+    }();
+    std::vector<std::string> rows(height);
+    parallel_for(static_cast<size_t>(height), [&](size_t y)
+                 {
+        std::string &row = rows[y];
+        row.reserve(size_t(width) * 12);
+        const unsigned char *p = &rgb[3 * y * width];
+        for (int x = 0; x < width; ++x, p += 3)
+        {
+            row += numbers[p[0]];
+            row += ' ';
+            row += numbers[p[1]];
+            row += ' ';
+            row += numbers[p[2]];
+            row += '\n';
+        } });
+    std::string body;
+    size_t total = 0;
+    for (const std::string &row : rows)
+        total += row.size();
+    body.reserve(total);
+    for (const std::string &row : rows)
+        body += row;
+    return body;
+}
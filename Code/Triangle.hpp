@@ -8,14 +8,16 @@ class Triangle : public Hittable
 {
 public:
     Vector3 v1, v2, v3; // Vertices of the triangle
+    Vector2 t1, t2, t3; // Texture coordinates at each vertex
     std::shared_ptr<Material> material_ptr;
 
     Triangle() {}
     
     //deafult contructor
 
-    Triangle(const Vector3 &p1, const Vector3 &p2, const Vector3 &p3, std::shared_ptr<Material> m)
-        : v1(p1), v2(p2), v3(p3), material_ptr(m) {}
+    Triangle(const Vector3 &p1, const Vector3 &p2, const Vector3 &p3, std::shared_ptr<Material> m,
+             const Vector2 &uv1 = Vector2(0, 0), const Vector2 &uv2 = Vector2(1, 0), const Vector2 &uv3 = Vector2(0, 1))
+        : v1(p1), v2(p2), v3(p3), t1(uv1), t2(uv2), t3(uv3), material_ptr(m) {}
 
     bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
     {
@@ -58,12 +60,25 @@ public:
         rec.set_face_normal(r, outward_normal);
         rec.material_ptr = material_ptr;
 
+        // u and v are already the barycentric weights of v2 and v3.
+        rec.uv = t1 * (1 - u - v) + t2 * u + t3 * v;
+        double world_area = edge1.cross(edge2).length();
+        double uv_area = std::fabs((t2 - t1).x * (t3 - t1).y - (t2 - t1).y * (t3 - t1).x);
+        rec.uv_per_unit = world_area > 0 ? std::sqrt(uv_area / world_area) : 0;
+
         return true;
     }
     bool bounding_box(double t0, double t1, box_ab &output_box) const override;
+
+    void translate(const Vector3 &offset) override
+    {
+        v1 += offset;
+        v2 += offset;
+        v3 += offset;
+    }
 };
 
-bool Triangle::bounding_box(double t0, double t1, box_ab &output_box) const
+inline bool Triangle::bounding_box(double t0, double t1, box_ab &output_box) const
 {
     // Compute the center and radius for the bounding sphere
     Vector3 center = (v1 + v2 + v3) / 3;
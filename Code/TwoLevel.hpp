@@ -0,0 +1,312 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "Hittable.hpp"
+#include "classbox_ab.hpp"
+
+// Two-level acceleration for scenes where only a few shapes move. Static
+// shapes go in one bottom-level structure (BLAS) built once, the shapes marked
+// "dynamic" in a small BVH of their own, and a top level (TLAS) holds the two.
+// After moving dynamic shapes, update() refits the dynamic BVH (or rebuilds
+// it once refitting has made it too loose) and refreshes the top level, so an
+// update costs time in the number of dynamic shapes only.
+
+inline double box_area(const box_ab &box)
+{
+    Vector3 d = box.max() - box.min();
+    return 2.0 * (double(d.x) * d.y + double(d.y) * d.z + double(d.z) * d.x);
+}
+
+// Like box_ab::hit, but also gives where the ray enters the box.
+inline bool box_entry(const box_ab &box, const Ray &r, double t_min, double t_max, double &t_enter)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        double inv = 1.0 / (&r.direction.x)[a];
+        double t0 = ((&box._min.x)[a] - (&r.origin.x)[a]) * inv;
+        double t1 = ((&box._max.x)[a] - (&r.origin.x)[a]) * inv;
+        t_min = std::fmax(std::fmin(t0, t1), t_min);
+        t_max = std::fmin(std::fmax(t0, t1), t_max);
+        if (t_max <= t_min)
+            return false;
+    }
+    t_enter = t_min;
+    return true;
+}
+
+// BVH over a small, changing set of shapes. Nodes live in one array with a
+// node's children stored after it, so a refit is one backwards pass.
+class DynamicBLAS : public Hittable
+{
+public:
+    static const uint32_t LEAF_SIZE = 2;
+    // Rebuild once refitting has grown the summed node area by this factor.
+    static constexpr double REBUILD_RATIO = 2.0;
+
+    explicit DynamicBLAS(std::vector<shared_ptr<Hittable>> dynamic_shapes) : shapes(std::move(dynamic_shapes))
+    {
+        rebuild();
+    }
+
+    // Call after moving shapes. Returns true if the tree had to be rebuilt.
+    bool update()
+    {
+        refit();
+        if (tree_area() > REBUILD_RATIO * built_area)
+        {
+            rebuild();
+            return true;
+        }
+        return false;
+    }
+
+    void rebuild()
+    {
+        order.resize(shapes.size());
+        std::iota(order.begin(), order.end(), 0u);
+        boxes.resize(shapes.size());
+        for (size_t i = 0; i < shapes.size(); ++i)
+            shapes[i]->bounding_box(0, 0, boxes[i]);
+        nodes.assign(1, Node());
+        build(0, 0, static_cast<uint32_t>(shapes.size()));
+        built_area = tree_area();
+    }
+
+    // Same topology, new boxes: leaves from their shapes, then every inner
+    // node from its children, which come after it in the array.
+    void refit()
+    {
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            Node &node = nodes[i];
+            if (node.count > 0)
+                node.box = leaf_box(node);
+            else
+                node.box = surrounding_box(nodes[node.first].box, nodes[node.first + 1].box);
+        }
+    }
+
+    size_t size() const { return shapes.size(); }
+    size_t node_count() const { return nodes.size(); }
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
+    {
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        bool hit_anything = false;
+        while (top > 0)
+        {
+            const Node &node = nodes[stack[--top]];
+            if (!node.box.hit(r, t_min, t_max))
+                continue;
+            if (node.count == 0)
+            {
+                stack[top++] = node.first + 1;
+                stack[top++] = node.first;
+                continue;
+            }
+            for (uint32_t i = node.first; i < node.first + node.count; ++i)
+                if (shapes[order[i]]->hit(r, t_min, t_max, rec))
+                {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+        }
+        return hit_anything;
+    }
+
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override
+    {
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node &node = nodes[stack[--top]];
+            if (!node.box.hit(r, t_min, t_max))
+                continue;
+            if (node.count == 0)
+            {
+                stack[top++] = node.first + 1;
+                stack[top++] = node.first;
+                continue;
+            }
+            for (uint32_t i = node.first; i < node.first + node.count; ++i)
+                if (const Hittable *occluder = shapes[order[i]]->any_hit(r, t_min, t_max))
+                    return occluder;
+        }
+        return nullptr;
+    }
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        output_box = nodes[0].box;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        box_ab box;
+        uint32_t first = 0; // inner: left child (the right one follows); leaf: first entry of order
+        uint32_t count = 0; // shapes in a leaf, 0 for an inner node
+    };
+
+    std::vector<shared_ptr<Hittable>> shapes;
+    std::vector<uint32_t> order;
+    std::vector<box_ab> boxes; // shape boxes, only used while building
+    std::vector<Node> nodes;
+    double built_area = 0;
+
+    box_ab leaf_box(const Node &node) const
+    {
+        box_ab box, shape_box;
+        shapes[order[node.first]]->bounding_box(0, 0, box);
+        for (uint32_t i = node.first + 1; i < node.first + node.count; ++i)
+        {
+            shapes[order[i]]->bounding_box(0, 0, shape_box);
+            box = surrounding_box(box, shape_box);
+        }
+        return box;
+    }
+
+    double tree_area() const
+    {
+        double area = 0;
+        for (const Node &node : nodes)
+            area += box_area(node.box);
+        return area;
+    }
+
+    // Median split of the box centres along their widest axis.
+    void build(uint32_t index, uint32_t begin, uint32_t end)
+    {
+        box_ab bounds = boxes[order[begin]];
+        Vector3 low = (bounds.min() + bounds.max()) * 0.5f, high = low;
+        for (uint32_t i = begin + 1; i < end; ++i)
+        {
+            bounds = surrounding_box(bounds, boxes[order[i]]);
+            Vector3 c = (boxes[order[i]].min() + boxes[order[i]].max()) * 0.5f;
+            low = Vector3(std::fmin(low.x, c.x), std::fmin(low.y, c.y), std::fmin(low.z, c.z));
+            high = Vector3(std::fmax(high.x, c.x), std::fmax(high.y, c.y), std::fmax(high.z, c.z));
+        }
+
+        if (end - begin <= LEAF_SIZE)
+        {
+            nodes[index].box = bounds;
+            nodes[index].first = begin;
+            nodes[index].count = end - begin;
+            return;
+        }
+
+        Vector3 extent = high - low;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](uint32_t a, uint32_t b)
+                         {
+                             return (&boxes[a]._min.x)[axis] + (&boxes[a]._max.x)[axis] <
+                                    (&boxes[b]._min.x)[axis] + (&boxes[b]._max.x)[axis];
+                         });
+
+        uint32_t child = static_cast<uint32_t>(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        build(child, begin, mid);
+        build(child + 1, mid, end);
+        nodes[index].box = bounds;
+        nodes[index].first = child;
+        nodes[index].count = 0;
+    }
+};
+
+// The top level: the static BLAS and the dynamic one, visited nearest first.
+// With two instances a linear pass over their boxes is the whole TLAS.
+class TwoLevelScene : public Hittable
+{
+public:
+    // static_blas may be null when every shape is dynamic; it must outlive this.
+    TwoLevelScene(const Hittable *static_blas, std::vector<shared_ptr<Hittable>> dynamic_shapes)
+        : dynamic(std::move(dynamic_shapes))
+    {
+        if (static_blas)
+            instances.push_back(Instance{static_blas, box_ab()});
+        instances.push_back(Instance{&dynamic, box_ab()});
+        refresh();
+    }
+    TwoLevelScene(const TwoLevelScene &) = delete;
+    TwoLevelScene &operator=(const TwoLevelScene &) = delete;
+
+    // Call after moving dynamic shapes. Returns true if the dynamic BLAS was rebuilt.
+    bool update()
+    {
+        bool rebuilt = dynamic.update();
+        refresh();
+        return rebuilt;
+    }
+
+    const DynamicBLAS &dynamic_blas() const { return dynamic; }
+
+    bool hit(const Ray &r, double t_min, double t_max, Hit_record &rec) const override
+    {
+        double entry[2];
+        int visit[2], count = 0;
+        for (int i = 0; i < static_cast<int>(instances.size()); ++i)
+            if (box_entry(instances[i].box, r, t_min, t_max, entry[i]))
+                visit[count++] = i;
+        if (count == 2 && entry[visit[1]] < entry[visit[0]])
+            std::swap(visit[0], visit[1]);
+
+        bool hit_anything = false;
+        for (int k = 0; k < count; ++k)
+        {
+            // A hit in the nearer instance can rule out the farther one.
+            if (hit_anything && entry[visit[k]] > t_max)
+                break;
+            if (instances[visit[k]].blas->hit(r, t_min, t_max, rec))
+            {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    const Hittable *any_hit(const Ray &r, double t_min, double t_max) const override
+    {
+        for (const Instance &instance : instances)
+            if (instance.box.hit(r, t_min, t_max))
+                if (const Hittable *occluder = instance.blas->any_hit(r, t_min, t_max))
+                    return occluder;
+        return nullptr;
+    }
+
+    bool bounding_box(double t0, double t1, box_ab &output_box) const override
+    {
+        output_box = bounds;
+        return true;
+    }
+
+private:
+    struct Instance
+    {
+        const Hittable *blas;
+        box_ab box;
+    };
+
+    DynamicBLAS dynamic;
+    std::vector<Instance> instances;
+    box_ab bounds;
+
+    void refresh()
+    {
+        for (Instance &instance : instances)
+            instance.blas->bounding_box(0, 0, instance.box);
+        bounds = instances[0].box;
+        for (size_t i = 1; i < instances.size(); ++i)
+            bounds = surrounding_box(bounds, instances[i].box);
+    }
+};
@@ -1,3 +1,6 @@
+#pragma once
+#include <cmath>
+
 class Vector2 {
 public:
     float x, y;
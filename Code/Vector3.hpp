@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include "json/include/nlohmann/json.hpp"
@@ -130,37 +131,64 @@ inline Vector3 unit(const Vector3 &v)
     return v / v.length();
 }
 
-Vector3 random_in_unit_sphere()
+// Rejection-free warps from the unit square (or cube). Each maps uniform
+// input to a uniform point in a fixed number of steps, so it keeps whatever
+// stratification a low-discrepancy sampler put into its input.
+
+// Shirley-Chiu concentric map: square to disk with low distortion.
+inline Vector3 sample_unit_disk(double u1, double u2)
 {
-    while (true)
+    double a = 2 * u1 - 1, b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return Vector3(0, 0, 0);
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b))
+    {
+        r = a;
+        phi = (pi / 4) * (b / a);
+    }
+    else
     {
-        auto p = Vector3::random(-1, 1);
-        if (p.length_squared() >= 1)
-            continue;
-        return p;
+        r = b;
+        phi = pi / 2 - (pi / 4) * (a / b);
     }
+    return Vector3(r * std::cos(phi), r * std::sin(phi), 0);
 }
 
-Vector3 random_in_unit_disk()
+// Uniform direction (point on the unit sphere).
+inline Vector3 sample_unit_vector(double u1, double u2)
 {
-    while (true)
-    {
-        auto p = Vector3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1)
-            continue;
-        return p;
-    }
+    double z = 1 - 2 * u1;
+    double r = std::sqrt(std::max(0.0, 1 - z * z));
+    double phi = 2 * pi * u2;
+    return Vector3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Uniform point inside the unit ball: a direction scaled by the cube root of the third input.
+inline Vector3 sample_unit_sphere(double u1, double u2, double u3)
+{
+    return sample_unit_vector(u1, u2) * static_cast<float>(std::cbrt(u3));
+}
+
+inline Vector3 random_in_unit_sphere()
+{
+    double u1 = random_double(), u2 = random_double(), u3 = random_double();
+    return sample_unit_sphere(u1, u2, u3);
+}
+
+inline Vector3 random_in_unit_disk()
+{
+    double u1 = random_double(), u2 = random_double();
+    return sample_unit_disk(u1, u2);
 }
 
-Vector3 random_unit_vector()
+inline Vector3 random_unit_vector()
 {
-    auto a = random_double(0, 2 * pi);
-    auto z = random_double(-1, 1);
-    auto r = sqrt(1 - z * z);
-    return Vector3(r * cos(a), r * sin(a), z);
+    double u1 = random_double(), u2 = random_double();
+    return sample_unit_vector(u1, u2);
 }
 
-Vector3 random_in_hemisphere(const Vector3 &normal)
+inline Vector3 random_in_hemisphere(const Vector3 &normal)
 {
     Vector3 in_unit_sphere = random_in_unit_sphere();
     if (in_unit_sphere.dot(normal) > 0.0)
@@ -174,7 +202,7 @@ Vector3 random_in_hemisphere(const Vector3 &normal)
     }
 }
 
-Vector3 reflect(const Vector3 &v, const Vector3 &n)
+inline Vector3 reflect(const Vector3 &v, const Vector3 &n)
 {
     return v - n * 2 * v.dot(n);
 }
@@ -184,7 +212,7 @@ inline Vector3 operator*(double t, const Vector3 &v)
     return Vector3(t * v.x, t * v.y, t * v.z);
 }
 
-Vector3 refract(const Vector3 &uv, const Vector3 &n, double etai_over_etat)
+inline Vector3 refract(const Vector3 &uv, const Vector3 &n, double etai_over_etat)
 {
     auto cos_theta = (-uv).dot(n);
     Vector3 r_out_paralell = etai_over_etat * (uv + cos_theta * n);
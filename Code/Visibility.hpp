@@ -0,0 +1,359 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "Camera.hpp"
+#include "CompiledScene.hpp"
+#include "Parallel.hpp"
+
+// Rasterized primary visibility. The compiled primitives are projected and
+// rasterized conservatively, tile by tile, into a per-pixel buffer that keeps
+// the primitive with the nearest possible depth and the second-nearest depth
+// of any other. A camera ray then only needs its candidate's exact hit test:
+// if that lands in front of everything else the pixel could show, it is the
+// closest hit. Otherwise (silhouettes, interpenetration) the ray is traced as
+// usual, so the hits are always the ones a full traversal finds.
+//
+// Primitives are clipped at the near plane, then triangles are rasterized
+// with edge functions and a 1/z plane, and spheres and cylinders as the
+// screen rectangle of their box. Coverage is widened by the lens offset, so
+// with depth of field too a pixel without a candidate is background for
+// every sample.
+
+struct VisibilityCounts
+{
+    uint64_t resolved = 0;   // closest hit taken from the candidate
+    uint64_t background = 0; // nothing rasterized there
+    uint64_t traced = 0;     // had to traverse after all
+};
+
+struct VisibilityBuildStats
+{
+    size_t primitives = 0, full_screen = 0, bin_entries = 0, covered_pixels = 0;
+};
+
+class VisibilityBuffer
+{
+public:
+    static const int TILE = 16;
+    // Hits closer than this are ignored by every camera ray (render_image's t_min).
+    static constexpr double NEAR = 0.001;
+
+    // scene and world must outlive the buffer; world must be scene itself or
+    // a structure over its primitives (grid, kd-tree).
+    VisibilityBuffer(const CompiledScene &scene, const Hittable &world, const Camera &camera, int width, int height)
+        : scene(scene), world(world), width(width), height(height)
+    {
+        eye = camera.origin;
+        forward = -camera.w;
+        right = camera.u;
+        up = camera.v;
+        x_scale = (width - 1) / camera.horizontal.length();
+        y_scale = (height - 1) / camera.vertical.length();
+        lens_radius = camera.camera_radius;
+
+        std::vector<uint32_t> primitives = scene.primitives();
+        build_stats.primitives = primitives.size();
+        std::vector<ScreenPrimitive> screen(primitives.size());
+        std::vector<char> visible(primitives.size(), 0);
+        parallel_for(primitives.size(), [&](size_t i)
+                     { visible[i] = setup(primitives[i], screen[i]); });
+
+        // Binning: every chunk of primitives lists, per tile, the ones whose
+        // rectangle reaches it; full-screen ones are kept apart.
+        int tiles_x = (width + TILE - 1) / TILE, tiles_y = (height + TILE - 1) / TILE;
+        size_t chunks = worker_count();
+        std::vector<std::vector<std::vector<uint32_t>>> bins(chunks, std::vector<std::vector<uint32_t>>(size_t(tiles_x) * tiles_y));
+        std::vector<uint32_t> everywhere;
+        for (size_t i = 0; i < screen.size(); ++i)
+            if (visible[i] && screen[i].full_screen)
+                everywhere.push_back(static_cast<uint32_t>(i));
+        parallel_chunks(screen.size(), chunks, [&](size_t c, size_t begin, size_t end)
+                        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const ScreenPrimitive &s = screen[i];
+                if (!visible[i] || s.full_screen)
+                    continue;
+                for (int ty = s.y0 / TILE; ty <= s.y1 / TILE; ++ty)
+                    for (int tx = s.x0 / TILE; tx <= s.x1 / TILE; ++tx)
+                        bins[c][size_t(ty) * tiles_x + tx].push_back(static_cast<uint32_t>(i));
+            } });
+
+        ids.assign(size_t(width) * height, 0);
+        nearest.assign(ids.size(), INFINITY);
+        second.assign(ids.size(), INFINITY);
+        parallel_for(size_t(tiles_x) * tiles_y, [&](size_t tile)
+                     {
+            int tx = int(tile % tiles_x) * TILE, ty = int(tile / tiles_x) * TILE;
+            int tx1 = std::min(tx + TILE, width) - 1, ty1 = std::min(ty + TILE, height) - 1;
+            for (uint32_t i : everywhere)
+                rasterize(screen[i], tx, ty, tx1, ty1);
+            for (size_t c = 0; c < chunks; ++c)
+                for (uint32_t i : bins[c][tile])
+                    rasterize(screen[i], tx, ty, tx1, ty1); });
+
+        build_stats.full_screen = everywhere.size();
+        for (const auto &chunk : bins)
+            for (const auto &bin : chunk)
+                build_stats.bin_entries += bin.size();
+        build_stats.covered_pixels = ids.size() - std::count(ids.begin(), ids.end(), 0u);
+    }
+
+    // Same result as world.hit(r, NEAR, inf, rec) for a camera ray through pixel.
+    bool closest_hit(size_t pixel, const Ray &r, Hit_record &rec, VisibilityCounts &counts) const
+    {
+        uint32_t candidate = ids[pixel];
+        if (!candidate)
+        {
+            ++counts.background;
+            return false;
+        }
+        // Camera ray directions have unit depth, so t is the hit's depth.
+        if (scene.arrays().hit_primitive(candidate, r, NEAR, inf, rec) && rec.t < second[pixel] * (1 - 1e-4))
+        {
+            ++counts.resolved;
+            return true;
+        }
+        ++counts.traced;
+        return world.hit(r, NEAR, inf, rec);
+    }
+
+    void add(const VisibilityCounts &counts) const
+    {
+        resolved += counts.resolved;
+        background += counts.background;
+        traced += counts.traced;
+    }
+
+    VisibilityCounts counts() const
+    {
+        VisibilityCounts total;
+        total.resolved = resolved;
+        total.background = background;
+        total.traced = traced;
+        return total;
+    }
+
+    const VisibilityBuildStats &stats() const { return build_stats; }
+
+private:
+    struct ScreenPrimitive
+    {
+        uint32_t child = 0;
+        bool full_screen = false; // a shape without a compiled pool: no usable bounds
+        int edges = 0;            // triangle with a proper screen area: edges of its clipped polygon
+        int x0 = 0, y0 = 0, x1 = 0, y1 = 0; // covered pixels, inclusive
+        float margin = 0;                   // lens offset, in pixels
+        float z_min = 0;
+        double a[4], b[4], c[4];            // edge functions, >= 0 inside
+        double inv_z[3];                    // 1/z = inv_z[0] x + inv_z[1] y + inv_z[2]
+    };
+
+    const CompiledScene &scene;
+    const Hittable &world;
+    int width, height;
+    Vector3 eye, forward, right, up; // camera position and axes
+    double x_scale, y_scale, lens_radius;
+
+    std::vector<uint32_t> ids; // child reference of the candidate, 0 for none
+    std::vector<float> nearest, second;
+    VisibilityBuildStats build_stats;
+    mutable std::atomic<uint64_t> resolved{0}, background{0}, traced{0};
+
+    // Camera-space coordinates (right, up, depth) of p.
+    void to_camera(const Vector3 &p, double out[3]) const
+    {
+        double d[3] = {double(p.x) - eye.x, double(p.y) - eye.y, double(p.z) - eye.z};
+        const Vector3 *axes[3] = {&right, &up, &forward};
+        for (int a = 0; a < 3; ++a)
+            out[a] = d[0] * axes[a]->x + d[1] * axes[a]->y + d[2] * axes[a]->z;
+    }
+
+    // False if the primitive cannot show in the image.
+    bool setup(uint32_t child, ScreenPrimitive &s) const
+    {
+        s.child = child;
+        uint32_t index = child & ((1u << 29) - 1);
+        uint32_t tag = (child >> 29) & 3;
+        bool triangle = tag == CHILD_TRIANGLE;
+        double points[8][3];
+        int count = 0;
+        if (triangle)
+        {
+            const CompiledTriangle &t = scene.arrays().triangles[index];
+            to_camera(t.v0, points[count++]);
+            to_camera(t.v0 + t.edge1, points[count++]);
+            to_camera(t.v0 + t.edge2, points[count++]);
+        }
+        else
+        {
+            Vector3 lo, hi;
+            scene.leaf_bounds(child, lo, hi);
+            for (int k = 0; k < 8; ++k)
+                to_camera(Vector3(k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z), points[count++]);
+        }
+        double z_min = INFINITY, z_max = -INFINITY;
+        for (int k = 0; k < count; ++k)
+        {
+            z_min = std::min(z_min, points[k][2]);
+            z_max = std::max(z_max, points[k][2]);
+        }
+        if (tag == CHILD_SPHERE)
+        {
+            const CompiledSphere &sphere = scene.arrays().spheres[index];
+            double center[3];
+            to_camera(sphere.center, center);
+            z_min = std::max(z_min, center[2] - 1.0 / sphere.inv_radius);
+        }
+        if (z_max < NEAR)
+            return false;
+        s.z_min = static_cast<float>(std::max(z_min, NEAR));
+        if (tag == CHILD_OTHER)
+        {
+            s.full_screen = true;
+            return true;
+        }
+
+        // Clipped to depth >= NEAR, the part camera rays can hit: a triangle
+        // stays a convex polygon, in order; a box becomes its front corners
+        // and the points where its edges cross the plane.
+        double clipped[20][3];
+        int n = 0;
+        auto keep_crossing = [&](const double *p, const double *q)
+        {
+            if ((p[2] >= NEAR) == (q[2] >= NEAR))
+                return;
+            double f = (NEAR - p[2]) / (q[2] - p[2]);
+            for (int a = 0; a < 3; ++a)
+                clipped[n][a] = p[a] + (q[a] - p[a]) * f;
+            clipped[n++][2] = NEAR;
+        };
+        if (triangle)
+            for (int k = 0; k < 3; ++k)
+            {
+                if (points[k][2] >= NEAR)
+                    std::copy(points[k], points[k] + 3, clipped[n++]);
+                keep_crossing(points[k], points[(k + 1) % 3]);
+            }
+        else
+        {
+            for (int k = 0; k < 8; ++k)
+                if (points[k][2] >= NEAR)
+                    std::copy(points[k], points[k] + 3, clipped[n++]);
+            for (int k = 0; k < 8; ++k)
+                for (int bit = 1; bit < 8; bit <<= 1)
+                    if (!(k & bit))
+                        keep_crossing(points[k], points[k | bit]);
+        }
+
+        // A ray from lens offset o through screen point q meets depth z where
+        // the pinhole sees q + o (1/z - 1).
+        double near_z = std::max(z_min, NEAR);
+        double lens_shift = lens_radius * std::max(std::abs(1 / near_z - 1), std::abs(1 / z_max - 1));
+        s.margin = static_cast<float>(lens_shift * std::max(x_scale, y_scale) + 1e-3);
+
+        // Screen position in render_image's pixel units: pixel x holds samples x <= sx < x + 1.
+        double sx[20], sy[20], sz[20];
+        double lo_x = INFINITY, lo_y = INFINITY, hi_x = -INFINITY, hi_y = -INFINITY;
+        for (int k = 0; k < n; ++k)
+        {
+            sz[k] = clipped[k][2];
+            sx[k] = 0.5 * (width - 1) + clipped[k][0] / sz[k] * x_scale;
+            sy[k] = 0.5 * (height - 1) + clipped[k][1] / sz[k] * y_scale;
+            lo_x = std::min(lo_x, sx[k]);
+            hi_x = std::max(hi_x, sx[k]);
+            lo_y = std::min(lo_y, sy[k]);
+            hi_y = std::max(hi_y, sy[k]);
+        }
+        lo_x = std::floor(lo_x - s.margin);
+        lo_y = std::floor(lo_y - s.margin);
+        hi_x = std::floor(hi_x + s.margin);
+        hi_y = std::floor(hi_y + s.margin);
+        if (hi_x < 0 || hi_y < 0 || lo_x > width - 1 || lo_y > height - 1)
+            return false;
+        s.x0 = int(std::max(lo_x, 0.0));
+        s.y0 = int(std::max(lo_y, 0.0));
+        s.x1 = int(std::min(hi_x, double(width - 1)));
+        s.y1 = int(std::min(hi_y, double(height - 1)));
+
+        if (triangle)
+        {
+            double area = 0;
+            for (int k = 0; k < n; ++k)
+                area += sx[k] * sy[(k + 1) % n] - sx[(k + 1) % n] * sy[k];
+            double extent = std::max(hi_x - lo_x, hi_y - lo_y) + 1;
+            // Seen edge on, a triangle is a sliver inside its rectangle.
+            if (std::abs(area) > 1e-9 * extent * extent)
+            {
+                s.edges = n;
+                double sign = area > 0 ? 1 : -1;
+                for (int e = 0; e < n; ++e)
+                {
+                    int f = (e + 1) % n;
+                    s.a[e] = sign * (sy[e] - sy[f]);
+                    s.b[e] = sign * (sx[f] - sx[e]);
+                    s.c[e] = sign * (sx[e] * sy[f] - sy[e] * sx[f]);
+                }
+                // 1/z is affine on screen over a plane; fit it to the widest
+                // triangle of polygon vertices.
+                int best = 1;
+                double det = 0;
+                for (int k = 1; k + 1 < n; ++k)
+                {
+                    double d = (sx[k] - sx[0]) * (sy[k + 1] - sy[0]) - (sx[k + 1] - sx[0]) * (sy[k] - sy[0]);
+                    if (std::abs(d) > std::abs(det))
+                    {
+                        det = d;
+                        best = k;
+                    }
+                }
+                int i1 = best, i2 = best + 1;
+                double w0 = 1 / sz[0], w1 = 1 / sz[i1], w2 = 1 / sz[i2];
+                s.inv_z[0] = ((w1 - w0) * (sy[i2] - sy[0]) - (w2 - w0) * (sy[i1] - sy[0])) / det;
+                s.inv_z[1] = ((w2 - w0) * (sx[i1] - sx[0]) - (w1 - w0) * (sx[i2] - sx[0])) / det;
+                s.inv_z[2] = w0 - s.inv_z[0] * sx[0] - s.inv_z[1] * sy[0];
+            }
+        }
+        return true;
+    }
+
+    // Adds s to the pixels of [tx0, tx1] x [ty0, ty1] it may cover.
+    void rasterize(const ScreenPrimitive &s, int tx0, int ty0, int tx1, int ty1)
+    {
+        int x0 = s.full_screen ? tx0 : std::max(s.x0, tx0), x1 = s.full_screen ? tx1 : std::min(s.x1, tx1);
+        int y0 = s.full_screen ? ty0 : std::max(s.y0, ty0), y1 = s.full_screen ? ty1 : std::min(s.y1, ty1);
+        double half = 0.5 + s.margin;
+        for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x)
+            {
+                float z = s.z_min;
+                if (s.edges)
+                {
+                    // Conservative: the pixel square, grown by the margin, touches the triangle.
+                    double cx = x + 0.5, cy = y + 0.5;
+                    bool outside = false;
+                    for (int e = 0; e < s.edges && !outside; ++e)
+                        outside = s.a[e] * cx + s.b[e] * cy + s.c[e] + half * (std::abs(s.a[e]) + std::abs(s.b[e])) < 0;
+                    if (outside)
+                        continue;
+                    // Nearest depth over the square: 1/z is largest at one of its corners.
+                    double inv = s.inv_z[0] * (s.inv_z[0] > 0 ? cx + half : cx - half) +
+                                 s.inv_z[1] * (s.inv_z[1] > 0 ? cy + half : cy - half) + s.inv_z[2];
+                    if (inv > 0)
+                        z = std::max(z, static_cast<float>(1 / inv));
+                }
+                size_t pixel = size_t(y) * width + x;
+                if (z < nearest[pixel])
+                {
+                    second[pixel] = nearest[pixel];
+                    nearest[pixel] = z;
+                    ids[pixel] = s.child;
+                }
+                else if (z < second[pixel])
+                    second[pixel] = z;
+            }
+    }
+};
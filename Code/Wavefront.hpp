@@ -0,0 +1,382 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "Camera.hpp"
+#include "EmissiveLights.hpp"
+#include "Light.hpp"
+#include "Material.hpp"
+#include "ShadowCache.hpp"
+#include "Parallel.hpp"
+#include "RaySort.hpp"
+#include "Region.hpp"
+#include "Denoise.hpp"
+
+using Color = Vector3;
+
+// Wavefront path tracer: instead of recursing per pixel, a whole batch of
+// paths moves through one stage at a time (generate, extend, shade, connect),
+// each stage being a flat loop over a contiguous queue. Paths that survive a
+// bounce are compacted into the next queue; Russian roulette decides when a
+// path stops, not a fixed depth. Emissive shapes are sampled directly at
+// every diffuse hit (next-event estimation) as well as found by bounces, and
+// the two estimates are weighed against each other by MIS.
+
+struct WavefrontSettings
+{
+    size_t batch_size = 1 << 18; // camera paths in flight per wave
+    int rr_start_depth = 3;      // bounces before Russian roulette may stop a path
+    int max_path_length = 64;    // hard cap in case roulette keeps winning
+    bool sort_secondary_rays = false; // Morton-sort each bounce's queue before extending it
+    const Sampler *sampler = nullptr;  // camera and bounce sample values; nullptr: random stream
+    const EmissiveLights *emitters = nullptr; // sampled at diffuse hits; nullptr: only bounces find them
+    ChunkExecutor *executor = nullptr;        // runs every stage; nullptr: threads started per stage
+};
+
+struct WavefrontStats
+{
+    uint64_t camera_rays = 0;
+    uint64_t extension_rays = 0; // every ray traced by the extend stage
+    uint64_t shadow_rays = 0;
+    uint64_t emitter_rays = 0; // the shadow rays towards points on emissive shapes
+    uint64_t roulette_kills = 0;
+    double extend_seconds = 0; // time in the extend stage, the part sorting should speed up
+    double sort_seconds = 0;
+
+    void add(const WavefrontStats &o)
+    {
+        camera_rays += o.camera_rays;
+        extension_rays += o.extension_rays;
+        shadow_rays += o.shadow_rays;
+        emitter_rays += o.emitter_rays;
+        roulette_kills += o.roulette_kills;
+        extend_seconds += o.extend_seconds;
+        sort_seconds += o.sort_seconds;
+    }
+};
+
+// A live path: the ray it follows next and the weight it still carries.
+struct PathState
+{
+    Ray ray;
+    Color throughput;
+    uint32_t pixel;
+    int depth;
+    uint64_t rng; // the path's own random stream, restored before each use
+    SampleStream samples; // and its place in the sampler's dimensions
+    float scatter_pdf = 0; // of ray's direction per solid angle; 0 from the camera or a mirror
+};
+
+// Extend-stage result for the path at the same queue index.
+struct PathHit
+{
+    Vector3 p;
+    Vector3 normal;
+    const Material *material; // nullptr when the ray escaped
+    bool front_face;
+    Vector2 uv;
+    double uv_per_unit;
+    float footprint; // ray cone width at the hit
+};
+
+// Point-light or emitter connection waiting for its visibility test.
+struct ShadowRay
+{
+    Ray ray;
+    float t_max;
+    Color contribution;
+    uint32_t pixel;
+    uint32_t light; // point lights first, then the emitters
+};
+
+// Appends the per-chunk outputs in chunk order, so the compacted queue keeps
+// the order of the queue it came from whatever the thread count.
+template <typename T>
+void concat_parts(std::vector<T> &out, std::vector<std::vector<T>> &parts)
+{
+    size_t total = 0;
+    for (const auto &part : parts)
+        total += part.size();
+    out.clear();
+    out.reserve(total);
+    for (auto &part : parts)
+    {
+        out.insert(out.end(), part.begin(), part.end());
+        part.clear();
+    }
+}
+
+// One camera path for each of the region's pixels [first, first + count), in
+// row-major order. Paths are seeded from the image position, not the region;
+// their pixel index is into a framebuffer that starts at image row first_row.
+inline void generate_paths(std::vector<PathState> &queue, const Camera &camera, int width, int height,
+                           const Region &region, size_t first, size_t count, int sample, int first_row = 0,
+                           const Sampler *sampler = nullptr, ChunkExecutor *executor = nullptr)
+{
+    queue.resize(count);
+    parallel_for(count, [&](size_t i)
+                 {
+        int x = region.x0 + static_cast<int>((first + i) % region.width());
+        int y = region.y0 + static_cast<int>((first + i) / region.width());
+        uint32_t pixel = static_cast<uint32_t>(y) * width + x;
+
+        seed_sample(pixel, sample);
+        start_sample(sampler, x, y, sample);
+        Vector2 jitter = sample_2d();
+        float u = (x + jitter.x) / (width - 1);
+        float v = (y + jitter.y) / (height - 1);
+        Ray ray = camera.get_ray(u, v);
+        uint32_t index = pixel - static_cast<uint32_t>(first_row) * width;
+        queue[i] = PathState{ray, Color(1, 1, 1), index, 0, random_state(), sample_stream()}; }, executor);
+}
+
+inline void extend_paths(const std::vector<PathState> &queue, std::vector<PathHit> &hits, const Hittable &world,
+                         ChunkExecutor *executor = nullptr)
+{
+    hits.resize(queue.size());
+    parallel_for(queue.size(), [&](size_t i)
+                 {
+        Hit_record rec;
+        if (world.hit(queue[i].ray, 0.001, inf, rec))
+            hits[i] = PathHit{rec.p, rec.normal, rec.material_ptr.get(), rec.front_face,
+                              rec.uv, rec.uv_per_unit, queue[i].ray.cone_width_at(rec.t)};
+        else
+            hits[i].material = nullptr; }, executor);
+}
+
+// Adds escaped and emitted light, queues a shadow ray per point light for
+// non-specular hits and scatters the survivors into next_queue. When primary
+// is given, camera paths (depth 0) record what they hit at their queue index.
+inline void shade_paths(const std::vector<PathState> &queue, const std::vector<PathHit> &hits,
+                        const std::vector<Light> &lights, const Color &background_color,
+                        std::vector<Color> &framebuffer, std::vector<PathState> &next_queue,
+                        std::vector<ShadowRay> &shadow_queue, const WavefrontSettings &settings,
+                        WavefrontStats &stats, std::vector<AOVSample> *primary = nullptr)
+{
+    size_t chunks = worker_count() * 4;
+    std::vector<std::vector<PathState>> next_parts(chunks);
+    std::vector<std::vector<ShadowRay>> shadow_parts(chunks);
+    std::vector<WavefrontStats> chunk_stats(chunks);
+
+    parallel_chunks(queue.size(), chunks, [&](size_t c, size_t begin, size_t end)
+                    {
+        auto &next = next_parts[c];
+        auto &shadows = shadow_parts[c];
+        for (size_t i = begin; i < end; ++i)
+        {
+            const PathState &path = queue[i];
+            const PathHit &hit = hits[i];
+            // Each pixel has exactly one path in a wave, so this write is private.
+            Color &pixel_color = framebuffer[path.pixel];
+
+            if (!hit.material)
+            {
+                pixel_color += path.throughput * background_color;
+                if (primary && path.depth == 0)
+                    (*primary)[i] = AOVSample{background_color, Vector3(0, 0, 0), 0};
+                continue;
+            }
+
+            const Material &material = *hit.material;
+            Color emitted = material.emit();
+            if (path.scatter_pdf > 0 && settings.emitters && settings.emitters->pdf_area(emitted) > 0)
+            {
+                // The previous hit may have sampled this point directly too.
+                Vector3 d = hit.p - path.ray.origin;
+                float distance_sq = d.length_squared();
+                float cos_light = std::fabs(hit.normal.dot(d)) / std::sqrt(distance_sq);
+                if (cos_light > 0)
+                    emitted = emitted * power_heuristic(path.scatter_pdf, settings.emitters->pdf_area(emitted) * distance_sq / cos_light);
+            }
+            pixel_color += path.throughput * emitted;
+
+            Hit_record rec;
+            rec.p = hit.p;
+            rec.normal = hit.normal;
+            rec.front_face = hit.front_face;
+            rec.uv = hit.uv;
+            rec.uv_per_unit = hit.uv_per_unit;
+            bool specular = material.isreflective || material.isrefractive;
+            Color albedo = specular ? material.diffusecolor : material.albedo(rec, hit.footprint);
+            if (primary && path.depth == 0)
+                (*primary)[i] = AOVSample{albedo, hit.normal, static_cast<float>((hit.p - path.ray.origin).length())};
+
+            // Point lights are connected with the same Blinn-Phong terms as
+            // mode 2, so both modes agree on brightness; mirrors and glass are
+            // delta surfaces and only see lights through their scattered ray.
+            if (!specular)
+            {
+                Vector3 view_dir = -unit(path.ray.direction);
+                for (size_t l = 0; l < lights.size(); ++l)
+                {
+                    Vector3 to_light = lights[l].position - hit.p;
+                    float distance = to_light.length();
+                    Vector3 light_dir = to_light / distance;
+                    float cos_theta = hit.normal.dot(light_dir);
+                    if (cos_theta <= 0)
+                        continue;
+
+                    Vector3 halfway_dir = (view_dir + light_dir).normalized();
+                    float spec = std::pow(std::max(0.0f, hit.normal.dot(halfway_dir)), material.specularexponent);
+                    Color brdf = cos_theta * material.kd * albedo + spec * material.ks * material.specularcolor;
+                    shadows.push_back(ShadowRay{Ray(hit.p, light_dir), distance,
+                                                path.throughput * brdf * lights[l].intensity,
+                                                path.pixel, static_cast<uint32_t>(l)});
+                }
+            }
+
+            random_state() = path.rng;
+            sample_stream() = path.samples;
+            bool sample_emitters = !specular && settings.emitters && !settings.emitters->empty();
+            if (sample_emitters)
+            {
+                // A point on an emissive shape, from the two dimensions of the
+                // bounce that diffuse scattering leaves unused.
+                sample_stream().dimension = 4 + SAMPLE_DIMENSIONS_PER_BOUNCE * path.depth + 2;
+                Vector2 u = sample_2d();
+                EmitterSample emitter = settings.emitters->sample(u.x, u.y);
+                Vector3 to_light = emitter.p - hit.p;
+                float distance = to_light.length();
+                Vector3 light_dir = to_light / distance;
+                float cos_light = std::fabs(emitter.normal.dot(light_dir));
+                float bsdf_pdf = distance > 1e-4f ? material.scatter_pdf(rec, light_dir) : 0;
+                if (bsdf_pdf > 0 && cos_light > 0)
+                {
+                    float light_pdf = emitter.pdf_area * distance * distance / cos_light;
+                    Color brdf_cos = albedo * bsdf_pdf;
+                    shadows.push_back(ShadowRay{Ray(hit.p, light_dir), distance * (1 - 1e-4f),
+                                                path.throughput * brdf_cos * emitter.emission * (power_heuristic(light_pdf, bsdf_pdf) / light_pdf),
+                                                path.pixel, static_cast<uint32_t>(lights.size() + emitter.index)});
+                    ++chunk_stats[c].emitter_rays;
+                }
+            }
+
+            if (path.depth + 1 >= settings.max_path_length)
+                continue;
+
+            // Every bounce starts at its own dimensions, whatever earlier bounces used.
+            sample_stream().dimension = 4 + SAMPLE_DIMENSIONS_PER_BOUNCE * path.depth;
+            Color attenuation;
+            Ray scattered;
+            if (!material.scatter(path.ray, rec, attenuation, scattered))
+                continue;
+            if (!specular)
+                attenuation = albedo;
+            scattered.cone_width = hit.footprint;
+            scattered.cone_spread = path.ray.cone_spread;
+
+            Color throughput = path.throughput * attenuation;
+            if (path.depth + 1 >= settings.rr_start_depth)
+            {
+                float survive = std::max({throughput.x, throughput.y, throughput.z});
+                survive = std::min(std::max(survive, 0.05f), 1.0f);
+                if (random_double() >= survive)
+                {
+                    ++chunk_stats[c].roulette_kills;
+                    continue;
+                }
+                throughput = throughput / survive;
+            }
+            float scatter_pdf = sample_emitters ? material.scatter_pdf(rec, scattered.direction) : 0;
+            next.push_back(PathState{scattered, throughput, path.pixel, path.depth + 1, random_state(), sample_stream(), scatter_pdf});
+        } }, settings.executor);
+
+    concat_parts(next_queue, next_parts);
+    concat_parts(shadow_queue, shadow_parts);
+    for (const auto &s : chunk_stats)
+        stats.add(s);
+}
+
+inline void connect_shadow_rays(const std::vector<ShadowRay> &shadow_queue, std::vector<uint8_t> &visible,
+                                const Hittable &world, std::vector<Color> &framebuffer, ChunkExecutor *executor = nullptr)
+{
+    visible.resize(shadow_queue.size());
+    parallel_for(shadow_queue.size(), [&](size_t i)
+                 {
+        const ShadowRay &s = shadow_queue[i];
+        visible[i] = !ShadowCache::local().occluded(s.ray, 0.001, s.t_max, world, s.light); }, executor);
+
+    // Several lights can land on one pixel, so the scatter-add stays serial.
+    for (size_t i = 0; i < shadow_queue.size(); ++i)
+    {
+        if (visible[i])
+            framebuffer[shadow_queue[i].pixel] += shadow_queue[i].contribution;
+    }
+}
+
+// Adds samples [first_sample, first_sample + samples) of every pixel inside
+// region to framebuffer (summed, like render_image, so write_image can divide
+// by the sample count). Every path keeps its pixel and random stream, so
+// sorting the queues changes the trace order but not the image. With aovs,
+// each sample's first hit and radiance are added to the auxiliary buffers too.
+// framebuffer (and aovs) may hold just the image rows from first_row on.
+inline WavefrontStats render_image_wavefront(std::vector<Color> &framebuffer, const Camera &camera, const Hittable &world,
+                                             const std::vector<Light> &lights, const Color &background_color,
+                                             int width, int height, const Region &region, int first_sample, int samples,
+                                             const WavefrontSettings &settings = WavefrontSettings(),
+                                             AOVBuffers *aovs = nullptr, int first_row = 0)
+{
+    WavefrontStats stats;
+    size_t pixel_count = region.area();
+
+    // A wave never holds two paths for the same pixel.
+    size_t batch = std::min(settings.batch_size, pixel_count);
+
+    std::vector<PathState> queue, next_queue;
+    std::vector<PathHit> hits;
+    std::vector<ShadowRay> shadow_queue;
+    std::vector<uint8_t> visible;
+    RaySortScratch sort_scratch;
+    // A sample's radiance is what its wave added to the pixel.
+    std::vector<AOVSample> primary;
+    std::vector<Color> before_wave;
+
+    box_ab scene_bounds;
+    world.bounding_box(0, 0, scene_bounds);
+
+    for (int sample = first_sample; sample < first_sample + samples; ++sample)
+    {
+        for (size_t first = 0; first < pixel_count; first += batch)
+        {
+            size_t count = std::min(batch, pixel_count - first);
+            generate_paths(queue, camera, width, height, region, first, count, sample, first_row, settings.sampler, settings.executor);
+            stats.camera_rays += count;
+            if (aovs)
+            {
+                primary.resize(count);
+                before_wave.resize(count);
+                parallel_for(count, [&](size_t i)
+                             { before_wave[i] = framebuffer[queue[i].pixel]; }, settings.executor);
+            }
+
+            for (int bounce = 0; !queue.empty(); ++bounce)
+            {
+                // Camera rays are already coherent in pixel order.
+                if (settings.sort_secondary_rays && bounce > 0)
+                {
+                    auto sort_start = std::chrono::high_resolution_clock::now();
+                    sort_rays_morton(queue, scene_bounds, sort_scratch, next_queue, settings.executor);
+                    stats.sort_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - sort_start).count();
+                }
+
+                stats.extension_rays += queue.size();
+                auto extend_start = std::chrono::high_resolution_clock::now();
+                extend_paths(queue, hits, world, settings.executor);
+                stats.extend_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - extend_start).count();
+                shade_paths(queue, hits, lights, background_color, framebuffer, next_queue, shadow_queue, settings, stats,
+                            aovs && bounce == 0 ? &primary : nullptr);
+                stats.shadow_rays += shadow_queue.size();
+                connect_shadow_rays(shadow_queue, visible, world, framebuffer, settings.executor);
+                queue.swap(next_queue);
+            }
+
+            if (aovs)
+            {
+                parallel_for(count, [&](size_t i)
+                             {
+                    size_t pixel = size_t(region.y0 - first_row + (first + i) / region.width()) * width + region.x0 + (first + i) % region.width();
+                    aovs->add(pixel, primary[i], framebuffer[pixel] - before_wave[i]); }, settings.executor);
+            }
+        }
+    }
+    return stats;
+}
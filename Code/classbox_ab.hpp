@@ -1,5 +1,6 @@
 #pragma once
 #include "utility.hpp"
+#include "Ray.hpp"
 
 class box_ab
 {
@@ -72,7 +73,7 @@ public:
     }
 };
 
-box_ab surrounding_box(box_ab box0, box_ab box1)
+inline box_ab surrounding_box(box_ab box0, box_ab box1)
 {
     Vector3 small(fmin(box0.min().x, box1.min().x),
                fmin(box0.min().y, box1.min().y),
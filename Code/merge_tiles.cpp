@@ -0,0 +1,79 @@
+#include <iostream>
+#include <vector>
+#include "utility.hpp"
+#include "Distributed.hpp"
+#include "RenderCore.hpp"
+
+// Assembles partial renders (--region / --shard output) into one image, tone
+// mapped with the settings (--tonemap, --exposure, --dither) they were rendered with:
+//     ./merge_tiles output.ppm part1.cgrp part2.cgrp ...
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cout << "Usage: " << argv[0] << " output.ppm part1.cgrp [part2.cgrp ...]" << std::endl;
+        return 1;
+    }
+
+    int width = 0, height = 0, samples_per_pixel = 0;
+    ToneSettings tone;
+    std::vector<Color> framebuffer;
+    std::vector<unsigned char> covered;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        std::FILE *in = std::fopen(argv[i], "rb");
+        PartialFramebuffer part;
+        bool ok = in && read_partial(in, part);
+        if (in)
+            std::fclose(in);
+        if (!ok)
+        {
+            std::cout << "Skipping " << argv[i] << ": not a partial framebuffer" << std::endl;
+            continue;
+        }
+
+        if (framebuffer.empty())
+        {
+            width = part.image_width;
+            height = part.image_height;
+            samples_per_pixel = part.samples_per_pixel;
+            tone = part.tone;
+            framebuffer.resize(size_t(width) * height);
+            covered.resize(framebuffer.size(), 0);
+        }
+        else if (part.image_width != width || part.image_height != height || part.samples_per_pixel != samples_per_pixel ||
+                 part.tone.op != tone.op || part.tone.exposure != tone.exposure || part.tone.dither != tone.dither)
+        {
+            std::cout << "Skipping " << argv[i] << ": belongs to a different render" << std::endl;
+            continue;
+        }
+
+        insert_region(framebuffer, part);
+        const Region &r = part.region;
+        for (int y = r.y0; y < r.y1; ++y)
+            for (int x = r.x0; x < r.x1; ++x)
+                covered[size_t(y) * width + x] = 1;
+    }
+
+    if (framebuffer.empty())
+    {
+        std::cout << "No usable parts." << std::endl;
+        return 1;
+    }
+
+    size_t missing = 0;
+    for (unsigned char c : covered)
+        missing += !c;
+    if (missing > 0)
+        std::cout << "Warning: " << missing << " pixels are not covered by any part and stay black." << std::endl;
+
+    if (!write_image(argv[1], framebuffer, width, height, samples_per_pixel, ToneMapper(tone)))
+    {
+        std::cout << "Could not write " << argv[1] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Merged image saved to " << argv[1] << std::endl;
+    return 0;
+}
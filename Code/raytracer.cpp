@@ -2,396 +2,1008 @@
 #include <fstream>
 #include <vector>
 #include <memory>
-#include "json/include/nlohmann/json.hpp"
-#include "BVH.hpp"
-#include "Camera.hpp"
-#include "Light.hpp"
-#include "Sphere.hpp"
-#include "Triangle.hpp"
-#include "Cylinder.hpp"
-#include "Texture.hpp" //custom texture class`
-#include "Material.hpp"
-#include "Hittable.hpp"
-#include "HitRecord.hpp"
-#include "utility.hpp"
-#include "Vector2.hpp"   //used for textures, not necessary for part1: basic ray tracing 
-#include <future>
+#include <cctype>
+#include <cstdio>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "Renderer.hpp"
+#include "HotReload.hpp"
+#include "Distributed.hpp"
+#include "Progressive.hpp"
+#include "Streaming.hpp"
+#include "Batch.hpp"
+#include "Checkpoint.hpp"
+
+// The command line client of libcgrrt: options, scene files, and the ways of
+// running a render (progressive, streamed, distributed, batched, watched,
+// checkpointed).
 
 using Color = Vector3;
 using json = nlohmann::json;
 
-Vector3 barycentric(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c)
-{
-    Vector3 v0 = b - a, v1 = c - a, v2 = p - a;
-    float d00 = v0.dot(v0);
-    float d01 = v0.dot(v1);
-    float d11 = v1.dot(v1);
-    float d20 = v2.dot(v0);
-    float d21 = v2.dot(v1);
-    float denom = d00 * d11 - d01 * d01;
-    float v = (d11 * d20 - d01 * d21) / denom;
-    float w = (d00 * d21 - d01 * d20) / denom;
-    float u = 1.0f - v - w;
-    return Vector3(u, v, w);
-}
-
-Color textureMappingTriangle(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c, const Vector2 &ta, const Vector2 &tb, const Vector2 &tc, const Texture &texture)
-{
-    Vector3 bary = barycentric(p, a, b, c);
-    Vector2 texCoord = ta * bary.x + tb * bary.y + tc * bary.z;
-    return texture.sample(texCoord);
-}
-
-void write_color(std::ostream &out, Color pixel_color, int samples_per_pixel, float exposure)
-{
-    auto r = pixel_color.x;
-    auto g = pixel_color.y;
-    auto b = pixel_color.z;
-
-    auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
-
-    // Write the translated [0,255] value of each color component.
-    out << static_cast<int>(255 * clamp(r, 0.0, 1.0)) << ' '
-        << static_cast<int>(255 * clamp(g, 0.0, 1.0)) << ' '
-        << static_cast<int>(255 * clamp(b, 0.0, 1.0)) << '\n';
-}
+// Heap allocations are counted while the scene is built, so the build can
+// report how many it makes; the flag keeps render-time allocations at one
+// relaxed load. The default operator delete frees with std::free, matching this.
+std::atomic<bool> count_heap_allocations{false};
+std::atomic<uint64_t> heap_allocations{0}, heap_allocated_bytes{0};
 
-Camera parseCamera(const json &j)
+void *operator new(std::size_t size)
 {
-    auto cam_data = j["camera"];
-    return Camera(Vector3(cam_data["position"]),
-                  Vector3(cam_data["lookAt"]),
-                  Vector3(cam_data["upVector"]),
-                  cam_data["fov"].get<float>(),
-                  static_cast<float>(cam_data["width"].get<int>()) / cam_data["height"].get<int>(),
-                  cam_data["exposure"].get<float>(),
-                  cam_data["width"].get<int>(),
-                  cam_data["height"].get<int>());
-}
-
-void parseLights(const json &j, std::vector<Light> &lights)
-{
-    if (j["scene"].contains("lightsources"))
+    if (count_heap_allocations.load(std::memory_order_relaxed))
     {
-        for (const auto &light : j["scene"]["lightsources"])
-        {
-            Vector3 position(light["position"]);
-            Color intensity(light["intensity"]);
-            lights.emplace_back(position, intensity);
-        }
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        heap_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    while (true)
+    {
+        if (void *p = std::malloc(size ? size : 1))
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
     }
 }
 
-void parseScene(const json &j, std::vector<std::shared_ptr<Hittable>> &objects)
+int main(int argc, char *argv[])
 {
-    for (const auto &obj : j["scene"]["shapes"])
+    if (argc < 2)
     {
-        std::shared_ptr<Material> material = std::make_shared<Diffuse>(Vector3(1, 0, 0));
+        std::cout << "Input the JSON file too..." << std::endl;
+        return 1;
+    }
 
-        if (obj.contains("material"))
+    WavefrontSettings path_settings;
+    int TraceType = 0;
+    Region region;
+    bool partial = false;
+    int shard_index = 0, shard_count = 0;
+    int workers = 0, tile_size = 64;
+    bool worker = false;
+    std::string outfile;
+    int samples_per_pixel = 10;
+    bool samples_given = false;
+    bool progressive = false;
+    ProgressiveSettings progressive_settings;
+    std::string snapshot_file;
+    bool denoise = false, save_aovs = false;
+    std::string reference_file;
+    int stream_rows = 0;
+    bool use_arena = true;
+    bool compile_scene = true;
+    bool quantized_bvh = false;
+    int chunk_shapes = 0;
+    std::string accel = "bvh";
+    bool accel_benchmark = false;
+    bool raster_primary = false, raster_benchmark = false;
+    int preview_scale = 0, shadow_map_size = 256;
+    bool preview_check = false;
+    int update_frames = 0;
+    bool watch = false;
+    bool keep_gbuffer = false;
+    bool numa = false, replicate_scene = false;
+    int numa_node_limit = 0;
+    ToneSettings tone_settings;
+    int view_index = -1;
+    std::unique_ptr<Sampler> sampler = make_sampler("sobol");
+    std::string convergence_reference;
+    bool sample_emitters = true;
+    std::string emitter_reference;
+    std::string checkpoint_file;
+    double checkpoint_seconds = 0;
+    bool resume = false;
+    // Options that --workers passes on to every worker it starts.
+    std::vector<std::string> worker_args = {argv[1], "--worker"};
+
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--sort-rays")
         {
-            const auto &mat_json = obj["material"];
-            if (mat_json.contains("isrefractive") && mat_json["isrefractive"].get<bool>())
-            {
-                material = std::make_shared<Dielectric>(obj["material"]);
-            }
-            else if (mat_json.contains("isreflective") && mat_json["isreflective"].get<bool>())
-            {
-                material = std::make_shared<Metal>(obj["material"]);
-            }
-            else
-            {
-                material = std::make_shared<Diffuse>(obj["material"]);
-            }
+            path_settings.sort_secondary_rays = true;
+            worker_args.push_back(arg);
         }
-
-        if (obj["type"] == "sphere")
+        else if (arg == "--texture-cache-mb" && has_value)
         {
-            objects.push_back(std::make_shared<Sphere>(
-                Vector3(obj["center"]),
-                obj["radius"].get<float>(),
-                material));
+            TextureCache::shared().set_budget(static_cast<size_t>(std::stod(argv[++i]) * (1 << 20)));
+            worker_args.insert(worker_args.end(), {arg, argv[i]});
         }
-        else if (obj["type"] == "cylinder")
+        else if (arg == "--mode" && has_value)
+            TraceType = std::stoi(argv[++i]);
+        else if (arg == "--region" && has_value && parse_region(argv[++i], region))
+            partial = true;
+        else if (arg == "--shard" && has_value && parse_shard(argv[++i], shard_index, shard_count))
+            partial = true;
+        else if (arg == "--output" && has_value)
+            outfile = argv[++i];
+        else if (arg == "--workers" && has_value)
+            workers = std::stoi(argv[++i]);
+        else if (arg == "--tile" && has_value)
+            tile_size = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--worker")
+            worker = true;
+        else if (arg == "--samples" && has_value)
         {
-            objects.push_back(std::make_shared<Cylinder>(
-                Vector3(obj["center"]),
-                Vector3(obj["axis"]),
-                obj["radius"].get<float>(),
-                obj["height"].get<float>(),
-                material));
+            samples_per_pixel = std::max(1, std::stoi(argv[++i]));
+            samples_given = true;
+            worker_args.insert(worker_args.end(), {arg, argv[i]});
         }
-        else if (obj["type"] == "triangle")
+        else if (arg == "--progressive")
+            progressive = true;
+        else if (arg == "--samples-per-pass" && has_value)
         {
-            objects.push_back(std::make_shared<Triangle>(
-                Vector3(obj["v0"]),
-                Vector3(obj["v1"]),
-                Vector3(obj["v2"]),
-                material));
+            progressive_settings.samples_per_pass = std::max(1, std::stoi(argv[++i]));
+            progressive = true;
         }
-    }
-}
-
-Color linearToneMapping(const Color &color, float exposure)
-{
-    Color mapped = color * exposure; // Scale based on exposure
-
-    // Clamp to [0, 1] to prevent tehm from going out of range
-    return Color(
-        fmin(mapped.x, 1.0f),
-        fmin(mapped.y, 1.0f),
-        fmin(mapped.z, 1.0f));
-}
-
-void parseScene(const json &j, hittable_list &world)
-{
-    for (const auto &obj : j["scene"]["shapes"])
-    {
-        std::shared_ptr<Material> material = std::make_shared<Diffuse>(Vector3(1, 0, 0));
-
-        if (obj.contains("material"))
+        else if (arg == "--time-budget" && has_value && parse_duration(argv[i + 1]) > 0)
         {
-            const auto &mat_json = obj["material"];
-            if (mat_json.contains("isrefractive") && mat_json["isrefractive"].get<bool>())
-            {
-                material = std::make_shared<Dielectric>(obj["material"]);
-            }
-            else if (mat_json.contains("isreflective") && mat_json["isreflective"].get<bool>())
-            {
-                material = std::make_shared<Metal>(obj["material"]);
-            }
+            progressive_settings.time_budget = parse_duration(argv[++i]);
+            progressive = true;
+        }
+        else if (arg == "--target-error" && has_value)
+        {
+            progressive_settings.target_error = std::stod(argv[++i]);
+            progressive = true;
+        }
+        else if (arg == "--snapshot-every" && has_value)
+        {
+            // A unit ("10s") means seconds, a bare number means passes.
+            std::string every = argv[++i];
+            if (!every.empty() && std::isalpha(static_cast<unsigned char>(every.back())))
+                progressive_settings.snapshot_seconds = std::max(0.0, parse_duration(every));
             else
-            {
-                material = std::make_shared<Diffuse>(obj["material"]);
-            }
+                progressive_settings.snapshot_passes = std::max(0, std::stoi(every));
+            progressive = true;
         }
-        else
+        else if (arg == "--snapshot" && has_value)
+            snapshot_file = argv[++i];
+        else if (arg == "--denoise")
+            denoise = true;
+        else if (arg == "--aovs")
+            save_aovs = true;
+        else if (arg == "--reference" && has_value)
+            reference_file = argv[++i];
+        else if (arg == "--stream" && has_value)
+            stream_rows = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--no-arena")
+            use_arena = false;
+        else if (arg == "--no-compile")
+            compile_scene = false;
+        else if (arg == "--quantized-bvh")
+            quantized_bvh = true;
+        else if (arg == "--accel" && has_value &&
+                 (argv[i + 1] == std::string("bvh") || argv[i + 1] == std::string("grid") ||
+                  argv[i + 1] == std::string("kdtree") || argv[i + 1] == std::string("auto")))
+            accel = argv[++i];
+        else if (arg == "--accel-benchmark")
+            accel_benchmark = true;
+        else if (arg == "--raster-primary")
         {
-            // No material specified, use the default material
-            material = std::make_shared<Diffuse>(Vector3(1, 0, 0)); // Red Diffuse material
+            raster_primary = true;
+            worker_args.push_back(arg);
         }
-
-        if (obj.contains("type") && obj["type"] == "sphere" && obj.contains("center") && obj.contains("radius"))
+        else if (arg == "--raster-benchmark")
+            raster_benchmark = true;
+        else if (arg == "--preview")
+            preview_scale = std::max(preview_scale, 2);
+        else if (arg == "--preview-scale" && has_value)
+            preview_scale = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--shadow-map-size" && has_value)
+            shadow_map_size = std::max(8, std::stoi(argv[++i]));
+        else if (arg == "--preview-check")
+        {
+            preview_check = true;
+            preview_scale = std::max(preview_scale, 2);
+        }
+        else if (arg == "--out-of-core" && has_value)
+            chunk_shapes = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--geometry-budget" && has_value)
+            GeometryCache::shared().set_budget(static_cast<size_t>(std::stod(argv[++i]) * (1 << 20)));
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg == "--gbuffer")
+            keep_gbuffer = true;
+        else if (arg == "--numa")
+            numa = true;
+        else if (arg == "--numa-nodes" && has_value)
         {
-            world.add(std::make_shared<Sphere>(
-                Vector3(obj["center"]),
-                obj["radius"].get<float>(),
-                material));
+            numa_node_limit = std::max(1, std::stoi(argv[++i]));
+            numa = true;
         }
-        else if (obj.contains("type") && obj["type"] == "cylinder" && obj.contains("center") && obj.contains("axis") &&
-                 obj.contains("radius") && obj.contains("height"))
+        else if (arg == "--replicate-scene")
+            replicate_scene = numa = true;
+        else if (arg == "--tonemap" && has_value && parse_tone_operator(argv[i + 1], tone_settings.op))
+            ++i;
+        else if (arg == "--exposure" && has_value)
+            tone_settings.exposure = static_cast<float>(std::exp2(std::stod(argv[++i])));
+        else if (arg == "--dither")
+            tone_settings.dither = true;
+        else if (arg == "--view" && has_value)
         {
-            world.add(std::make_shared<Cylinder>(
-                Vector3(obj["center"]),
-                Vector3(obj["axis"]),
-                obj["radius"].get<float>(),
-                obj["height"].get<float>(),
-                material));
+            view_index = std::max(0, std::stoi(argv[++i]));
+            worker_args.insert(worker_args.end(), {arg, argv[i]});
         }
-        else if (obj.contains("type") && obj["type"] == "triangle" &&
-                 obj.contains("v0") && obj.contains("v1") && obj.contains("v2"))
+        else if (arg == "--update-benchmark" && has_value)
+            update_frames = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--sampler" && has_value && make_sampler(argv[i + 1]))
         {
+            sampler = make_sampler(argv[++i]);
+            worker_args.insert(worker_args.end(), {arg, argv[i]});
+        }
+        else if (arg == "--convergence" && has_value)
+            convergence_reference = argv[++i];
+        else if (arg == "--no-emitter-sampling")
+        {
+            sample_emitters = false;
+            worker_args.push_back(arg);
+        }
+        else if (arg == "--emitter-benchmark" && has_value)
+            emitter_reference = argv[++i];
+        else if (arg == "--checkpoint" && has_value)
+            checkpoint_file = argv[++i];
+        else if (arg == "--checkpoint-every" && has_value && parse_duration(argv[i + 1]) > 0)
+            checkpoint_seconds = parse_duration(argv[++i]);
+        else if (arg == "--resume")
+            resume = true;
+        else
+            std::cout << "Ignoring unknown or incomplete option " << arg << std::endl;
+    }
+
+    // A worker's stdout carries its tiles back to the coordinator.
+    int protocol_fd = worker ? claim_worker_stdout() : -1;
+
+    std::ifstream file(argv[1]);
+    json j;
+    file >> j;
 
-            world.add(std::make_shared<Triangle>(
-                Vector3(obj["v0"]),
-                Vector3(obj["v1"]),
-                Vector3(obj["v2"]),
-                material));
+    // "cameras" or "camera_path" make a batch of views of the one scene; the
+    // first (or the one --view picks) stands in as "camera" for everything else.
+    std::string view_error;
+    std::vector<json> views = camera_views(j, view_error);
+    if (views.empty())
+    {
+        std::cout << "Cannot render " << argv[1] << ": " << view_error << std::endl;
+        return 1;
+    }
+    if (view_index >= 0)
+    {
+        if (size_t(view_index) >= views.size())
+        {
+            std::cout << "--view " << view_index << ": the scene has " << views.size() << " views" << std::endl;
+            return 1;
         }
+        views = {views[view_index]};
     }
-}
+    bool multi_view = j.contains("cameras") || j.contains("camera_path");
+    j["camera"] = views[0];
 
-Color blinn_phong_shading(const Vector3 &view_dir, const Vector3 &light_dir, const Vector3 &normal, const Material &material, const Color &light_intensity)
-{
-    // Ambient component
-    Color ambient = 0.1 * material.diffusecolor; // Adjust ambient factor as needed
+    auto camera_future = async_parseCamera(j);
 
-    // Specular component
-    Vector3 halfway_dir = (view_dir + light_dir).normalized();
-    float spec = std::pow(std::max(0.0f, normal.dot(halfway_dir)), material.specularexponent);
-    Color specular = spec * material.ks * material.specularcolor * light_intensity;
+    SceneOptions scene_options;
+    scene_options.use_arena = use_arena;
+    scene_options.compile = compile_scene;
+    scene_options.quantized_bvh = quantized_bvh;
+    scene_options.chunk_shapes = chunk_shapes;
+    scene_options.accel = accel;
+    scene_options.keep_entries = watch;
+    Scene scene(scene_options);
+    std::string scene_error;
+    count_heap_allocations = true;
+    bool scene_built = scene.load(j, scene_error);
+    if (!scene_built)
+        std::cerr << scene_error << std::endl;
+    else
+        scene_built = scene.build(scene_error); // OutOfCoreScene says why it failed
+    count_heap_allocations = false;
+    if (!scene_built)
+        return 1;
+    Camera camera = camera_future.get();
 
-    // Diffuse component
-    float diff = std::max(0.0f, normal.dot(light_dir));
-    Color diffuse = diff * material.kd * material.diffusecolor * light_intensity;
+    const SceneStats &scene_stats = scene.stats;
+    std::cout << "Scene build: " << scene_stats.static_shapes + scene_stats.dynamic_shapes << " shapes, " << heap_allocations
+              << " heap allocations (" << heap_allocated_bytes / 1024 << " KB), "
+              << scene_stats.build_seconds << " seconds\n";
+    if (scene.shape_arena())
+    {
+        ArenaStats arena_stats = scene.arena.stats();
+        std::cout << "Scene arena: " << arena_stats.allocations << " objects, " << arena_stats.bytes / 1024
+                  << " KB in " << arena_stats.blocks << " blocks of " << arena_stats.block_bytes / 1024 << " KB total, "
+                  << arena_stats.destructors << " with destructors\n";
+    }
+    if (scene.out_of_core)
+        std::cout << "Out-of-core geometry: " << scene.out_of_core->chunk_count() << " chunks of up to " << chunk_shapes << " shapes, "
+                  << scene.out_of_core->bytes_on_disk() / 1024 << " KB on disk, "
+                  << GeometryCache::shared().budget() / 1024 << " KB budget\n";
+
+    // The compiled copy of the tree, then --accel's grid or kd-tree over it.
+    if (accel != "bvh" && (!compile_scene || quantized_bvh || !scene.bvh_tree))
+        std::cout << "--accel needs the compiled in-core scene without --quantized-bvh; keeping the BVH.\n";
+    scene.compile();
+    std::unique_ptr<CompiledScene> &compiled = scene.compiled;
+    if (compiled)
+    {
+        CompiledSceneStats compiled_stats = compiled->stats();
+        std::cout << "Compiled scene: " << compiled_stats.spheres << " spheres, " << compiled_stats.triangles << " triangles, "
+                  << compiled_stats.cylinders << " cylinders, " << compiled_stats.others << " other, "
+                  << compiled_stats.nodes << (quantized_bvh ? " quantized" : "") << " nodes (" << compiled_stats.node_bytes / 1024
+                  << " KB), " << compiled_stats.bytes / 1024 << " KB in all, "
+                  << scene_stats.compile_seconds << " seconds\n";
+    }
+    if (scene.grid || scene.kd_tree)
+    {
+        std::cout << "Acceleration: " << scene.options.accel;
+        if (scene.grid)
+            std::cout << ", " << scene.grid->dimensions()[0] << "x" << scene.grid->dimensions()[1] << "x" << scene.grid->dimensions()[2]
+                      << " cells, " << scene.grid->reference_count() << " references";
+        if (scene.kd_tree)
+            std::cout << ", " << scene.kd_tree->node_count() << " nodes, " << scene.kd_tree->reference_count() << " references";
+        std::cout << ", built in " << scene_stats.accel_seconds << " seconds\n";
+    }
+    if (accel_benchmark && compiled && !quantized_bvh)
+        return run_accel_benchmark(*compiled, scene.objects, camera, j["camera"]["width"], j["camera"]["height"]);
+    if (raster_benchmark && compiled)
+        return run_raster_benchmark(*compiled, *scene.static_world, camera, j["camera"]["width"], j["camera"]["height"]);
 
-    // Combine all components
-    return ambient + specular + diffuse;
-}
+    if (scene_stats.emitters > 0)
+        std::cout << "Emissive shapes: " << scene_stats.emitters << ", total power " << scene.emitters.power()
+                  << (sample_emitters ? ", sampled directly in mode 3" : ", found by bounces only") << "\n";
 
-Color lerp(const Color &a, const Color &b, float t)
-{
-    return a * (1 - t) + b * t;
-}
+    if (scene.two_level)
+    {
+        std::cout << "Two-level scene: " << scene_stats.static_shapes << " static shapes, " << scene.dynamic_objects.size()
+                  << " dynamic shapes in " << scene.two_level->dynamic_blas().node_count() << " nodes\n";
+        if (update_frames > 0)
+            run_update_benchmark(*scene.two_level, scene.dynamic_objects, update_frames, scene_stats.build_seconds);
+    }
+    else if (update_frames > 0)
+        std::cout << "--update-benchmark needs shapes marked \"dynamic\": true; skipping it.\n";
+    const Hittable *world = &scene.world();
+    std::vector<Light> &lights = scene.lights;
+    Color &background_color = scene.background;
 
-Color Binary_Ray_Color(const Ray &r, const BVHNode &world, const Color &background_color)
-{
-    Hit_record rec;
-    if (world.hit(r, 0.001, inf, rec))
+    if (TraceType == 0)
     {
-        Color lighting(1, 0, 0);
-        return lighting;
+        std::cout << "Press 1 for Binary-RayTracing, 2 for Blinn-Phong-RayTracing, 3 for Path-Tracing: ";
+        std::cin >> TraceType;
     }
+    worker_args.insert(worker_args.end(), {"--mode", std::to_string(TraceType)});
 
-    return background_color;
-}
+    int width = j["camera"]["width"];
+    int height = j["camera"]["height"];
+    int max_depth = 5;
 
-Color ray_color_phong(const Ray &r, const BVHNode &world, const std::vector<Light> &lights, const Color &background_color, int depth)
-{
-    if (depth <= 0)
-        return Color(0, 0, 0);
+    // --preview: Blinn-Phong at 1/scale of the resolution (one sample unless
+    // --samples says otherwise) with shadows from cubemaps, scaled up on output.
+    bool preview = preview_scale > 0;
+    if (preview && (TraceType != 2 || worker || workers > 0 || partial || stream_rows > 0 || denoise || save_aovs || views.size() > 1))
+    {
+        std::cout << "--preview renders one whole image in --mode 2 in this process; ignoring it with --workers, --region, "
+                     "--shard, --stream, denoising options or a batch of views.\n";
+        preview = preview_check = false;
+    }
+    int output_width = width, output_height = height;
+    if (preview)
+    {
+        width = std::max(1, width / preview_scale);
+        height = std::max(1, height / preview_scale);
+        camera.height = height; // ray cones (texture filtering) follow the coarser pixels
+        if (!samples_given)
+            samples_per_pixel = 1;
+    }
+    // The camera's "exposure" is its lens size (see parseCamera); brightness is --exposure.
+    ToneMapper tone(tone_settings);
+    if (tone_settings.dither && tone_settings.op == ToneOperator::Gamma)
+        std::cout << "--dither applies to the sRGB operators (--tonemap linear|reinhard|aces); the default gamma encoding truncates.\n";
+    if (watch && (worker || workers > 0 || partial || progressive || stream_rows > 0 || denoise || save_aovs))
+    {
+        std::cout << "--watch re-renders whole images in this process; ignoring it with --workers, --region, --shard, --stream, progressive or denoising options.\n";
+        watch = false;
+    }
+    if (watch && multi_view)
+    {
+        std::cout << "--watch follows one camera; ignoring it for a scene with \"cameras\" or \"camera_path\".\n";
+        watch = false;
+    }
+    if (stream_rows > 0 && (worker || workers > 0 || partial || progressive || denoise || save_aovs))
+    {
+        std::cout << "--stream renders whole images in one pass; ignoring it with --workers, --region, --shard, progressive or denoising options.\n";
+        stream_rows = 0;
+    }
+    // A streamed image never exists in memory as a whole.
+    std::vector<Color> framebuffer(stream_rows > 0 ? 0 : size_t(width) * height);
+    // Writes an image of the framebuffer, scaled up to the scene's size for a preview.
+    auto save_image = [&](const std::string &path, int samples)
+    {
+        if (!preview)
+            return write_image(path, framebuffer, width, height, samples, tone);
+        return write_image(path, upscale_bilinear(framebuffer, width, height, output_width, output_height), output_width, output_height, samples, tone);
+    };
+
+    // The auxiliary buffers only exist for whole images rendered in this process.
+    AOVBuffers aovs;
+    bool want_aovs = denoise || save_aovs;
+    if (want_aovs && (worker || workers > 0 || partial))
+    {
+        if (!worker)
+            std::cout << "--denoise and --aovs need the whole image in one process; ignoring them.\n";
+        want_aovs = denoise = save_aovs = false;
+    }
+    if (want_aovs)
+        aovs.resize(framebuffer.size());
+
+    // The G-buffer only pays off when the image is shaded again, i.e. in watch mode.
+    GBuffer gbuffer;
+    if (keep_gbuffer && (!watch || TraceType != 2))
+        std::cout << "--gbuffer needs --watch and --mode 2; ignoring it.\n";
+    else if (keep_gbuffer)
+    {
+        gbuffer.resize(framebuffer.size(), samples_per_pixel);
+        std::cout << "G-buffer: " << samples_per_pixel << " samples per pixel, " << gbuffer.bytes() / 1024 << " KB\n";
+    }
+
+    // --numa: pinned threads per NUMA node, each node rendering its own band
+    // of tiles, optionally with its own copy of the compiled scene.
+    bool numa_render = false;
+    std::vector<std::unique_ptr<CompiledScene>> replicas;
+    if (numa && (TraceType == 3 || worker || workers > 0 || progressive || stream_rows > 0 || want_aovs || keep_gbuffer))
+        std::cout << "--numa renders one pass of tiles in modes 1 and 2; ignoring it with path tracing, --workers, --stream, progressive, denoising or G-buffer options.\n";
+    else
+        numa_render = numa;
+
+    // Everything this process renders goes through one renderer and its
+    // pinned threads (those of the first --numa-nodes nodes with --numa). A
+    // worker is one of many processes and renders its tiles on one thread.
+    std::unique_ptr<Renderer> renderer;
+    if (!worker && workers == 0)
+    {
+        std::vector<NumaNode> nodes = detect_numa_nodes();
+        if (numa_render && numa_node_limit > 0 && nodes.size() > size_t(numa_node_limit))
+            nodes.resize(numa_node_limit);
+        RenderOptions render_options;
+        render_options.mode = TraceType;
+        render_options.samples = samples_per_pixel;
+        render_options.max_depth = max_depth;
+        render_options.tile_size = tile_size;
+        renderer = std::make_unique<Renderer>(render_options, nodes);
+    }
+
+    if (numa_render)
+    {
+        NumaThreadPool &numa_pool = renderer->pool();
+        const std::vector<NumaNode> &nodes = numa_pool.nodes();
+        std::cout << "NUMA: " << nodes.size() << " nodes, " << numa_pool.size() << " threads";
+        for (const NumaNode &node : nodes)
+            std::cout << (&node == &nodes[0] ? " (" : ", ") << "node " << node.id << ": " << node.cpus.size() << " CPUs";
+        std::cout << ")\n";
+        if (replicate_scene && !(compiled && world == compiled.get()))
+            std::cout << "--replicate-scene copies the compiled BVH, so it needs the default in-core BVH without dynamic shapes; sharing one copy.\n";
+        else if (replicate_scene)
+        {
+            // Copied by a thread of each node, so the copy's pages are local to it.
+            auto replicate_start = std::chrono::high_resolution_clock::now();
+            replicas.resize(nodes.size());
+            numa_pool.run_once_per_node([&](size_t node)
+                                         { replicas[node] = std::make_unique<CompiledScene>(*compiled); });
+            std::chrono::duration<double> replicate_time = std::chrono::high_resolution_clock::now() - replicate_start;
+            std::cout << "Scene replicated on " << nodes.size() << " nodes, " << compiled->stats().bytes / 1024
+                      << " KB each, " << replicate_time.count() << " seconds\n";
+        }
+    }
+
+    bool batch = views.size() > 1;
+    if (batch && (worker || workers > 0 || partial || progressive || stream_rows > 0 || want_aovs || keep_gbuffer || numa_render ||
+                  !convergence_reference.empty()))
+    {
+        std::cout << "A batch of views renders whole images in this process; with --workers, --region, --shard, --stream, --numa, "
+                     "progressive, denoising, G-buffer or convergence options only the first view is rendered (--view K picks another).\n";
+        batch = false;
+    }
+    // --checkpoint, --checkpoint-every, --resume: the plain render of one
+    // image (or region) goes one sample per pass, checkpointed between passes.
+    bool checkpointing = !checkpoint_file.empty() || checkpoint_seconds > 0 || resume;
+    if (checkpointing && (worker || workers > 0 || progressive || stream_rows > 0 || want_aovs || watch || numa_render || batch ||
+                          !convergence_reference.empty()))
+    {
+        std::cout << "--checkpoint and --resume cover a plain render in this process; ignoring them with --workers, --stream, --numa, "
+                     "--watch, progressive, denoising or convergence options or a batch of views.\n";
+        checkpointing = resume = false;
+    }
+    // --raster-primary: camera rays start from a rasterized visibility buffer.
+    std::unique_ptr<VisibilityBuffer> visibility;
+    if (raster_primary && (TraceType == 3 || !compiled || scene.two_level || batch || watch))
+        std::cout << "--raster-primary needs mode 1 or 2, the compiled in-core scene without dynamic shapes, one camera and no --watch; tracing camera rays.\n";
+    else if (raster_primary)
+    {
+        auto raster_start = std::chrono::high_resolution_clock::now();
+        visibility = std::make_unique<VisibilityBuffer>(*compiled, *world, camera, width, height);
+        std::chrono::duration<double> raster_time = std::chrono::high_resolution_clock::now() - raster_start;
+        VisibilityBuildStats raster_stats = visibility->stats();
+        std::cout << "Visibility buffer: " << raster_stats.bin_entries << " tile bin entries, " << raster_stats.full_screen
+                  << " full-screen primitives, " << raster_time.count() << " seconds\n";
+    }
 
-    Hit_record rec;
-    if (world.hit(r, 0.001, inf, rec))
+    // Shadow cubemaps for the preview, one per light, rebuilt whenever the
+    // lights or the geometry change.
+    std::vector<std::unique_ptr<ShadowCubemap>> shadow_maps;
+    double shadow_map_seconds = 0;
+    auto build_shadow_maps = [&]
     {
-        Color lighting(0.1, 0.1, 0.1);
-        Vector3 view_dir = -r.direction.normalized();
+        shadow_maps.clear();
+        for (Light &light : lights)
+        {
+            shadow_maps.push_back(std::make_unique<ShadowCubemap>(light.position, *world, shadow_map_size));
+            light.shadow_map = shadow_maps.back().get();
+        }
+    };
+    if (preview)
+    {
+        auto maps_start = std::chrono::high_resolution_clock::now();
+        build_shadow_maps();
+        std::chrono::duration<double> maps_time = std::chrono::high_resolution_clock::now() - maps_start;
+        shadow_map_seconds = maps_time.count();
+        std::cout << "Preview: " << width << "x" << height << " (1/" << preview_scale << "), " << samples_per_pixel
+                  << " spp, " << shadow_maps.size() << " shadow cubemaps of " << shadow_map_size << "^2 x 6 texels ("
+                  << (shadow_maps.empty() ? 0 : shadow_maps.size() * shadow_maps[0]->bytes() / 1024) << " KB), "
+                  << maps_time.count() << " seconds\n";
+    }
 
-        // code for texture that is not working.
-        // Color texColor = rec.material_ptr->texture->sample(rec.uv);
+    std::vector<Camera> view_cameras;
+    if (batch)
+    {
+        for (const json &view : views)
+            view_cameras.push_back(parseCamera(json{{"camera", view}}));
+        framebuffer = std::vector<Color>(); // every view has its own
+    }
 
-        for (const auto &light : lights)
+    // Adds samples [first_sample, first_sample + samples) of region to the framebuffer.
+    // target holds the image rows from first_row on.
+    WavefrontStats path_stats;
+    auto render_into = [&](std::vector<Color> &target, int first_row, const Region &r, int first_sample, int samples)
+    {
+        if (renderer)
         {
-            Vector3 light_dir = (light.position - rec.p).normalized();
-            Ray shadow_ray(rec.p, light_dir);
-            Hit_record shadow_rec;
+            renderer->options.path = path_settings;
+            path_stats.add(renderer->render_region(target, first_row, camera, *world, lights, background_color, width, height, r, first_sample, samples,
+                                                   RenderTargets{want_aovs ? &aovs : nullptr, gbuffer.empty() ? nullptr : &gbuffer, visibility.get()}));
+        }
+        else if (TraceType == 3)
+            path_stats.add(render_image_wavefront(target, camera, *world, lights, background_color, width, height, r, first_sample, samples, path_settings, want_aovs ? &aovs : nullptr, first_row));
+        else
+            render_image(target, camera, *world, lights, background_color, width, height, first_sample, samples, max_depth, TraceType, r, want_aovs ? &aovs : nullptr, first_row, path_settings.sampler, gbuffer.empty() ? nullptr : &gbuffer, visibility.get());
+    };
+    auto render_samples = [&](const Region &r, int first_sample, int samples)
+    {
+        render_into(framebuffer, 0, r, first_sample, samples);
+    };
 
-            if (!world.hit(shadow_ray, 0.001, (light.position - rec.p).length(), shadow_rec))
-            {
-                // Use the blinn_phong_shading function for each light
-                lighting += blinn_phong_shading(view_dir, light_dir, rec.normal, *rec.material_ptr, light.intensity);
-            }
+    path_settings.sampler = sampler.get();
+    path_settings.emitters = sample_emitters ? &scene.emitters : nullptr;
+
+    if (!emitter_reference.empty())
+    {
+        if (TraceType != 3 || scene.emitters.empty())
+        {
+            std::cout << "--emitter-benchmark needs --mode 3 and a scene with emissive shapes." << std::endl;
+            return 1;
         }
+        return run_emitter_benchmark(emitter_reference, framebuffer, width, height, samples_per_pixel, tone,
+                                     [&](bool direct, int first_sample, int samples)
+                                     {
+                                         path_settings.emitters = direct ? &scene.emitters : nullptr;
+                                         render_samples(Region::full(width, height), first_sample, samples);
+                                     });
+    }
 
-        // Reflection handling
-        if (rec.material_ptr->isreflective && depth > 0)
+    if (!convergence_reference.empty())
+    {
+        return run_convergence_benchmark(convergence_reference, framebuffer, width, height, samples_per_pixel, tone,
+                                         [&](const Sampler *s, int first_sample, int samples)
+                                         {
+                                             path_settings.sampler = s;
+                                             render_samples(Region::full(width, height), first_sample, samples);
+                                         });
+    }
+
+    if (worker)
+    {
+        auto render_tile = [&](const Region &r)
         {
-            Vector3 reflected_dir = reflect(r.direction.normalized(), rec.normal);
-            Ray reflected_ray(rec.p, reflected_dir);
+            for (int y = r.y0; y < r.y1; ++y)
+                std::fill(framebuffer.begin() + size_t(y) * width + r.x0, framebuffer.begin() + size_t(y) * width + r.x1, Color(0, 0, 0));
+            render_samples(r, 0, samples_per_pixel);
+        };
+        return run_worker(render_tile, framebuffer, width, height, samples_per_pixel, protocol_fd);
+    }
 
-            float cos_theta = std::max(-reflected_dir.dot(rec.normal), 0.0f);
-            float fresnel = rec.material_ptr->reflectivity + (1.0f - rec.material_ptr->reflectivity) * std::pow(1.0f - cos_theta, 5);
+    if (shard_count > 0)
+        region = Region::shard(shard_index, shard_count, width, height);
+    region = partial ? region.clipped(width, height) : Region::full(width, height);
+    if (region.empty())
+    {
+        std::cout << "The requested region lies outside the " << width << "x" << height << " image." << std::endl;
+        return 1;
+    }
 
-            Color reflected_color = ray_color_phong(reflected_ray, world, lights, background_color, depth - 1);
-            lighting = lerp(lighting, reflected_color, fresnel);
+    if (outfile.empty() && !partial)
+        outfile = "rendered_image.ppm";
+
+    // What the progressive and checkpointed drivers render, pass by pass.
+    RenderJob job;
+    job.camera = &camera;
+    job.world = world;
+    job.lights = &lights;
+    job.background = background_color;
+    job.width = width;
+    job.height = height;
+    job.region = region;
+    job.targets = RenderTargets{want_aovs ? &aovs : nullptr, gbuffer.empty() ? nullptr : &gbuffer, visibility.get()};
+
+    // A checkpoint only fits the same scene, image, region and options that
+    // change the samples; its sums and sample counts replace the empty image.
+    int first_sample = 0;
+    CheckpointSettings checkpoint_settings;
+    if (checkpointing)
+    {
+        if (checkpoint_file.empty())
+            checkpoint_file = (outfile.empty() ? std::string("rendered_image.ppm") : outfile) + ".ckpt";
+        checkpoint_settings.path = checkpoint_file;
+        if (checkpoint_seconds > 0)
+            checkpoint_settings.seconds = checkpoint_seconds;
+        // The camera that was picked (--view) counts explicitly, not only as
+        // whatever the file's "camera" entry holds by now.
+        checkpoint_settings.fingerprint = checkpoint_fingerprint(j.dump() + "\nview " + views[0].dump() + " mode " + std::to_string(TraceType) +
+                                                                 " preview " + std::to_string(preview ? preview_scale : 0) + " " + std::to_string(shadow_map_size) +
+                                                                 " roulette " + std::to_string(path_settings.rr_start_depth) + " " + std::to_string(path_settings.max_path_length) +
+                                                                 " emitters " + std::to_string(sample_emitters));
+        renderer->options.path = path_settings;
+    }
+    if (resume && access(checkpoint_file.c_str(), F_OK) != 0)
+        std::cout << "No checkpoint at " << checkpoint_file << " yet; starting from the first sample.\n";
+    else if (resume)
+    {
+        std::string resume_error;
+        first_sample = renderer->resume_checkpoint(framebuffer, job, samples_per_pixel, checkpoint_settings, resume_error);
+        if (first_sample < 0)
+        {
+            std::cout << "Cannot resume: " << resume_error << std::endl;
+            return 1;
         }
+        std::cout << "Resuming from " << checkpoint_file << " at " << first_sample << " of " << samples_per_pixel << " samples per pixel\n";
+    }
 
-        return lighting;
-        // return texColor * lighting;  code for texture that is not working
+    StreamingImageWriter stream_writer;
+    if (stream_rows > 0 && !stream_writer.open(outfile, width, height))
+    {
+        std::cout << "Could not write " << outfile << std::endl;
+        return 1;
     }
 
-    return background_color;
-}
+    std::vector<NumaNodeStats> numa_stats;
+    std::vector<ViewStats> view_stats;
+    std::cout << "\n\nRendering...";
+    std::cout << "\n\r";
+    auto start = std::chrono::high_resolution_clock::now();
 
-void render_image(std::vector<Color> &framebuffer, Camera &camera, const BVHNode &world, const std::vector<Light> &lights, const Color &background_color, int width, int height, int samples_per_pixel, int max_depth, int TraceType)
-{
-    for (int y = 0; y < height; ++y)
+    if (workers > 0)
+    {
+        if (progressive)
+            std::cout << "Progressive options are ignored with --workers.\n";
+        if (!run_coordinator(argv[0], worker_args, workers, tile_size, framebuffer, width, height))
+            return 1;
+    }
+    else if (stream_rows > 0)
     {
-        for (int x = 0; x < width; ++x)
+        StreamingResult streamed = render_streaming(stream_writer, width, height, stream_rows, samples_per_pixel, tone,
+                                                    [&](std::vector<Color> &band, const Region &r)
+                                                    { render_into(band, r.y0, r, 0, samples_per_pixel); });
+        if (!streamed.ok || !stream_writer.finish())
         {
-            Color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s)
+            std::cout << "Could not write " << outfile << std::endl;
+            return 1;
+        }
+        std::cout << "Streamed " << streamed.bands << " bands of " << std::min(stream_rows, height) << " rows, "
+                  << stream_writer.bytes_written / (1 << 20) << " MB written, band buffers "
+                  << streamed.peak_buffer_bytes / 1024 << " KB (full framebuffer would be "
+                  << size_t(width) * height * sizeof(Color) / 1024 << " KB)\n";
+    }
+    else if (progressive)
+    {
+        // Without a deadline or a noise target, --samples still bounds the render.
+        bool open_ended = progressive_settings.time_budget > 0 || progressive_settings.target_error > 0;
+        progressive_settings.max_samples = (open_ended && !samples_given) ? 0 : samples_per_pixel;
+        if (snapshot_file.empty())
+            snapshot_file = partial ? "rendered_image.ppm" : outfile;
+
+        renderer->options.path = path_settings;
+        ProgressiveResult progress = renderer->render_progressive(
+            framebuffer, job, progressive_settings,
+            [&](int samples)
             {
-                float u = (x + random_double()) / (width - 1);
-                float v = (y + random_double()) / (height - 1);
-                Ray ray = camera.get_ray(u, v);
-
-                if (TraceType == 1)
-                {
-                    pixel_color += Binary_Ray_Color(ray, world, background_color);
-                }
-                else if (TraceType == 2)
-                {
-                    pixel_color += ray_color_phong(ray, world, lights, background_color, max_depth);
-                }
-            }
-            framebuffer[y * width + x] = pixel_color;
+                save_image(snapshot_file, samples);
+                std::cout << "Snapshot: " << samples << " spp -> " << snapshot_file << std::endl;
+            },
+            &path_stats);
+
+        samples_per_pixel = progress.samples;
+        std::cout << "Progressive: " << progress.passes << " passes, " << progress.samples << " spp, stopped by "
+                  << progress.stop_reason;
+        if (progressive_settings.target_error > 0)
+            std::cout << " (noise estimate " << progress.error << ")";
+        std::cout << "\n";
+    }
+    else if (numa_render)
+    {
+        numa_stats = render_tiles_numa(renderer->pool(), framebuffer, width, region, tile_size,
+                                       [&](size_t node, const Region &tile, std::vector<Color> &band, int band_first_row)
+                                       {
+                                           const Hittable &node_world = replicas.empty() ? *world : *replicas[node];
+                                           render_image(band, camera, node_world, lights, background_color, width, height, 0, samples_per_pixel,
+                                                        max_depth, TraceType, tile, nullptr, band_first_row, path_settings.sampler, nullptr, visibility.get());
+                                       });
+    }
+    else if (batch)
+    {
+        renderer->options.path = path_settings;
+        view_stats = renderer->render_batch(job, view_cameras,
+                                            [&](size_t v, std::vector<Color> &image)
+                                            {
+                                                std::string path = numbered_path(outfile, v, views.size());
+                                                if (!write_image(path, image, width, height, samples_per_pixel, tone))
+                                                    std::cout << "Could not write " << path << std::endl;
+                                            },
+                                            &path_stats);
+    }
+    else if (checkpointing)
+    {
+        CheckpointedResult checkpointed = renderer->render_checkpointed(framebuffer, job, first_sample, samples_per_pixel,
+                                                                        checkpoint_settings, &path_stats);
+        if (checkpointed.stopped)
+        {
+            std::cout << "Stopped at " << checkpointed.samples << " of " << samples_per_pixel << " samples per pixel; ";
+            if (checkpointed.write_failed)
+                std::cout << "could not write " << checkpoint_file << std::endl;
+            else
+                std::cout << "checkpoint saved to " << checkpoint_file << ", --resume continues from it." << std::endl;
+            return 1;
         }
+        if (checkpointed.write_failed)
+            std::cout << "Could not write " << checkpoint_file << "\n";
+        std::cout << "Checkpoints: " << checkpointed.written << " written to " << checkpoint_file << " ("
+                  << framebuffer.size() * (sizeof(Color) + sizeof(uint32_t)) / 1024 << " KB each)\n";
+    }
+    else
+    {
+        render_samples(region, 0, samples_per_pixel);
     }
-}
 
-std::future<std::vector<Light>> async_parseLights(const json &j)
-{
-    return std::async(std::launch::async, [](const json &j)
-                      {
-        std::vector<Light> lights;
-        parseLights(j, lights);
-        return lights; }, j);
-}
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    std::cout << "Render Time: " << elapsed.count() << " seconds\n";
 
-std::future<Camera> async_parseCamera(const json &j)
-{
-    return std::async(std::launch::async, parseCamera, j);
-}
+    for (size_t n = 0; n < numa_stats.size(); ++n)
+        std::cout << "NUMA node " << renderer->pool().nodes()[n].id << ": " << numa_stats[n].rows << " rows, " << numa_stats[n].tiles
+                  << " tiles (" << numa_stats[n].stolen << " from other nodes), " << numa_stats[n].busy_seconds / renderer->pool().nodes()[n].cpus.size()
+                  << " seconds busy per thread\n";
+    if (numa_render)
+        std::cout << "NUMA render: " << renderer->pool().pinned() << " of " << renderer->pool().size() << " threads pinned, "
+                  << region.area() * samples_per_pixel / elapsed.count() / 1e6 << " Msamples/s\n";
 
-std::future<hittable_list> async_parseScene(const json &j)
-{
-    return std::async(std::launch::async, [](const json &j)
-                      {
-        hittable_list world;
-        parseScene(j, world);
-        return world; }, j);
-}
+    if (visibility)
+    {
+        VisibilityCounts counts = visibility->counts();
+        double samples = std::max<double>(1, counts.resolved + counts.background + counts.traced);
+        std::cout << "Camera samples: " << 100.0 * counts.resolved / samples << "% resolved from the visibility buffer, "
+                  << 100.0 * counts.background / samples << "% background, " << 100.0 * counts.traced / samples << "% traced\n";
+    }
 
-int main(int argc, char *argv[])
-{
-    if (argc < 2)
+    if (path_stats.extension_rays > 0)
     {
-        std::cout << "Input the JSON file too..." << std::endl;
-        return 1;
+        std::cout << "Path rays: " << path_stats.extension_rays
+                  << " (" << path_stats.camera_rays << " camera), shadow rays: " << path_stats.shadow_rays;
+        if (path_stats.emitter_rays > 0)
+            std::cout << " (" << path_stats.emitter_rays << " to emissive shapes)";
+        std::cout << ", stopped by roulette: " << path_stats.roulette_kills
+                  << ", " << (path_stats.extension_rays + path_stats.shadow_rays) / elapsed.count() / 1e6 << " Mrays/s\n";
+        std::cout << "Extend stage: " << path_stats.extend_seconds << " s";
+        if (path_settings.sort_secondary_rays)
+            std::cout << ", ray sorting: " << path_stats.sort_seconds << " s";
+        std::cout << "\n";
     }
 
-    std::ifstream file(argv[1]);
-    json j;
-    file >> j;
+    TextureCacheStats texture_stats = TextureCache::shared().stats();
+    if (texture_stats.lookups > 0)
+    {
+        std::cout << "Texture tiles: " << texture_stats.lookups << " cache lookups, "
+                  << texture_stats.misses << " loaded (" << texture_stats.bytes_read / 1024 << " KB), "
+                  << texture_stats.evictions << " evicted, "
+                  << texture_stats.resident_bytes / 1024 << " KB resident of "
+                  << TextureCache::shared().budget() / 1024 << " KB budget\n";
+    }
 
-    auto camera_future = async_parseCamera(j);
-    auto lights_future = async_parseLights(j);
-    auto scene_future = async_parseScene(j);
+    GeometryCacheStats geometry_stats = GeometryCache::shared().stats();
+    if (geometry_stats.lookups > 0)
+    {
+        std::cout << "Geometry chunks: " << geometry_stats.lookups << " cache lookups, "
+                  << geometry_stats.page_ins << " paged in (" << geometry_stats.bytes_read / 1024 << " KB read), "
+                  << geometry_stats.evictions << " evicted, "
+                  << geometry_stats.resident_bytes / 1024 << " KB resident of "
+                  << GeometryCache::shared().budget() / 1024 << " KB budget\n";
+    }
 
-    Camera camera = camera_future.get();
-    hittable_list world = scene_future.get();
-    std::vector<Light> lights = lights_future.get();
+    ShadowCacheStats shadow_stats = ShadowCache::stats();
+    if (shadow_stats.lookups > 0)
+    {
+        std::cout << "Shadow rays: " << shadow_stats.lookups
+                  << ", occluder cache hits: " << shadow_stats.cache_hits
+                  << " (" << 100.0 * shadow_stats.hit_rate() << "% of all, "
+                  << 100.0 * shadow_stats.occluded_hit_rate() << "% of occluded)"
+                  << ", BVH traversals: " << shadow_stats.traversals << "\n";
+    }
 
-    std::vector<std::shared_ptr<Hittable>> objects;
-    parseScene(j, objects);
+    if (batch)
+    {
+        double samples = double(width) * height * samples_per_pixel;
+        for (size_t v = 0; v < view_stats.size(); ++v)
+            std::cout << "View " << v << ": " << view_stats[v].tiles << " tiles, " << view_stats[v].started << "-"
+                      << view_stats[v].finished << " s, " << view_stats[v].busy_seconds << " thread-seconds, "
+                      << samples / view_stats[v].busy_seconds / 1e6 << " Msamples/s per thread -> "
+                      << numbered_path(outfile, v, views.size()) << "\n";
+        std::cout << "Batch: " << views.size() << " views in " << elapsed.count() << " seconds, "
+                  << views.size() / elapsed.count() << " views/s, " << samples * views.size() / elapsed.count() / 1e6
+                  << " Msamples/s" << std::endl;
+        return 0;
+    }
 
-    BVHNode bvh_tree(objects, 0, objects.size(), 0.0, 0);
+    if (partial)
+    {
+        // Raw sums for merge_tiles, which normalises once all parts are in.
+        if (outfile.empty())
+            outfile = "rendered_part_" + std::to_string(region.x0) + "_" + std::to_string(region.y0) + "_" +
+                      std::to_string(region.x1) + "_" + std::to_string(region.y1) + ".cgrp";
+        std::FILE *part_file = std::fopen(outfile.c_str(), "wb");
+        if (!part_file || !write_partial(part_file, extract_region(framebuffer, width, height, samples_per_pixel, region, tone_settings)))
+        {
+            std::cout << "Could not write " << outfile << std::endl;
+            return 1;
+        }
+        std::fclose(part_file);
+        std::cout << "Partial render saved to " << outfile << std::endl;
+        // The finished render supersedes its checkpoint.
+        if (checkpointing)
+            std::remove(checkpoint_file.c_str());
+        return 0;
+    }
 
-    Color background_color = j["scene"].contains("backgroundcolor") ? Color(j["scene"]["backgroundcolor"]) : Color(0.25, 0.25, 0.25);
+    if (stream_rows > 0)
+    {
+        std::cout << "Rendering complete. Image saved to " << outfile << std::endl;
+        return 0;
+    }
 
-    std::cout << "Press 1 for Binary-RayTracing, 2 for Blinn-Phong-RayTracing: ";
-    int TraceType;
-    std::cin >> TraceType;
-    std::cout << "\n\nRendering...";
-    std::cout << "\n\r";
-    int width = j["camera"]["width"];
-    int height = j["camera"]["height"];
-    int samples_per_pixel = 10;
-    int max_depth = 5;
-    std::vector<Color> framebuffer(width * height);
-    auto start = std::chrono::high_resolution_clock::now();
+    if (save_aovs)
+    {
+        std::string base = outfile.size() > 4 && outfile.compare(outfile.size() - 4, 4, ".ppm") == 0 ? outfile.substr(0, outfile.size() - 4) : outfile;
+        if (write_aov_images(base, framebuffer, aovs, width, height, samples_per_pixel))
+            std::cout << "AOVs saved to " << base << "_{albedo,normal,depth,variance}.ppm\n";
+        else
+            std::cout << "Could not write the AOV images\n";
+    }
 
-    render_image(framebuffer, camera, bvh_tree, lights, background_color, width, height, samples_per_pixel, max_depth, TraceType);
+    if (denoise)
+    {
+        auto denoise_start = std::chrono::high_resolution_clock::now();
+        denoise_atrous(framebuffer, aovs, width, height, samples_per_pixel);
+        std::chrono::duration<double> denoise_time = std::chrono::high_resolution_clock::now() - denoise_start;
+        std::cout << "Denoise Time: " << denoise_time.count() << " seconds\n";
+    }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = end - start;
-    std::cout << "Render Time: " << elapsed.count() << " seconds\n";
+    if (!save_image(outfile, samples_per_pixel))
+    {
+        std::cout << "Could not write " << outfile << std::endl;
+        return 1;
+    }
 
-    char outfile[] = "rendered_image.ppm";
-    std::ofstream out(outfile);
-    out << "P3\n"
-        << width << ' ' << height << "\n255\n";
+    std::cout << "Rendering complete. Image saved to " << outfile << std::endl;
+    if (checkpointing)
+        std::remove(checkpoint_file.c_str());
 
-    for (const Color &color : framebuffer)
+    if (preview_check)
     {
-        write_color(out, color, samples_per_pixel, j["camera"]["exposure"]);
+        // The exact image the preview stands in for: full size, traced shadows.
+        std::vector<Light> exact_lights = lights;
+        for (Light &light : exact_lights)
+            light.shadow_map = nullptr;
+        Camera exact_camera = camera;
+        exact_camera.height = output_height;
+        int exact_samples = samples_given ? samples_per_pixel : 10;
+        std::vector<Color> exact(size_t(output_width) * output_height, Color(0, 0, 0));
+        auto exact_start = std::chrono::high_resolution_clock::now();
+        render_image(exact, exact_camera, *world, exact_lights, background_color, output_width, output_height, 0, exact_samples,
+                     max_depth, TraceType, Region::full(output_width, output_height), nullptr, 0, path_settings.sampler);
+        std::chrono::duration<double> exact_time = std::chrono::high_resolution_clock::now() - exact_start;
+
+        std::vector<unsigned char> exact_pixels = tone.encode_image(exact, output_width, output_height, exact_samples);
+        std::vector<unsigned char> preview_pixels =
+            tone.encode_image(upscale_bilinear(framebuffer, width, height, output_width, output_height), output_width, output_height, samples_per_pixel);
+        double squared = 0;
+        for (size_t k = 0; k < exact_pixels.size(); ++k)
+            squared += (double(exact_pixels[k]) - preview_pixels[k]) * (double(exact_pixels[k]) - preview_pixels[k]);
+        std::cout << "Preview check: exact " << output_width << "x" << output_height << " at " << exact_samples << " spp took "
+                  << exact_time.count() << " seconds (" << exact_time.count() / (elapsed.count() + shadow_map_seconds) << "x the preview with its shadow maps), RMSE "
+                  << std::sqrt(squared / exact_pixels.size()) << " of 255, PSNR " << psnr(preview_pixels, exact_pixels) << " dB" << std::endl;
     }
-    out.close();
 
-    std::cout << "Rendering complete. Image saved to " << outfile << std::endl;
-    return 0;
+    if (!reference_file.empty())
+    {
+        // Compared as written, i.e. after gamma and 8-bit quantisation.
+        int ref_width, ref_height, out_width, out_height;
+        std::vector<unsigned char> ref_pixels, out_pixels;
+        if (!read_ppm(reference_file, ref_width, ref_height, ref_pixels) || !read_ppm(outfile, out_width, out_height, out_pixels))
+            std::cout << "Could not read " << reference_file << " for comparison" << std::endl;
+        else if (ref_width != out_width || ref_height != out_height)
+            std::cout << "Reference " << reference_file << " is " << ref_width << "x" << ref_height << ", not " << out_width << "x" << out_height << std::endl;
+        else
+            std::cout << "PSNR vs " << reference_file << ": " << psnr(out_pixels, ref_pixels) << " dB" << std::endl;
+    }
+    if (!watch)
+        return 0;
+
+    // Watch mode: apply each edit of the scene file and re-render what it affects.
+    std::cout << "Watching " << argv[1] << " for changes (Ctrl-C to stop)" << std::endl;
+    renderer->options.path = path_settings;
+    auto stamp = scene_file_stamp(argv[1]);
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        if (scene_file_stamp(argv[1]) == stamp)
+            continue;
+        stamp = scene_file_stamp(argv[1]);
+        std::ifstream changed_file(argv[1]);
+        json next = json::parse(changed_file, nullptr, false);
+        if (next.is_discarded() || !valid_scene_json(next))
+        {
+            std::cout << argv[1] << " is not a valid scene; keeping the current one." << std::endl;
+            continue;
+        }
+        SceneChanges changes = diff_scenes(j, next);
+        if (changes.empty())
+            continue;
+
+        // The edited shapes, materials and lights are updated in place and
+        // only the tiles they can affect are rendered again.
+        auto reload_start = std::chrono::high_resolution_clock::now();
+        EditResult edit = renderer->apply_edit(scene, j, next, changes, framebuffer, job,
+                                               [&]
+                                               {
+                                                   world = &scene.world();
+                                                   if (changes.camera)
+                                                   {
+                                                       camera = parseCamera(next);
+                                                       if (preview)
+                                                           camera.height = height;
+                                                   }
+                                                   if (preview && (changes.lights || !changes.moved.empty()))
+                                                       build_shadow_maps();
+                                               });
+        if (!edit.reload_reason.empty())
+        {
+            // The simplest full reload: start over with the same arguments.
+            std::cout << "Reloading " << argv[1] << ": " << edit.reload_reason << std::endl;
+            exec_self(argv);
+            std::perror("exec");
+            return 1;
+        }
+        j = std::move(next);
+        if (!save_image(outfile, samples_per_pixel))
+            std::cout << "Could not write " << outfile << std::endl;
+
+        std::chrono::duration<double> reload_time = std::chrono::high_resolution_clock::now() - reload_start;
+        size_t tile_count = size_t((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+        std::cout << "Reload: " << changes.moved.size() << " shapes changed, " << changes.restyled.size() << " materials changed"
+                  << (changes.lights ? ", lights changed" : "") << (changes.camera ? ", camera changed" : "")
+                  << (changes.background ? ", background changed" : "") << " (" << edit.geometry_update << "); "
+                  << edit.tiles << " of " << tile_count << (edit.relit ? " tiles relit from the G-buffer, " : " tiles re-rendered, ") << reload_time.count() << " seconds" << std::endl;
+    }
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -18,9 +19,45 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180;
 }
 
+// Each thread owns its generator state, so parallel stages never contend on
+// rand()'s lock and a path can carry (and restore) its own sample stream.
+inline uint64_t &random_state()
+{
+    thread_local uint64_t state = 0x9E3779B97F4A7C15ULL;
+    return state;
+}
+
+// splitmix64: spreads nearby seeds (pixel indices, pass numbers) apart.
+inline uint64_t hash_seed(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+inline void seed_random(uint64_t seed)
+{
+    uint64_t s = hash_seed(seed);
+    random_state() = s ? s : 0x9E3779B97F4A7C15ULL;
+}
+
+// Stream for one sample of one pixel (pixel = y * width + x). Seeding by
+// position and sample number makes every sample reproducible on its own, no
+// matter how the image or the sample count is split up.
+inline void seed_sample(uint64_t pixel, int sample)
+{
+    seed_random((static_cast<uint64_t>(sample) << 32) | pixel);
+}
+
 inline double random_double()
 {
-    return rand() / (RAND_MAX + 1.0);
+    // xorshift64*
+    uint64_t &s = random_state();
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return ((s * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double random_double(double min, double max)
@@ -37,7 +74,7 @@ inline double clamp(double x, double min, double max)
     return x;
 }
 
-double schlick(double cosine, double ref_idx)
+inline double schlick(double cosine, double ref_idx)
 {
     auto r0 = (1 - ref_idx) / (1 + ref_idx);
     r0 = r0 * r0;
@@ -49,5 +86,3 @@ inline int random_int(int min, int max)
     return static_cast<int>(random_double(min, max + 1));
 }
 
-#include "Ray.hpp"
-#include "Vector3.hpp"